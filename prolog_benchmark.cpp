@@ -0,0 +1,398 @@
+// ============================================================================
+// PROLOG TEXT PARSER BENCHMARKS
+// Purpose: Repeatable timings of the hot paths of prolog_text_parser.cpp at
+//          database sizes from a thousand to hundreds of millions of facts.
+//          Every benchmark is run as a number of samples; a sample times a
+//          batch of operations that is sized to take at least a millisecond.
+//          The report gives the median, p99 and standard deviation of the
+//          time per operation over the samples.
+// Build:   g++ -O2 -pthread -o prolog_benchmark prolog_benchmark.cpp
+// Example: ./prolog_benchmark --sizes 1000,1000000 --samples 30 --filter query
+// ============================================================================
+#define PROLOG_NO_MAIN
+#include "prolog_text_parser.cpp"
+#undef PROLOG_NO_MAIN
+
+#include <random>
+
+// ============================================================================
+// CLASS: BenchmarkRunner
+// Purpose: Times operations and reports per-operation statistics
+// ============================================================================
+struct Measurement {
+    string name;
+    size_t facts;                 // Database size the benchmark ran at
+    uint64_t operations;          // Timed in total
+    double median;                // Nanoseconds per operation
+    double p99;
+    double stddev;
+};
+
+class BenchmarkRunner {
+private:
+    size_t sampleCount = 20;
+    string filter;
+    bool csv = false;
+    vector<Measurement> results;
+    ostream out{cout.rdbuf()};            // Still the terminal while cout is muted
+    
+    static constexpr double MIN_SAMPLE_SECONDS = 1e-3;
+    
+    // Helper function to summarize the per-operation times of the samples
+    static Measurement summarize(const string& name, size_t facts,
+                                 uint64_t operations, vector<double> times) {
+        sort(times.begin(), times.end());
+        size_t n = times.size();
+        double median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+        double p99 = times[min(n - 1, static_cast<size_t>(ceil(0.99 * n)) - 1)];
+        double mean = 0;
+        for (double t : times) mean += t;
+        mean /= n;
+        double variance = 0;
+        for (double t : times) variance += (t - mean) * (t - mean);
+        double stddev = n > 1 ? sqrt(variance / (n - 1)) : 0;
+        return {name, facts, operations, median, p99, stddev};
+    }
+    
+    // Helper function to time calls op(first) .. op(first + count - 1)
+    template <typename Op>
+    static double timeBatch(Op& op, uint64_t first, uint64_t count) {
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < count; i++) op(first + i);
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    void setSamples(size_t count) { sampleCount = max<size_t>(count, 1); }
+    void setFilter(const string& text) { filter = text; }
+    void setCsv(bool enabled) { csv = enabled; }
+    
+    // Whether a benchmark was selected with --filter
+    bool wanted(const string& name) const {
+        return filter.empty() || name.find(filter) != string::npos;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: run
+    // Purpose: Times op(i) for i = 0, 1, ... After a warm-up batch that
+    //          also sizes the batches, takes the configured number of
+    //          samples.
+    // Parameters:
+    //   - name: Benchmark name, as shown in the report
+    //   - facts: Size of the database it runs against
+    //   - op: The operation; i lets it vary its input
+    // ------------------------------------------------------------------------
+    template <typename Op>
+    void run(const string& name, size_t facts, Op op) {
+        if (!wanted(name)) return;
+        
+        // Double the batch until it takes long enough to time reliably
+        uint64_t next = 0;
+        uint64_t batch = 1;
+        for (;;) {
+            double seconds = timeBatch(op, next, batch);
+            next += batch;
+            if (seconds >= MIN_SAMPLE_SECONDS || batch >= (1u << 24)) break;
+            batch *= 2;
+        }
+        
+        vector<double> times;
+        for (size_t s = 0; s < sampleCount; s++) {
+            times.push_back(timeBatch(op, next, batch) * 1e9 / batch);
+            next += batch;
+        }
+        record(summarize(name, facts, batch * sampleCount, times));
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: runOnce
+    // Purpose: Times operations that change what they measure, such as
+    //          growing the database: batch(s) must do the s-th of the
+    //          samples and return how many operations it did. The batches
+    //          run even if --filter leaves the benchmark out of the report.
+    // ------------------------------------------------------------------------
+    template <typename Batch>
+    void runOnce(const string& name, size_t facts, Batch batch) {
+        vector<double> times;
+        uint64_t operations = 0;
+        for (size_t s = 0; s < sampleCount; s++) {
+            auto start = chrono::steady_clock::now();
+            uint64_t done = batch(s);
+            double seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+            if (done == 0) continue;
+            times.push_back(seconds * 1e9 / done);
+            operations += done;
+        }
+        if (!times.empty() && wanted(name)) {
+            record(summarize(name, facts, operations, times));
+        }
+    }
+    
+    // Helper function to print one result as soon as it is known
+    void record(const Measurement& result) {
+        if (results.empty()) {
+            if (csv) {
+                out << "benchmark,facts,operations,median_ns,p99_ns,stddev_ns\n";
+            } else {
+                out << left << setw(34) << "benchmark" << right << setw(11) << "facts"
+                     << setw(14) << "median ns" << setw(14) << "p99 ns"
+                     << setw(14) << "stddev ns" << setw(14) << "ops/s" << "\n";
+            }
+        }
+        results.push_back(result);
+        
+        if (csv) {
+            out << result.name << "," << result.facts << "," << result.operations
+                 << "," << fixed << setprecision(1) << result.median << ","
+                 << result.p99 << "," << result.stddev << defaultfloat << "\n";
+        } else {
+            out << left << setw(34) << result.name << right << setw(11) << result.facts
+                 << fixed << setprecision(1) << setw(14) << result.median
+                 << setw(14) << result.p99 << setw(14) << result.stddev
+                 << setprecision(0) << setw(14) << 1e9 / max(result.median, 1e-3)
+                 << defaultfloat << setprecision(6) << "\n";
+        }
+        out.flush();
+    }
+};
+
+// ============================================================================
+// CLASS: BenchmarkDataset
+// Purpose: Fills a database with a reproducible family-and-places data set
+//          of the shape the sentence patterns produce:
+//          parent/2 (40%), likes/2 (30%), lives_in/2 (20%), tall/1 (10%).
+//          People are p0 .. pK with K = facts / 8, so a bound lookup finds a
+//          handful of facts.
+// ============================================================================
+class BenchmarkDataset {
+private:
+    size_t people;
+
+public:
+    explicit BenchmarkDataset(size_t facts) : people(max<size_t>(facts / 8, 16)) {}
+    
+    size_t personCount() const { return people; }
+    
+    string person(size_t k) const { return "p" + to_string(k % people); }
+    string thing(size_t k) const { return "t" + to_string(k % (people / 4 + 1)); }
+    string city(size_t k) const { return "c" + to_string(k % 1000); }
+    
+    // Adds fact number k; the same k always gives the same fact
+    void addFact(PrologDatabase& db, uint64_t k) {
+        uint64_t r = mixHash(k + 1);
+        string_view args[2];
+        string first = person(r >> 8);
+        string second;
+        args[0] = first;
+        switch (r % 10) {
+            case 0: case 1: case 2: case 3:
+                second = person(r >> 32);
+                args[1] = second;
+                db.addFact("parent", args, 2);
+                break;
+            case 4: case 5: case 6:
+                second = thing(r >> 32);
+                args[1] = second;
+                db.addFact("likes", args, 2);
+                break;
+            case 7: case 8:
+                second = city(r >> 32);
+                args[1] = second;
+                db.addFact("lives_in", args, 2);
+                break;
+            default:
+                db.addFact("tall", args, 1);
+        }
+    }
+    
+    // A stored parent/2 fact, to build queries that find something
+    pair<string, string> parentFact(uint64_t k) const {
+        uint64_t r = mixHash(k + 1);
+        while (r % 10 > 3) r = mixHash(++k + 1);
+        return {person(r >> 8), person(r >> 32)};
+    }
+};
+
+// ============================================================================
+// FUNCTION: benchmarkSize
+// Purpose: Runs every benchmark against a database of the given size
+// ============================================================================
+static void benchmarkSize(BenchmarkRunner& runner, size_t facts, size_t samples) {
+    PrologDatabase db;
+    db.setVerbose(false);
+    BenchmarkDataset data(facts);
+    
+    // addFact: grow the database to its size, one sample per slice
+    uint64_t added = 0;
+    runner.runOnce("addFact", facts, [&](size_t s) {
+        uint64_t end = facts * (s + 1) / samples;
+        uint64_t begin = added;
+        for (; added < end; added++) data.addFact(db, added);
+        return added - begin;
+    });
+    for (; added < facts; added++) data.addFact(db, added);
+    
+    // Query keys: stored facts picked at random, so lookups find something
+    const size_t KEYS = 4096;
+    vector<pair<string, string>> keys;
+    mt19937_64 random(7);
+    for (size_t k = 0; k < KEYS; k++) {
+        keys.push_back(data.parentFact(random() % max<size_t>(facts, 1)));
+    }
+    auto key = [&](uint64_t i) -> const pair<string, string>& { return keys[i % KEYS]; };
+    
+    // query in each binding mode of parent/2
+    size_t rows = 0;
+    runner.run("query parent(+,?)", facts, [&](uint64_t i) {
+        rows += db.query("parent", {key(i).first, "?"}).size();
+    });
+    runner.run("query parent(?,+)", facts, [&](uint64_t i) {
+        rows += db.query("parent", {"?", key(i).second}).size();
+    });
+    runner.run("query parent(+,+)", facts, [&](uint64_t i) {
+        rows += db.query("parent", {key(i).first, key(i).second}).size();
+    });
+    runner.run("query parent(+,+) miss", facts, [&](uint64_t i) {
+        rows += db.query("parent", {key(i).second, "nobody"}).size();
+    });
+    runner.run("query tall(+)", facts, [&](uint64_t i) {
+        rows += db.query("tall", {key(i).first}).size();
+    });
+    runner.run("query parent(?,?)", facts, [&](uint64_t) {
+        rows += db.query("parent", {"?", "?"}).size();
+    });
+    
+    // processQuery for each question pattern
+    QueryEngine engine(db);
+    NullBuffer nullBuffer;
+    ostream nullStream(&nullBuffer);
+    engine.setOutput(nullStream);
+    const vector<pair<string, string>> questions = {
+        {"processQuery who is", "Who is the parent of %2?"},
+        {"processQuery what does", "What does %1 like?"},
+        {"processQuery where does", "Where does %1 live?"},
+        {"processQuery is property", "Is %1 tall?"},
+        {"processQuery is relation", "Is %1 the parent of %2?"},
+    };
+    for (const auto& question : questions) {
+        vector<string> texts;
+        for (size_t k = 0; k < KEYS; k++) {
+            string text = question.second;
+            for (size_t at; (at = text.find("%1")) != string::npos;) {
+                text.replace(at, 2, keys[k].first);
+            }
+            for (size_t at; (at = text.find("%2")) != string::npos;) {
+                text.replace(at, 2, keys[k].second);
+            }
+            texts.push_back(text);
+        }
+        runner.run(question.first, facts, [&](uint64_t i) {
+            engine.processQuery(texts[i % KEYS]);
+        });
+    }
+    
+    // parseText for each sentence pattern. These add facts, so they run
+    // after the read benchmarks.
+    TextParser parser(db);
+    parser.setVerbose(false);
+    const vector<pair<string, string>> sentences = {
+        {"parseText relation", "P%1 is the parent of P%2"},
+        {"parseText likes", "P%1 likes pizza"},
+        {"parseText lives in", "P%1 lives in Paris"},
+        {"parseText property", "P%1 is tall"},
+        {"parseText paragraph", "P%1 likes music. P%2 lives in Rome. P%1 is smart."},
+    };
+    for (const auto& sentence : sentences) {
+        vector<string> texts;
+        for (size_t k = 0; k < KEYS; k++) {
+            string text = sentence.second;
+            for (size_t at; (at = text.find("%1")) != string::npos;) {
+                text.replace(at, 2, to_string(k % data.personCount()));
+            }
+            for (size_t at; (at = text.find("%2")) != string::npos;) {
+                text.replace(at, 2, to_string((k * 7) % data.personCount()));
+            }
+            texts.push_back(text);
+        }
+        runner.run(sentence.first, facts, [&](uint64_t i) {
+            rows += parser.parseText(texts[i % KEYS]);
+        });
+    }
+    
+    // Listing the whole database, per fact listed
+    uint64_t listed = 0;
+    {
+        PrologDatabase::Snapshot view = db.snapshot();
+        auto all = [](string_view, size_t) { return true; };
+        for (const auto& range : db.factRanges(all, SIZE_MAX)) {
+            db.forEachFact(range, view, [&](const string_view*) { listed++; });
+        }
+    }
+    if (runner.wanted("printDatabase")) {
+        streambuf* saved = cout.rdbuf(&nullBuffer);
+        runner.runOnce("printDatabase", facts, [&](size_t) {
+            db.printDatabase();
+            return listed;
+        });
+        cout.rdbuf(saved);
+    }
+    const vector<pair<string, ExportFormat>> formats = {
+        {"export prolog", ExportFormat::Prolog},
+        {"export csv", ExportFormat::Csv},
+        {"export jsonl", ExportFormat::JsonLines},
+    };
+    for (const auto& format : formats) {
+        if (!runner.wanted(format.first)) continue;
+        FactExporter exporter(db);
+        exporter.setFormat(format.second);
+        runner.runOnce(format.first, facts, [&](size_t) {
+            return exporter.exportTo("/dev/null");
+        });
+    }
+    
+    // Keeps the results observable, so no query is optimized away
+    if (rows == SIZE_MAX) cerr << rows;
+}
+
+// ============================================================================
+// MAIN FUNCTION
+// Purpose: Parses the options and runs the benchmarks for every size
+// ============================================================================
+int main(int argc, char* argv[]) {
+    vector<size_t> sizes = {1000, 100000, 1000000};
+    size_t samples = 20;
+    BenchmarkRunner runner;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes.clear();
+            stringstream list(argv[++i]);
+            for (string size; getline(list, size, ',');) {
+                // Accepts 1000, 10k, 5M
+                char* end;
+                double value = strtod(size.c_str(), &end);
+                if (*end == 'k' || *end == 'K') value *= 1e3;
+                if (*end == 'm' || *end == 'M') value *= 1e6;
+                if (value >= 1) sizes.push_back(static_cast<size_t>(value));
+            }
+        } else if (arg == "--samples" && i + 1 < argc) {
+            samples = max<size_t>(strtoul(argv[++i], nullptr, 10), 1);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            runner.setFilter(argv[++i]);
+        } else if (arg == "--csv") {
+            runner.setCsv(true);
+        } else {
+            cerr << "Unknown option: " << arg << "\n";
+            cerr << "Usage: " << argv[0]
+                 << " [--sizes N,N,...] [--samples N] [--filter TEXT] [--csv]\n";
+            return 1;
+        }
+    }
+    runner.setSamples(samples);
+    
+    for (size_t facts : sizes) {
+        benchmarkSize(runner, facts, samples);
+    }
+    return 0;
+}
@@ -0,0 +1,648 @@
+// ============================================================================
+// PROLOG TEXT PARSER TESTS
+// Purpose: Checks of the parts of prolog_text_parser.cpp that can break
+//          quietly: persistence round trips and damaged files, reading
+//          and writing Prolog source, and answering questions. Every test
+//          works on fresh databases and temporary files, so the tests can
+//          run in any order.
+// Build:   g++ -O2 -pthread -o prolog_tests prolog_tests.cpp
+// Example: ./prolog_tests            (exits with status 1 if a check fails)
+// ============================================================================
+#define PROLOG_NO_MAIN
+#include "prolog_text_parser.cpp"
+#undef PROLOG_NO_MAIN
+
+// ============================================================================
+// CLASS: TestRunner
+// Purpose: Runs named tests and counts the checks that fail
+// ============================================================================
+class TestRunner {
+private:
+    string current;                       // Test being run
+    size_t checks = 0;
+    size_t failures = 0;
+
+public:
+    // Records one check; a failure is reported with the test's name
+    void check(bool passed, const string& what) {
+        checks++;
+        if (passed) return;
+        failures++;
+        cerr << "FAILED " << current << ": " << what << "\n";
+    }
+
+    // Checks that op() throws runtime_error
+    template <typename Op>
+    void checkThrows(Op op, const string& what) {
+        bool thrown = false;
+        try {
+            op();
+        } catch (const runtime_error&) {
+            thrown = true;
+        }
+        check(thrown, what + " throws");
+    }
+
+    // Runs test(*this); an exception fails the test
+    template <typename Test>
+    void run(const string& name, Test test) {
+        current = name;
+        size_t before = failures;
+        try {
+            test(*this);
+        } catch (const exception& e) {
+            failures++;
+            cerr << "FAILED " << name << ": unexpected exception: " << e.what() << "\n";
+        }
+        cout << (failures == before ? "ok    " : "FAIL  ") << name << "\n";
+    }
+
+    // Prints the totals; returns the exit status
+    int finish() const {
+        cout << checks << " checks, " << failures << " failed\n";
+        return failures ? 1 : 0;
+    }
+};
+
+// ============================================================================
+// UTILITY: Test helpers
+// ============================================================================
+
+// A path for a temporary file, removed first if an earlier run left it
+static string tempPath(const string& name) {
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir && *dir ? dir : "/tmp") + "/prolog_tests_" + name;
+    remove(path.c_str());
+    return path;
+}
+
+static string readFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static void writeFile(const string& path, const string& bytes) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+// Every fact of a predicate/arity as sorted "a,b,c" lines, for comparisons
+static vector<string> factsOf(PrologDatabase& db, const string& predicate,
+                              size_t arity) {
+    vector<string> lines;
+    for (const auto& fact : db.query(predicate, vector<string>(arity, "?"))) {
+        string line;
+        for (size_t i = 0; i < fact.size(); i++) {
+            if (i) line += ",";
+            line += fact[i];
+        }
+        lines.push_back(line);
+    }
+    sort(lines.begin(), lines.end());
+    return lines;
+}
+
+// ============================================================================
+// TESTS: Snapshots and the write-ahead log
+// ============================================================================
+static void testPersistence(TestRunner& tests) {
+    tests.run("snapshot save -> load", [](TestRunner& t) {
+        string path = tempPath("save_load.snapshot");
+        {
+            PrologDatabase db(2);
+            db.setVerbose(false);
+            db.addFact("parent", {"tom", "bob"});
+            db.addFact("parent", {"bob", "ann"});
+            db.addFact("parent", {"ann", "joe"});
+            db.addFact("likes", {"ann", "pizza"});
+            db.addFact("tall", {"joe"});
+            db.retract("parent", {"bob", "ann"});
+            db.save(path);
+        }
+        PrologDatabase loaded(2);
+        loaded.setVerbose(false);
+        loaded.load(path);
+        t.check(factsOf(loaded, "parent", 2) == vector<string>{"ann,joe", "tom,bob"},
+                "parent/2 comes back without the retracted fact");
+        t.check(factsOf(loaded, "likes", 2) == vector<string>{"ann,pizza"}, "likes/2");
+        t.check(factsOf(loaded, "tall", 1) == vector<string>{"joe"}, "tall/1");
+        t.check(loaded.query("parent", {"tom", "?"}).size() == 1,
+                "indexed lookup on a loaded relation");
+
+        // The loaded database still takes changes
+        loaded.addFact("parent", {"joe", "sam"});
+        loaded.retract("parent", {"tom", "bob"});
+        t.check(factsOf(loaded, "parent", 2) == vector<string>{"ann,joe", "joe,sam"},
+                "changes on top of a snapshot");
+        remove(path.c_str());
+    });
+
+    tests.run("write-ahead log -> replay", [](TestRunner& t) {
+        string path = tempPath("replay.log");
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            t.check(db.openLog(path) == 0, "a new log replays nothing");
+            db.addFact("parent", {"tom", "bob"});
+            FactBatch batch;
+            string_view first[] = {"bob", "ann"};
+            string_view second[] = {"ann", "joe"};
+            batch.add("parent", first, 2);
+            batch.add("parent", second, 2);
+            db.addFacts(batch);
+            db.retract("parent", {"tom", "bob"});
+        }
+        PrologDatabase replayed;
+        replayed.setVerbose(false);
+        t.check(replayed.openLog(path) == 4, "every add and retract is replayed");
+        t.check(factsOf(replayed, "parent", 2) == vector<string>{"ann,joe", "bob,ann"},
+                "replayed facts");
+        remove(path.c_str());
+    });
+
+    tests.run("checkpoint -> empty log", [](TestRunner& t) {
+        string snapshotPath = tempPath("checkpoint.snapshot");
+        string logPath = tempPath("checkpoint.log");
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            db.openLog(logPath);
+            db.addFact("likes", {"ann", "pizza"});
+            db.addFact("likes", {"bob", "pasta"});
+            db.checkpoint(snapshotPath);
+            t.check(readFile(logPath).empty(), "the checkpoint empties the log");
+            db.addFact("likes", {"joe", "soup"});
+        }
+        PrologDatabase restored;
+        restored.setVerbose(false);
+        restored.load(snapshotPath);
+        t.check(restored.openLog(logPath) == 1,
+                "only the change after the checkpoint is replayed");
+        t.check(factsOf(restored, "likes", 2) ==
+                    vector<string>{"ann,pizza", "bob,pasta", "joe,soup"},
+                "snapshot plus log");
+        remove(snapshotPath.c_str());
+        remove(logPath.c_str());
+    });
+
+    tests.run("torn write-ahead log", [](TestRunner& t) {
+        string path = tempPath("torn.log");
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            db.openLog(path);
+            db.addFact("tall", {"tom"});
+            db.addFact("tall", {"bob"});
+            db.addFact("tall", {"ann"});
+        }
+        string bytes = readFile(path);
+        writeFile(path, bytes.substr(0, bytes.size() - 3));
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            t.check(db.openLog(path) == 2, "a torn last record is dropped");
+            t.check(readFile(path).size() == bytes.size() * 2 / 3,
+                    "the log is cut back to the last good record");
+            db.addFact("tall", {"joe"});
+        }
+        PrologDatabase db;
+        db.setVerbose(false);
+        t.check(db.openLog(path) == 3, "new records follow the last good one");
+        t.check(factsOf(db, "tall", 1) == vector<string>{"bob", "joe", "tom"},
+                "facts after the repair");
+        remove(path.c_str());
+    });
+
+    tests.run("corrupt write-ahead log record", [](TestRunner& t) {
+        string path = tempPath("corrupt.log");
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            db.openLog(path);
+            db.addFact("tall", {"tom"});
+            db.addFact("tall", {"bob"});
+            db.addFact("tall", {"ann"});
+        }
+        string bytes = readFile(path);
+        bytes[bytes.size() / 2] ^= 0x40;  // Inside the second record
+        writeFile(path, bytes);
+        PrologDatabase db;
+        db.setVerbose(false);
+        t.check(db.openLog(path) == 1, "replay stops at the bad checksum");
+        t.check(factsOf(db, "tall", 1) == vector<string>{"tom"}, "facts before it");
+        remove(path.c_str());
+    });
+
+    tests.run("damaged snapshot", [](TestRunner& t) {
+        string path = tempPath("damaged.snapshot");
+        {
+            PrologDatabase db;
+            db.setVerbose(false);
+            for (int i = 0; i < 100; i++) {
+                db.addFact("parent", {"p" + to_string(i), "p" + to_string(i + 1)});
+            }
+            db.save(path);
+        }
+        string bytes = readFile(path);
+
+        string flipped = bytes;
+        flipped[flipped.size() / 2] ^= 0x01;
+        writeFile(path, flipped);
+        t.checkThrows([&] { PrologDatabase db; db.load(path); },
+                      "a flipped bit");
+
+        writeFile(path, bytes.substr(0, bytes.size() - 8));
+        t.checkThrows([&] { PrologDatabase db; db.load(path); },
+                      "a truncated file");
+
+        writeFile(path, bytes.substr(0, 16));
+        t.checkThrows([&] { PrologDatabase db; db.load(path); },
+                      "a file shorter than the header");
+
+        writeFile(path, "parent(tom, bob).\n");
+        t.checkThrows([&] { PrologDatabase db; db.load(path); },
+                      "a file that is not a snapshot");
+
+        writeFile(path, bytes);
+        PrologDatabase db;
+        db.load(path);
+        t.check(db.query("parent", {"p41", "?"}).size() == 1,
+                "the undamaged file still loads");
+        remove(path.c_str());
+    });
+}
+
+// ============================================================================
+// TESTS: Consulting Prolog source
+// ============================================================================
+
+// Consults source into db with errors collected in messages
+static ConsultStats consultInto(PrologDatabase& db, const string& source,
+                                string* messages = nullptr) {
+    ostringstream errors;
+    PrologReader reader(db);
+    reader.setErrorStream(&errors);
+    reader.consultText(source, "test.pl");
+    if (messages) *messages = errors.str();
+    return reader.stats();
+}
+
+static void testConsult(TestRunner& tests) {
+    tests.run("quoted atoms and escapes", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        string messages;
+        consultInto(db,
+            "q(plain, 'New York', 'it''s', 'a\\nb', 'tab\\there').\n"
+            "q('\\x41\\', '\\101\\', '\\x6c\\\\x6F\\', 'back\\\\slash', 'q\\'uote').\n"
+            "q(\"string\", `codes`, 'line\\\ncontinued', '', '\\\"').\n",
+            &messages);
+        t.check(messages.empty(), "no errors: " + messages);
+        t.check(factsOf(db, "q", 5) == vector<string>{
+                    "A,A,lo,back\\slash,q'uote",
+                    "plain,New York,it's,a\nb,tab\there",
+                    "string,codes,linecontinued,,\""},
+                "decoded arguments");
+        t.check(db.query("q", {"A", "?", "?", "?", "?"}).size() == 1,
+                "a hex escape closed by a backslash keeps the closing quote");
+    });
+
+    tests.run("operators", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        ConsultStats stats = consultInto(db,
+            "e(1 + 2 * 3).\n"
+            "e((1 + 2) * 3).\n"
+            "e(1 - 2 - 3).\n"
+            "e(2 ^ 3 ^ 4).\n"
+            "e(- 1).\n"
+            "e(-1).\n"
+            "e(- a).\n"
+            "e(a = b).\n"
+            "e(\\+ a).\n"
+            "e(- (1)).\n"
+            "e(f(a, (b, c))).\n"
+            "grandparent(X, Z) :- parent(X, Y), parent(Y, Z).\n"
+            ":- dynamic e/1.\n"
+            "s --> [a], s.\n"
+            "v(X).\n");
+        t.check(factsOf(db, "e", 1) == vector<string>{
+                    "*(+(1,2),3)", "+(1,*(2,3))", "-(-(1,2),3)", "-(1)", "-(1)",
+                    "-(a)", "-1", "=(a,b)", "\\+(a)", "^(2,^(3,4))",
+                    "f(a,','(b,c))"},
+                "canonical forms");
+        t.check(stats.facts == 11, "facts stored");
+        t.check(stats.rules == 2, "a rule and a DCG rule counted");
+        t.check(stats.directives == 1, "a directive counted");
+        t.check(stats.nonGround == 1, "a fact with a variable counted");
+        t.check(stats.errors == 0, "no errors");
+    });
+
+    tests.run("lists and special atoms", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        consultInto(db,
+            "l([a, b, c]).\n"
+            "l([a | b]).\n"
+            "l([a, b | [c]]).\n"
+            "l([]).\n"
+            "l('[]').\n"
+            "l({a, b}).\n"
+            "l([[1], [2, 3]]).\n"
+            "l(['A b', \"s\"]).\n");
+        t.check(factsOf(db, "l", 1) == vector<string>{
+                    "['A b',\"s\"]", "[[1],[2,3]]", "[]", "[]", "[a,b,c]",
+                    "[a,b,c]", "[a|b]", "{}(','(a,b))"},
+                "canonical lists");
+    });
+
+    tests.run("error recovery and line numbers", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        string messages;
+        ConsultStats stats = consultInto(db,
+            "ok(1).\n"
+            "bad(1 2).\n"
+            "ok(2). bad('\\q').\n"
+            "ok(3).\n"
+            "bad('\\x1234\\'). ok(4).\n"
+            "/* comment\n"
+            "   over lines */ ok(5).\n"
+            "bad(( ). ok(6).\n"
+            "bad('unterminated). ok(7).\n"
+            "ok(8).\n",
+            &messages);
+        t.check(factsOf(db, "ok", 1) ==
+                    vector<string>{"1", "2", "3", "4", "5", "6", "7", "8"},
+                "every good clause after a bad one is read");
+        t.check(factsOf(db, "bad", 1).empty(), "no bad clause is stored");
+        t.check(stats.errors == 5, "one error per bad clause");
+        for (const char* line : {"test.pl:2:", "test.pl:3:", "test.pl:5:",
+                                 "test.pl:8:", "test.pl:9:"}) {
+            t.check(messages.find(line) != string::npos,
+                    string("error reported at ") + line);
+        }
+        
+        PrologDatabase rest;
+        rest.setVerbose(false);
+        stats = consultInto(rest, "ok(1).\n/* never closed\nok(2).\n", &messages);
+        t.check(stats.facts == 1 && stats.errors == 1, "an unclosed comment");
+        t.check(messages.find("test.pl:2:") != string::npos,
+                "reported where the comment opens");
+    });
+}
+
+// ============================================================================
+// TESTS: Exporting facts
+// ============================================================================
+static void testExport(TestRunner& tests) {
+    tests.run("consult -> export -> consult", [](TestRunner& t) {
+        const string source =
+            "atom(plain). atom('New York'). atom('it''s'). atom('back\\\\slash').\n"
+            "atom('line\\nbreak'). atom(''). atom('Upper'). atom('_under').\n"
+            "atom('.'). atom('/*'). atom('/**/'). atom(+). atom(=..). atom('+.').\n"
+            "atom([]). atom({}). atom(!). atom(;). atom(','). atom('|').\n"
+            "atom(42). atom(-7). atom(3.14). atom('007'). atom('1e3').\n"
+            "atom(\"a string\"). atom(point(1, 2)). atom([a, 'B c', [d]]).\n"
+            "atom('%'). atom('a%b'). atom('caf\xc3\xa9').\n"
+            "atom(0x1F). atom(0'c). atom(0' ). atom(1.5e3). atom(-0b101). atom(-2.5E-3).\n"
+            "atom('-'). atom('- 7'). atom('1e'). atom('0x'). atom('12abc').\n"
+            "atom(f(x, 'A')). atom(-(1)). atom(- 1). atom([a, b|[c]]). atom('[a|[b]]').\n"
+            "atom('f(x'). atom('g(A)'). atom('{}(x)'). atom('f( x)').\n"
+            "pair('.', '/*').\n";
+        string path = tempPath("round_trip.pl");
+        
+        PrologDatabase original;
+        original.setVerbose(false);
+        string messages;
+        consultInto(original, source, &messages);
+        t.check(messages.empty(), "the source reads cleanly: " + messages);
+        
+        FactExporter exporter(original);
+        exporter.setFormat(ExportFormat::Prolog);
+        t.check(exporter.exportTo(path) == 52, "every fact is exported");
+        string exported = readFile(path);
+        for (const char* term : {"atom(-7).", "atom(0x1F).", "atom(0'c).", "atom(1.5e3).",
+                                 "atom(-0b101).", "atom(f(x,'A')).", "atom([a,b,c]).",
+                                 "atom(point(1,2))."}) {
+            t.check(exported.find(string("\n") + term + "\n") != string::npos,
+                    string("written as a term: ") + term);
+        }
+        for (const char* atom : {"atom('- 7').", "atom('1e').", "atom('[a|[b]]').",
+                                 "atom('g(A)').", "atom('f( x)')."}) {
+            t.check(exported.find(string("\n") + atom + "\n") != string::npos,
+                    string("written as an atom: ") + atom);
+        }
+        
+        PrologDatabase reread;
+        reread.setVerbose(false);
+        ConsultStats stats = consultInto(reread, readFile(path), &messages);
+        t.check(stats.errors == 0, "the export reads back cleanly: " + messages);
+        t.check(factsOf(reread, "atom", 1) == factsOf(original, "atom", 1),
+                "atom/1 survives the round trip");
+        t.check(factsOf(reread, "pair", 2) == vector<string>{".,/*"},
+                "pair/2 survives the round trip");
+        remove(path.c_str());
+    });
+    
+    tests.run("parallel export keeps the order", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        for (int p = 0; p < 40; p++) {
+            for (int i = 0; i < 50; i++) {
+                db.addFact("p" + to_string(p), {"a" + to_string(i), to_string(p)});
+            }
+        }
+        string single = tempPath("export_1.csv");
+        string parallel = tempPath("export_4.csv");
+        
+        FactExporter exporter(db);
+        exporter.setFormat(ExportFormat::Csv);
+        exporter.exportTo(single);
+        exporter.setWorkers(4);
+        t.check(exporter.exportTo(parallel) == 2000, "every fact is exported");
+        t.check(readFile(parallel) == readFile(single),
+                "four workers write what one does");
+        remove(single.c_str());
+        remove(parallel.c_str());
+    });
+}
+
+// ============================================================================
+// TESTS: Bulk loading
+// ============================================================================
+
+// A database whose writes fail: its write-ahead log cannot be written
+static void failWrites(PrologDatabase& db) {
+    db.openLog("/dev/full");
+}
+
+static void testBulkLoading(TestRunner& tests) {
+    tests.run("CSV load across segments", [](TestRunner& t) {
+        // Quoted fields with delimiters, doubled quotes and line breaks, a
+        // stray quote in an unquoted field, CRLF lines and a bad row
+        string csv;
+        for (int i = 0; i < 2001; i++) {
+            string id = to_string(i);
+            switch (i % 7) {
+                case 0: csv += "p" + id + ",\"a, b\"\n"; break;
+                case 1: csv += "p" + id + ",\"say \"\"hi\"\"\"\n"; break;
+                case 2: csv += "p" + id + ",\"two\nlines\"\n"; break;
+                case 3: csv += "p" + id + ",5'6\"\n"; break;
+                case 4: csv += "p" + id + "," + id + "\r\n"; break;
+                default: csv += "p" + id + "," + id + "\n"; break;
+            }
+            if (i == 1000) csv += "one,two,three\n";
+        }
+        string path = tempPath("segments.csv");
+        writeFile(path, csv);
+        
+        PrologDatabase whole;
+        whole.setVerbose(false);
+        CsvLoader reference(whole);
+        t.check(reference.loadFile(path, "row") == 2001, "one segment loads every row");
+        t.check(reference.stats().badRows == 1, "one segment finds the bad row");
+        vector<string> expected = factsOf(whole, "row", 2);
+        
+        for (size_t segmentSize : {5, 64, 1000}) {
+            for (size_t workers : {1, 4}) {
+                PrologDatabase db;
+                db.setVerbose(false);
+                CsvLoader loader(db);
+                loader.setSegmentSize(segmentSize);
+                loader.setWorkers(workers);
+                string setup = to_string(segmentSize) + " byte segments, " +
+                               to_string(workers) + " workers";
+                t.check(loader.loadFile(path, "row") == 2001, setup + ": rows");
+                t.check(loader.stats().badRows == 1, setup + ": bad rows");
+                t.check(factsOf(db, "row", 2) == expected, setup + ": facts");
+            }
+        }
+        remove(path.c_str());
+    });
+    
+    tests.run("parallel CSV load passes on a failed insert", [](TestRunner& t) {
+        string csv;
+        for (int i = 0; i < 2000; i++) csv += "p" + to_string(i) + ",x\n";
+        string path = tempPath("failing.csv");
+        writeFile(path, csv);
+        PrologDatabase db;
+        db.setVerbose(false);
+        failWrites(db);
+        CsvLoader loader(db);
+        loader.setSegmentSize(64);
+        loader.setWorkers(4);
+        t.checkThrows([&] { loader.loadFile(path, "row"); },
+                      "a CSV load whose inserts fail");
+        remove(path.c_str());
+    });
+    
+    tests.run("parallel ingest passes on a failed insert", [](TestRunner& t) {
+        string text;
+        for (int i = 0; i < 2000; i++) {
+            text += "P" + to_string(i) + " likes pizza.\n";
+        }
+        PrologDatabase db;
+        db.setVerbose(false);
+        failWrites(db);
+        TextParser parser(db);
+        parser.setVerbose(false);
+        CorpusIngester ingester(parser, 64);
+        ingester.setWorkers(4);
+        istringstream in(text);
+        t.checkThrows([&] { ingester.ingest(in); },
+                      "an ingest whose inserts fail");
+    });
+}
+
+// ============================================================================
+// TESTS: Answering questions
+// ============================================================================
+static void testQuestions(TestRunner& tests) {
+    tests.run("question forms of the corpus generator", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        TextParser parser(db);
+        parser.setVerbose(false);
+        parser.parseText("John is the parent of Tom. Ann is the parent of John. "
+                         "John likes pizza. Ann watches films. John lives in Paris. "
+                         "Ann is tall.");
+        
+        QueryEngine engine(db);
+        auto answer = [&](const string& question) {
+            ostringstream out;
+            engine.setOutput(out);
+            engine.processQuery(question);
+            return out.str();
+        };
+        t.check(answer("Who is the parent of Tom?").find("john") != string::npos,
+                "who is the parent of X");
+        t.check(answer("What does John like?").find("pizza") != string::npos,
+                "what does X like asks likes/2");
+        t.check(answer("What does Ann watch?").find("films") != string::npos,
+                "what does X watch asks watches/2");
+        t.check(answer("What does John likes?").find("pizza") != string::npos,
+                "what does X likes asks likes/2 as written");
+        db.addFact("have", {"ann", "cat"});
+        t.check(answer("What does Ann have?").find("cat") != string::npos,
+                "a relation named like the verb is asked first");
+        t.check(answer("Where does John live?").find("paris") != string::npos,
+                "where does X live");
+        t.check(answer("Is Ann tall?").find("Yes") != string::npos, "is X property");
+        t.check(answer("Is John the parent of Tom?").find("Yes") != string::npos,
+                "is X the relation of Y");
+        t.check(answer("Is Tom the parent of John?").find("No") != string::npos,
+                "is X the relation of Y, reversed");
+    });
+}
+
+// ============================================================================
+// TESTS: Metrics
+// Run last: they use up the slots of the process-wide metrics
+// ============================================================================
+static void testMetrics(TestRunner& tests) {
+    tests.run("metrics slots running out", [](TestRunner& t) {
+        PrologDatabase db;
+        db.setVerbose(false);
+        bool stored = true;
+        try {
+            for (int p = 0; p < 30000; p++) {
+                db.addFact("rel" + to_string(p), {"a", "b"});
+            }
+        } catch (const exception&) {
+            stored = false;
+        }
+        t.check(stored, "adding facts of 30000 predicates");
+        
+        string messages;
+        ConsultStats stats = consultInto(db, "late(a, b). late(c, d).", &messages);
+        t.check(stats.facts == 2 && messages.empty(), "consulting after the slots ran out");
+        t.check(factsOf(db, "late", 2) == vector<string>{"a,b", "c,d"},
+                "facts of late predicates are stored");
+        
+        TextParser parser(db);
+        parser.setVerbose(false);
+        t.check(parser.parseText("Ann is the parent of Tom.") == 1,
+                "parsing after the slots ran out");
+        
+        ostringstream report;
+        Metrics::instance().write(report, MetricsFormat::Text);
+        t.check(report.str().find("facts_added{predicate=\"other\"}") != string::npos,
+                "late predicates are counted as other");
+    });
+}
+
+// ============================================================================
+// MAIN FUNCTION
+// Purpose: Runs every test and reports the failures
+// ============================================================================
+int main() {
+    TestRunner tests;
+    testPersistence(tests);
+    testConsult(tests);
+    testExport(tests);
+    testBulkLoading(tests);
+    testQuestions(tests);
+    testMetrics(tests);
+    return tests.finish();
+}
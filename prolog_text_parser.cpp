@@ -1,300 +1,8825 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <array>
 #include <map>
 #include <sstream>
+#include <fstream>
 #include <algorithm>
 #include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <shared_mutex>
+#include <climits>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <exception>
+#include <chrono>
+#include <iterator>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <string_view>
+#include <initializer_list>
+#include <new>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PROLOG_HAVE_POSIX 1
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define PROLOG_HAVE_EPOLL 1
+#endif
 
 using namespace std;
 
+// ============================================================================
+// UTILITY: hashBytes
+// Purpose: Fast non-cryptographic 64-bit hash used by the statistics sketches
+// ============================================================================
+static inline uint64_t mixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hashBytes(const char* data, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0x100000001b3ULL);
+    size_t i = 0;
+    
+    // Consume 8 bytes at a time, then fold in the tail
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ mixHash(word)) * 0x87c37b91114253d5ULL;
+    }
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < len; i++, shift += 8) {
+        tail |= uint64_t(static_cast<unsigned char>(data[i])) << shift;
+    }
+    return mixHash(h ^ mixHash(tail));
+}
+
+static inline uint64_t hashString(const string& str) {
+    return hashBytes(str.data(), str.size());
+}
+
+// ============================================================================
+// UTILITY: BinaryWriter / BinaryReader
+// Purpose: Minimal host-endian serialization for the on-disk caches and
+//          snapshots. The reader never reads past its input; it clears ok
+//          instead, and the caller checks ok once at the end.
+// ============================================================================
+struct BinaryWriter {
+    string bytes;
+    template <typename T> void pod(T value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    void str(string_view value) {
+        pod(static_cast<uint32_t>(value.size()));
+        bytes += value;
+    }
+};
+
+struct BinaryReader {
+    string_view bytes;
+    bool ok = true;
+    template <typename T> T pod() {
+        T value{};
+        if (bytes.size() < sizeof(T)) {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, bytes.data(), sizeof(T));
+        bytes.remove_prefix(sizeof(T));
+        return value;
+    }
+    string str() {
+        uint32_t size = pod<uint32_t>();
+        if (!ok || bytes.size() < size) {
+            ok = false;
+            return "";
+        }
+        string value(bytes.substr(0, size));
+        bytes.remove_prefix(size);
+        return value;
+    }
+};
+
+// ============================================================================
+// UTILITY: StreamHash
+// Purpose: hashBytes-style 64-bit checksum that can be fed in pieces, for
+//          files too large to hash in one buffer
+// ============================================================================
+struct StreamHash {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    uint64_t length = 0;
+    uint64_t pending = 0;                 // Bytes of an unfinished word
+    
+    void update(const char* data, size_t size) {
+        size_t i = 0;
+        while (i < size && length % 8 != 0) {
+            pending |= uint64_t(static_cast<unsigned char>(data[i++]))
+                       << (length++ % 8 * 8);
+            if (length % 8 == 0) {
+                h = (h ^ mixHash(pending)) * 0x87c37b91114253d5ULL;
+                pending = 0;
+            }
+        }
+        for (; i + 8 <= size; i += 8, length += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ mixHash(word)) * 0x87c37b91114253d5ULL;
+        }
+        for (; i < size; i++, length++) {
+            pending |= uint64_t(static_cast<unsigned char>(data[i]))
+                       << (length % 8 * 8);
+        }
+    }
+    
+    uint64_t finish() const {
+        return mixHash(h ^ mixHash(pending) ^ mixHash(length));
+    }
+};
+
+// ============================================================================
+// CLASS: MappedFile
+// Purpose: Read-only view of a whole file. Memory-mapped where the platform
+//          has mmap, so pages are only read when touched; read into memory
+//          elsewhere. Throws runtime_error if the file cannot be opened.
+// ============================================================================
+class MappedFile {
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    vector<char> copy;                    // Without mmap
+    
+    void release() {
+#ifdef PROLOG_HAVE_POSIX
+        if (bytes && copy.empty()) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+        bytes = nullptr;
+        length = 0;
+        copy.clear();
+    }
+
+public:
+    MappedFile() = default;
+    
+    explicit MappedFile(const string& path) {
+#ifdef PROLOG_HAVE_POSIX
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Cannot open " + path);
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                throw runtime_error("Cannot map " + path);
+            }
+            bytes = static_cast<const char*>(mapped);
+        }
+        ::close(fd);
+#else
+        ifstream file(path, ios::binary);
+        if (!file) throw runtime_error("Cannot open " + path);
+        copy.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        bytes = copy.data();
+        length = copy.size();
+#endif
+    }
+    
+    ~MappedFile() { release(); }
+    
+    MappedFile(MappedFile&& other) noexcept { *this = move(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            release();
+            bytes = other.bytes;
+            length = other.length;
+            copy = move(other.copy);
+            other.bytes = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+    
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// ============================================================================
+// UTILITY: syncPath
+// Purpose: Forces a file, or a directory's entries, to stable storage.
+//          Best effort: a no-op where there is no fsync.
+// ============================================================================
+static void syncPath(const string& path) {
+#ifdef PROLOG_HAVE_POSIX
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Directory part of a path, for syncing a rename
+static string parentDirectory(const string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == string::npos) return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// ============================================================================
+// UTILITY: text kernels
+// Purpose: ASCII case folding and character classes shared by the database,
+//          the parser and the query engine. Unlike ::tolower and ispunct
+//          they do not go through the locale, bytes outside ASCII pass
+//          through unchanged, and the bulk versions work on 16 bytes (SSE2)
+//          or 32 bytes (AVX2) per step with a scalar tail.
+// ============================================================================
+enum CharClass : uint8_t {
+    CHAR_SPACE = 1,                       // ' ' '\t' '\n' '\r'
+    CHAR_PUNCT = 2,
+    CHAR_UPPER = 4,
+    CHAR_LOWER = 8,
+    CHAR_DIGIT = 16
+};
+
+struct CharClassTable {
+    uint8_t bits[256] = {};
+    
+    constexpr CharClassTable() {
+        bits[' '] = bits['\t'] = bits['\n'] = bits['\r'] = CHAR_SPACE;
+        for (int c = '!'; c <= '~'; c++) bits[c] = CHAR_PUNCT;
+        for (int c = 'A'; c <= 'Z'; c++) bits[c] = CHAR_UPPER;
+        for (int c = 'a'; c <= 'z'; c++) bits[c] = CHAR_LOWER;
+        for (int c = '0'; c <= '9'; c++) bits[c] = CHAR_DIGIT;
+    }
+};
+
+static constexpr CharClassTable CHAR_CLASSES;
+
+static inline bool hasCharClass(char c, uint8_t classes) {
+    return (CHAR_CLASSES.bits[static_cast<unsigned char>(c)] & classes) != 0;
+}
+static inline bool isAsciiSpace(char c) { return hasCharClass(c, CHAR_SPACE); }
+static inline bool isAsciiPunct(char c) { return hasCharClass(c, CHAR_PUNCT); }
+static inline bool isAsciiLower(char c) { return hasCharClass(c, CHAR_LOWER); }
+static inline bool isAsciiAlpha(char c) {
+    return hasCharClass(c, CHAR_UPPER | CHAR_LOWER);
+}
+
+static inline char asciiLower(char c) {
+    return hasCharClass(c, CHAR_UPPER) ? static_cast<char>(c | 0x20) : c;
+}
+
+// Lowercases n bytes from in to out (which may be the same buffer)
+static inline void asciiLower(const char* in, char* out, size_t n) {
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i beforeA32 = _mm256_set1_epi8('A' - 1);
+    const __m256i afterZ32 = _mm256_set1_epi8('Z' + 1);
+    const __m256i caseBit32 = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, beforeA32),
+                                         _mm256_cmpgt_epi8(afterZ32, v));
+        v = _mm256_or_si256(v, _mm256_and_si256(upper, caseBit32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+    }
+#endif
+#ifdef __SSE2__
+    // Bytes >= 0x80 compare as negative, so they are never "uppercase"
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, beforeA),
+                                      _mm_cmpgt_epi8(afterZ, v));
+        v = _mm_or_si128(v, _mm_and_si128(upper, caseBit));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+    }
+#endif
+    for (; i < n; i++) out[i] = asciiLower(in[i]);
+}
+
+static inline string toLowerAscii(string_view text) {
+    string result(text.size(), '\0');
+    asciiLower(text.data(), &result[0], text.size());
+    return result;
+}
+
+static inline bool hasAsciiUpper(string_view text) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    for (; i + 16 <= text.size(); i += 16) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(text.data() + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, beforeA),
+                                      _mm_cmpgt_epi8(afterZ, v));
+        if (_mm_movemask_epi8(upper)) return true;
+    }
+#endif
+    for (; i < text.size(); i++) {
+        if (hasCharClass(text[i], CHAR_UPPER)) return true;
+    }
+    return false;
+}
+
+// ----------------------------------------------------------------------------
+// findByte: index of the first byte equal to (or, with Negate, different
+// from) all of a, b, c and d, or n if there is none. Used to jump to token
+// and sentence boundaries without looking at every byte on its own.
+// ----------------------------------------------------------------------------
+template <bool Negate>
+static inline size_t findByte(const char* p, size_t n,
+                              char a, char b, char c, char d) {
+    size_t i = 0;
+#ifdef __AVX2__
+    {
+        const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+        const __m256i vc = _mm256_set1_epi8(c), vd = _mm256_set1_epi8(d);
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i hit = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd)));
+            uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+            if (Negate) bits = ~bits;
+            if (bits) return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    {
+        const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+        const __m128i vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+            uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+            if (Negate) bits = ~bits & 0xffff;
+            if (bits) return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        char x = p[i];
+        bool hit = x == a || x == b || x == c || x == d;
+        if (hit != Negate) return i;
+    }
+    return n;
+}
+
+// First whitespace byte (end of a token), or n
+static inline size_t findSpace(const char* p, size_t n) {
+    return findByte<false>(p, n, ' ', '\t', '\n', '\r');
+}
+
+// First non-whitespace byte (start of a token), or n
+static inline size_t skipSpace(const char* p, size_t n) {
+    return findByte<true>(p, n, ' ', '\t', '\n', '\r');
+}
+
+static inline string_view trimAscii(string_view text) {
+    size_t start = skipSpace(text.data(), text.size());
+    size_t end = text.size();
+    while (end > start && isAsciiSpace(text[end - 1])) end--;
+    return text.substr(start, end - start);
+}
+
+static inline string_view stripTrailingPunct(string_view text) {
+    while (!text.empty() && isAsciiPunct(text.back())) text.remove_suffix(1);
+    return text;
+}
+
+// ============================================================================
+// UTILITY: memory accounting
+// Purpose: Byte counts for PrologDatabase::getMemoryReport. "used" is live
+//          payload (tombstones included), "requested" is what a container
+//          asked the allocator for, so requested - used is unused capacity
+//          (empty hash slots, the unfilled end of a segment), and
+//          "allocated" is what the allocator really holds for those blocks
+//          with its rounding and block headers (glibc; elsewhere, or where
+//          the block start is not known, the same as requested).
+// ============================================================================
+struct MemoryUse {
+    uint64_t used = 0;
+    uint64_t requested = 0;
+    uint64_t allocated = 0;
+    
+    MemoryUse& operator+=(const MemoryUse& other) {
+        used += other.used;
+        requested += other.requested;
+        allocated += other.allocated;
+        return *this;
+    }
+    
+    // Counts one heap block of size bytes, usedBytes of them live. A null
+    // block is counted at its requested size.
+    void add(const void* block, size_t size, size_t usedBytes) {
+        used += usedBytes;
+        requested += size;
+#ifdef __GLIBC__
+        if (block) {
+            allocated += malloc_usable_size(const_cast<void*>(block)) + sizeof(size_t);
+            return;
+        }
+#endif
+        (void)block;
+        allocated += size;
+    }
+    
+    // Counts the heap buffer of a vector
+    template <typename T>
+    void add(const vector<T>& items) {
+        if (items.capacity()) {
+            add(items.data(), items.capacity() * sizeof(T), items.size() * sizeof(T));
+        }
+    }
+    
+    // Counts the heap buffer of a string too long for its inline buffer
+    void add(const string& text) {
+        const char* inside = reinterpret_cast<const char*>(&text);
+        if (text.data() < inside || text.data() >= inside + sizeof(string)) {
+            add(text.data(), text.capacity() + 1, text.size() + 1);
+        }
+    }
+};
+
+// Helper function to print a byte count, e.g. "1.5 MiB"
+static string formatBytes(uint64_t bytes) {
+    ostringstream text;
+    if (bytes < 1024) {
+        text << bytes << " B";
+    } else if (bytes < 1048576) {
+        text << fixed << setprecision(1) << bytes / 1024.0 << " KiB";
+    } else if (bytes < (uint64_t(1) << 30)) {
+        text << fixed << setprecision(1) << bytes / 1048576.0 << " MiB";
+    } else {
+        text << fixed << setprecision(2) << bytes / 1073741824.0 << " GiB";
+    }
+    return text.str();
+}
+
+// Memory of one predicate/arity pair, over the snapshot and every shard
+struct PredicateMemory {
+    string predicate;
+    size_t arity = 0;
+    uint64_t tuples = 0;                     // Stored, tombstones included
+    uint64_t deadTuples = 0;                 // Tombstones
+    uint64_t reclaimableTuples = 0;          // Tombstones no snapshot can see
+    MemoryUse tupleBytes;                    // Arguments and version stamps
+    MemoryUse indexBytes;                    // Column indexes and postings
+    MemoryUse statisticsBytes;               // Sketches kept for the planner
+    uint64_t mappedBytes = 0;                // Snapshot tuples and indexes
+    uint64_t compactedBytes = 0;             // Tuples and indexes requested
+                                             // once compacted
+    
+    MemoryUse heap() const {
+        MemoryUse total = tupleBytes;
+        total += indexBytes;
+        total += statisticsBytes;
+        return total;
+    }
+};
+
+struct MemoryReport {
+    vector<PredicateMemory> predicates;      // Largest first
+    uint64_t atomCount = 0;
+    MemoryUse atomText;                      // Atom spellings
+    MemoryUse atomLookup;                    // Text -> id hash tables
+    MemoryUse atomFolded;                    // Lowercase ids
+    uint64_t atomMappedBytes = 0;            // Snapshot atoms read in place
+    MemoryUse directories;                   // Predicate tables and relations
+    uint64_t mappedBytes = 0;                // Whole snapshot file mapping
+    
+    MemoryUse heap() const {
+        MemoryUse total = atomText;
+        total += atomLookup;
+        total += atomFolded;
+        total += directories;
+        for (const PredicateMemory& predicate : predicates) total += predicate.heap();
+        return total;
+    }
+};
+
+// ============================================================================
+// CLASS: HyperLogLog
+// Purpose: Estimates the number of distinct values in a column. Small columns
+//          are counted exactly; once they grow past a few dozen values the
+//          sketch switches to 2^10 one-byte registers (~3% standard error).
+// ============================================================================
+class HyperLogLog {
+private:
+    static constexpr int PRECISION = 10;
+    static constexpr size_t REGISTERS = size_t(1) << PRECISION;
+    static constexpr size_t SPARSE_LIMIT = 32;
+    
+    vector<uint64_t> sparse;      // Exact set of hashes while small
+    vector<uint8_t> registers;    // Dense registers once promoted
+    
+    void addDense(uint64_t hash) {
+        size_t index = hash >> (64 - PRECISION);
+        uint64_t rest = (hash << PRECISION) | (uint64_t(1) << (PRECISION - 1));
+        uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        if (rank > registers[index]) registers[index] = rank;
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: add
+    // Purpose: Records one (already hashed) value
+    // ------------------------------------------------------------------------
+    void add(uint64_t hash) {
+        if (registers.empty()) {
+            auto pos = lower_bound(sparse.begin(), sparse.end(), hash);
+            if (pos != sparse.end() && *pos == hash) return;
+            
+            if (sparse.size() < SPARSE_LIMIT) {
+                sparse.insert(pos, hash);
+                return;
+            }
+            
+            // Promote to the dense representation
+            registers.assign(REGISTERS, 0);
+            for (uint64_t h : sparse) addDense(h);
+            sparse.clear();
+            sparse.shrink_to_fit();
+        }
+        addDense(hash);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: estimate
+    // Purpose: Returns the estimated number of distinct values seen so far
+    // ------------------------------------------------------------------------
+    uint64_t estimate() const {
+        if (registers.empty()) return sparse.size();
+        
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (uint8_t r : registers) {
+            sum += ldexp(1.0, -r);
+            if (r == 0) zeros++;
+        }
+        
+        double m = static_cast<double>(REGISTERS);
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double estimate = alpha * m * m / sum;
+        
+        // Small-range correction: linear counting is more accurate here
+        if (estimate <= 2.5 * m && zeros > 0) {
+            estimate = m * log(m / static_cast<double>(zeros));
+        }
+        return static_cast<uint64_t>(estimate + 0.5);
+    }
+    
+    bool isExact() const { return registers.empty(); }
+    
+    // Serialized form, used by database snapshots
+    void save(BinaryWriter& out) const {
+        out.pod(static_cast<uint8_t>(registers.empty() ? 0 : 1));
+        if (registers.empty()) {
+            out.pod(static_cast<uint32_t>(sparse.size()));
+            for (uint64_t hash : sparse) out.pod(hash);
+        } else {
+            out.bytes.append(reinterpret_cast<const char*>(registers.data()),
+                             REGISTERS);
+        }
+    }
+    
+    void load(BinaryReader& in) {
+        sparse.clear();
+        registers.clear();
+        if (in.pod<uint8_t>() == 0) {
+            uint32_t count = in.pod<uint32_t>();
+            if (count > SPARSE_LIMIT) in.ok = false;
+            for (uint32_t i = 0; i < count && in.ok; i++) {
+                sparse.push_back(in.pod<uint64_t>());
+            }
+        } else if (in.bytes.size() >= REGISTERS) {
+            registers.assign(in.bytes.begin(), in.bytes.begin() + REGISTERS);
+            in.bytes.remove_prefix(REGISTERS);
+        } else {
+            in.ok = false;
+        }
+    }
+    
+    // Heap bytes of the sketch
+    MemoryUse memoryUse() const {
+        MemoryUse use;
+        use.add(sparse);
+        use.add(registers);
+        return use;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: merge
+    // Purpose: Folds another sketch in, as if its values had been added here
+    // ------------------------------------------------------------------------
+    void merge(const HyperLogLog& other) {
+        if (other.registers.empty()) {
+            for (uint64_t hash : other.sparse) add(hash);
+            return;
+        }
+        
+        if (registers.empty()) {
+            registers.assign(REGISTERS, 0);
+            for (uint64_t h : sparse) addDense(h);
+            sparse.clear();
+            sparse.shrink_to_fit();
+        }
+        for (size_t i = 0; i < REGISTERS; i++) {
+            registers[i] = max(registers[i], other.registers[i]);
+        }
+    }
+};
+
+// ============================================================================
+// CLASS: HeavyHitters
+// Purpose: Tracks the most frequent values (atom ids) of a column with the
+//          Space-Saving algorithm. Counts are upper bounds; "error" is the
+//          maximum overestimate for each entry.
+// ============================================================================
+class HeavyHitters {
+public:
+    struct Entry {
+        uint64_t key;
+        uint64_t count;
+        uint64_t error;
+    };
+    
+private:
+    static constexpr size_t CAPACITY = 8;
+    vector<Entry> entries;
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: add
+    // Purpose: Counts one occurrence of a value
+    // ------------------------------------------------------------------------
+    void add(uint64_t key) {
+        for (auto& entry : entries) {
+            if (entry.key == key) {
+                entry.count++;
+                return;
+            }
+        }
+        
+        if (entries.size() < CAPACITY) {
+            entries.push_back({key, 1, 0});
+            return;
+        }
+        
+        // Evict the smallest counter; the newcomer inherits its count
+        auto smallest = min_element(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.count < b.count; });
+        smallest->error = smallest->count;
+        smallest->count++;
+        smallest->key = key;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: merge
+    // Purpose: Combines the counters of another summary into this one,
+    //          keeping the largest CAPACITY entries
+    // ------------------------------------------------------------------------
+    void merge(const HeavyHitters& other) {
+        for (const auto& incoming : other.entries) {
+            auto existing = find_if(entries.begin(), entries.end(),
+                [&](const Entry& entry) { return entry.key == incoming.key; });
+            if (existing != entries.end()) {
+                existing->count += incoming.count;
+                existing->error += incoming.error;
+            } else {
+                entries.push_back(incoming);
+            }
+        }
+        
+        if (entries.size() > CAPACITY) {
+            entries = top();
+            entries.resize(CAPACITY);
+        }
+    }
+    
+    // Heap bytes of the tracked values
+    MemoryUse memoryUse() const {
+        MemoryUse use;
+        use.add(entries);
+        return use;
+    }
+    
+    void save(BinaryWriter& out) const {
+        out.pod(static_cast<uint32_t>(entries.size()));
+        for (const Entry& entry : entries) {
+            out.pod(entry.key);
+            out.pod(entry.count);
+            out.pod(entry.error);
+        }
+    }
+    
+    void load(BinaryReader& in) {
+        entries.clear();
+        uint32_t count = in.pod<uint32_t>();
+        if (count > CAPACITY) in.ok = false;
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            Entry entry;
+            entry.key = in.pod<uint64_t>();
+            entry.count = in.pod<uint64_t>();
+            entry.error = in.pod<uint64_t>();
+            entries.push_back(entry);
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: top
+    // Purpose: Returns the tracked values, most frequent first
+    // ------------------------------------------------------------------------
+    vector<Entry> top() const {
+        vector<Entry> sorted = entries;
+        sort(sorted.begin(), sorted.end(),
+             [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        return sorted;
+    }
+};
+
+// ============================================================================
+// STRUCT: PredicateStats
+// Purpose: Snapshot of the statistics kept for one predicate/arity pair
+// ============================================================================
+struct HeavyHitter {
+    string value;
+    uint64_t count;                          // Upper bound
+    uint64_t error;                          // Maximum overestimate
+};
+
+struct ColumnStats {
+    uint64_t distinctEstimate;
+    bool exact;                              // True while below sketch limit
+    vector<HeavyHitter> heavyHitters;
+};
+
+struct PredicateStats {
+    string predicate;
+    size_t arity;
+    uint64_t rowCount;
+    vector<ColumnStats> columns;
+};
+
+// ============================================================================
+// CLASS: EpochManager
+// Purpose: Process-wide epoch-based reclamation and MVCC version clock.
+//          Readers pin the current epoch and commit version in a per-thread
+//          slot; writers publish new versions under a short commit lock and
+//          hand unlinked memory to retire(), which frees it once no reader
+//          that could still see it remains pinned.
+// ============================================================================
+class EpochManager {
+public:
+    static constexpr uint64_t NEVER = UINT64_MAX;
+    
+private:
+    static constexpr size_t MAX_THREADS = 256;
+    
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};          // 0 = not pinned
+        atomic<uint64_t> version{NEVER};    // Snapshot version while pinned
+        atomic<bool> inUse{false};
+        unsigned depth = 0;                 // Nesting depth (owner only)
+    };
+    
+    struct Retired {
+        uint64_t epoch;
+        function<void()> reclaim;
+    };
+    
+    Slot slots[MAX_THREADS];
+    atomic<uint64_t> globalEpoch{1};
+    atomic<uint64_t> committedVersion{0};
+    mutex commitMutex;
+    mutex retireMutex;
+    vector<Retired> retired;
+    
+    // Releases the calling thread's slot when the thread exits
+    struct SlotOwner {
+        Slot* slot = nullptr;
+        ~SlotOwner() {
+            if (slot) slot->inUse.store(false, memory_order_release);
+        }
+    };
+    
+    Slot& localSlot() {
+        static thread_local SlotOwner owner;
+        if (owner.slot) return *owner.slot;
+        
+        for (Slot& slot : slots) {
+            bool expected = false;
+            if (!slot.inUse.load(memory_order_relaxed) &&
+                slot.inUse.compare_exchange_strong(expected, true)) {
+                owner.slot = &slot;
+                return slot;
+            }
+        }
+        throw runtime_error("EpochManager: too many concurrent threads");
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // CLASS: Guard
+    // Purpose: RAII pin of one reader. While it lives, memory retired after
+    //          it was taken stays valid and version() names a consistent
+    //          snapshot. Guards nest and must stay on the creating thread.
+    // ------------------------------------------------------------------------
+    class Guard {
+    private:
+        Slot* slot;
+        
+    public:
+        explicit Guard(Slot* s) : slot(s) {}
+        Guard(Guard&& other) noexcept : slot(other.slot) { other.slot = nullptr; }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        Guard& operator=(Guard&&) = delete;
+        
+        ~Guard() {
+            if (slot && --slot->depth == 0) {
+                slot->version.store(NEVER, memory_order_release);
+                slot->epoch.store(0, memory_order_release);
+            }
+        }
+        
+        uint64_t version() const {
+            return slot->version.load(memory_order_relaxed);
+        }
+    };
+    
+    static EpochManager& instance() {
+        static EpochManager manager;
+        return manager;
+    }
+    
+    ~EpochManager() {
+        for (auto& item : retired) item.reclaim();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: pin
+    // Purpose: Enters a read-side critical section and takes a snapshot
+    // ------------------------------------------------------------------------
+    Guard pin() {
+        Slot& slot = localSlot();
+        if (slot.depth++ == 0) {
+            // Re-check the version after publishing it, so a compactor that
+            // scanned the slots in between cannot have missed our snapshot
+            while (true) {
+                uint64_t version = committedVersion.load();
+                slot.version.store(version);
+                slot.epoch.store(globalEpoch.load());
+                if (committedVersion.load() == version) break;
+            }
+        }
+        return Guard(&slot);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: commit
+    // Purpose: Assigns the next version to a write, lets stamp() label the
+    //          new data with it, then makes it visible to new snapshots
+    // Returns: The committed version
+    // ------------------------------------------------------------------------
+    template <typename Stamp>
+    uint64_t commit(Stamp stamp) {
+        lock_guard<mutex> lock(commitMutex);
+        uint64_t version = committedVersion.load(memory_order_relaxed) + 1;
+        stamp(version);
+        committedVersion.store(version, memory_order_release);
+        return version;
+    }
+    
+    uint64_t currentVersion() const {
+        return committedVersion.load(memory_order_acquire);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: oldestActiveVersion
+    // Purpose: Returns the oldest snapshot any reader may still be using;
+    //          versions deleted at or before it are invisible to everyone
+    // ------------------------------------------------------------------------
+    uint64_t oldestActiveVersion() const {
+        uint64_t oldest = committedVersion.load();
+        for (const Slot& slot : slots) {
+            oldest = min(oldest, slot.version.load());
+        }
+        return oldest;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: retire
+    // Purpose: Schedules reclaim() to run once no pinned reader can still
+    //          reach the memory it frees. Call after unlinking the memory.
+    // ------------------------------------------------------------------------
+    void retire(function<void()> reclaim) {
+        uint64_t epoch = globalEpoch.fetch_add(1);
+        size_t pending;
+        {
+            lock_guard<mutex> lock(retireMutex);
+            retired.push_back({epoch, move(reclaim)});
+            pending = retired.size();
+        }
+        if (pending >= 64) collect();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: collect
+    // Purpose: Runs every retired reclaim() that is safe to run now
+    // ------------------------------------------------------------------------
+    void collect() {
+        uint64_t oldestPin = NEVER;
+        for (const Slot& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) oldestPin = min(oldestPin, epoch);
+        }
+        
+        vector<Retired> ready;
+        {
+            lock_guard<mutex> lock(retireMutex);
+            auto split = partition(retired.begin(), retired.end(),
+                [&](const Retired& item) { return item.epoch >= oldestPin; });
+            move(split, retired.end(), back_inserter(ready));
+            retired.erase(split, retired.end());
+        }
+        for (auto& item : ready) item.reclaim();
+    }
+};
+
+// ============================================================================
+// CLASS: SegmentedVector
+// Purpose: Append-only array for one writer and any number of lock-free
+//          readers. Storage grows in doubling segments that never move, so
+//          an element published by push is valid for as long as the vector.
+// ============================================================================
+template <typename T, unsigned FIRST_BITS = 4>
+class SegmentedVector {
+private:
+    static constexpr size_t FIRST = size_t(1) << FIRST_BITS;
+    static constexpr size_t MAX_SEGMENTS = 48;
+    
+    atomic<T*> segments[MAX_SEGMENTS];
+    atomic<size_t> published{0};
+    
+    static void locate(size_t index, size_t& segment, size_t& offset) {
+        size_t q = index / FIRST + 1;
+        segment = 63 - __builtin_clzll(q);
+        offset = index - FIRST * ((size_t(1) << segment) - 1);
+    }
+
+public:
+    SegmentedVector() {
+        for (auto& segment : segments) segment.store(nullptr);
+    }
+    
+    ~SegmentedVector() {
+        for (auto& segment : segments) delete[] segment.load();
+    }
+    
+    SegmentedVector(const SegmentedVector&) = delete;
+    SegmentedVector& operator=(const SegmentedVector&) = delete;
+    
+    // Number of elements visible to readers
+    size_t size() const { return published.load(memory_order_acquire); }
+    
+    const T& operator[](size_t index) const {
+        size_t segment, offset;
+        locate(index, segment, offset);
+        return segments[segment].load(memory_order_acquire)[offset];
+    }
+    
+    // Writer-only mutable access to an already published element
+    T& at(size_t index) {
+        size_t segment, offset;
+        locate(index, segment, offset);
+        return segments[segment].load(memory_order_relaxed)[offset];
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: append
+    // Purpose: Lets init() fill the next slot, then publishes it (writer only)
+    // Returns: Index of the new element
+    // ------------------------------------------------------------------------
+    template <typename Init>
+    size_t append(Init init) {
+        size_t index = published.load(memory_order_relaxed);
+        size_t segment, offset;
+        locate(index, segment, offset);
+        
+        T* storage = segments[segment].load(memory_order_relaxed);
+        if (!storage) {
+            storage = new T[FIRST << segment];
+            segments[segment].store(storage, memory_order_release);
+        }
+        init(storage[offset]);
+        published.store(index + 1, memory_order_release);
+        return index;
+    }
+    
+    size_t push_back(const T& value) {
+        return append([&](T& slot) { slot = value; });
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: memoryUse
+    // Purpose: Bytes held by the segments, plus what elementHeap(element)
+    //          says each published element owns itself
+    // ------------------------------------------------------------------------
+    MemoryUse memoryUse() const {
+        return memoryUse([](const T&) { return MemoryUse(); });
+    }
+    
+    template <typename ElementHeap>
+    MemoryUse memoryUse(ElementHeap elementHeap) const {
+        MemoryUse use;
+        size_t count = size();
+        for (size_t segment = 0; segment < MAX_SEGMENTS; segment++) {
+            const T* storage = segments[segment].load(memory_order_acquire);
+            if (!storage) continue;
+            
+            size_t capacity = FIRST << segment;
+            size_t first = FIRST * ((size_t(1) << segment) - 1);
+            size_t filled = count > first ? min(capacity, count - first) : 0;
+            
+            // new[] puts a cookie before arrays it must destroy one by one
+            const void* block = is_trivially_destructible<T>::value ? storage : nullptr;
+            use.add(block, capacity * sizeof(T), filled * sizeof(T));
+            for (size_t i = 0; i < filled; i++) use += elementHeap(storage[i]);
+        }
+        return use;
+    }
+    
+    // Bytes the segments of a vector of count elements take
+    static uint64_t bytesFor(size_t count) {
+        uint64_t bytes = 0;
+        for (size_t segment = 0; FIRST * ((size_t(1) << segment) - 1) < count; segment++) {
+            bytes += (FIRST << segment) * sizeof(T);
+        }
+        return bytes;
+    }
+};
+
+// ============================================================================
+// CLASS: ConcurrentMap
+// Purpose: Open-addressing hash map for one writer and lock-free readers.
+//          Entries are allocated once and never move; growing the table
+//          publishes a new slot array and retires the old one.
+// ============================================================================
+struct StringHasher {
+    uint64_t operator()(string_view str) const {
+        return hashBytes(str.data(), str.size());
+    }
+};
+
+struct AtomHasher {
+    uint64_t operator()(uint32_t atom) const { return mixHash(atom); }
+};
+
+template <typename Key, typename Value, typename Hasher>
+class ConcurrentMap {
+private:
+    struct Entry {
+        Key key;
+        uint64_t hash;
+        Value value;
+        Entry(const Key& k, uint64_t h) : key(k), hash(h) {}
+    };
+    
+    struct Table {
+        size_t mask;
+        unique_ptr<atomic<Entry*>[]> slots;
+        explicit Table(size_t capacity)
+            : mask(capacity - 1), slots(new atomic<Entry*>[capacity]) {
+            for (size_t i = 0; i < capacity; i++) slots[i].store(nullptr);
+        }
+    };
+    
+    atomic<Table*> table;
+    size_t count = 0;                        // Writer only
+    
+    static void place(Table& target, Entry* entry) {
+        size_t i = entry->hash & target.mask;
+        while (target.slots[i].load(memory_order_relaxed)) {
+            i = (i + 1) & target.mask;
+        }
+        target.slots[i].store(entry, memory_order_release);
+    }
+
+public:
+    ConcurrentMap() : table(new Table(8)) {}
+    
+    ~ConcurrentMap() {
+        Table* current = table.load();
+        for (size_t i = 0; i <= current->mask; i++) {
+            delete current->slots[i].load();
+        }
+        delete current;
+    }
+    
+    ConcurrentMap(const ConcurrentMap&) = delete;
+    ConcurrentMap& operator=(const ConcurrentMap&) = delete;
+    
+    // Number of entries (writer only)
+    size_t size() const { return count; }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: find
+    // Purpose: Looks a key up; safe from any thread holding an epoch guard
+    // Returns: The value, or nullptr if absent
+    // ------------------------------------------------------------------------
+    template <typename Probe>
+    Value* find(const Probe& key) const {
+        uint64_t hash = Hasher()(key);
+        Table* current = table.load(memory_order_acquire);
+        
+        for (size_t i = hash & current->mask;; i = (i + 1) & current->mask) {
+            Entry* entry = current->slots[i].load(memory_order_acquire);
+            if (!entry) return nullptr;
+            if (entry->hash == hash && entry->key == key) return &entry->value;
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: findOrInsert
+    // Purpose: Returns the value for a key. A missing entry is
+    //          default-constructed and passed to init() before readers can
+    //          see it (writer only).
+    // ------------------------------------------------------------------------
+    Value& findOrInsert(const Key& key) {
+        return findOrInsert(key, [](Value&) {});
+    }
+    
+    template <typename Init>
+    Value& findOrInsert(const Key& key, Init init) {
+        if (Value* existing = find(key)) return *existing;
+        
+        Table* current = table.load(memory_order_relaxed);
+        if ((count + 1) * 2 > current->mask + 1) {
+            Table* grown = new Table((current->mask + 1) * 2);
+            for (size_t i = 0; i <= current->mask; i++) {
+                if (Entry* entry = current->slots[i].load(memory_order_relaxed)) {
+                    place(*grown, entry);
+                }
+            }
+            table.store(grown, memory_order_release);
+            EpochManager::instance().retire([current] { delete current; });
+            current = grown;
+        }
+        
+        Entry* entry = new Entry(key, Hasher()(key));
+        init(entry->value);
+        place(*current, entry);
+        count++;
+        return entry->value;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: memoryUse
+    // Purpose: Bytes held by the slot table and the entries, plus what
+    //          entryHeap(key, value) says an entry owns itself; safe for
+    //          readers. A table waiting to be retired is not counted.
+    // ------------------------------------------------------------------------
+    template <typename EntryHeap>
+    MemoryUse memoryUse(EntryHeap entryHeap) const {
+        MemoryUse use;
+        const Table* current = table.load(memory_order_acquire);
+        size_t capacity = current->mask + 1;
+        size_t entries = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (const Entry* entry = current->slots[i].load(memory_order_acquire)) {
+                entries++;
+                use.add(entry, sizeof(Entry), sizeof(Entry));
+                use += entryHeap(entry->key, entry->value);
+            }
+        }
+        use.add(current, sizeof(Table), sizeof(Table));
+        use.add(current->slots.get(), capacity * sizeof(atomic<Entry*>),
+                entries * sizeof(atomic<Entry*>));
+        return use;
+    }
+    
+    // Bytes the table and entries of a map of count entries take, without
+    // what the entries own
+    static uint64_t bytesFor(size_t count) {
+        size_t capacity = 8;
+        while (count * 2 > capacity) capacity *= 2;
+        return sizeof(Table) + capacity * sizeof(atomic<Entry*>) + count * sizeof(Entry);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: forEach
+    // Purpose: Visits every entry as visit(key, value); safe for readers
+    // ------------------------------------------------------------------------
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        Table* current = table.load(memory_order_acquire);
+        for (size_t i = 0; i <= current->mask; i++) {
+            if (Entry* entry = current->slots[i].load(memory_order_acquire)) {
+                visit(entry->key, entry->value);
+            }
+        }
+    }
+};
+
+// ============================================================================
+// CLASS: AtomTable
+// Purpose: Interns predicate names and arguments as 32-bit atom ids, so that
+//          facts are stored and compared as integers. Every atom also knows
+//          the id of its lowercase spelling, used for case-insensitive
+//          matching. Interning is striped over several locks; lookups are
+//          lock-free but must run under an EpochManager guard.
+// ============================================================================
+class AtomTable {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    
+    // Atoms of a loaded snapshot, read in place from the mapped file. They
+    // keep their snapshot ids 0..count-1; atoms interned later follow them.
+    struct Base {
+        uint32_t count = 0;
+        const uint64_t* offsets = nullptr;  // [count + 1] into text
+        const uint32_t* folded = nullptr;   // [count]
+        const uint32_t* slots = nullptr;    // Hash table of id + 1 (0 = empty)
+        uint64_t slotMask = 0;
+        const char* text = nullptr;
+    };
+    
+private:
+    static constexpr unsigned STRIPE_BITS = 4;
+    static constexpr size_t STRIPES = size_t(1) << STRIPE_BITS;
+    
+    // Atom id = base.count + ((index within stripe << STRIPE_BITS) | stripe)
+    struct alignas(64) Stripe {
+        mutex writeMutex;
+        ConcurrentMap<string, uint32_t, StringHasher> ids;
+        SegmentedVector<string, 6> names;
+        SegmentedVector<uint32_t, 6> folded;
+    };
+    
+    Stripe stripes[STRIPES];
+    Base base;
+    
+    static size_t stripeOf(string_view text) {
+        return StringHasher()(text) >> (64 - STRIPE_BITS);
+    }
+    
+    string_view baseName(uint32_t atom) const {
+        return string_view(base.text + base.offsets[atom],
+                           base.offsets[atom + 1] - base.offsets[atom]);
+    }
+    
+    uint32_t baseLookup(string_view text) const {
+        if (base.count == 0) return NONE;
+        for (uint64_t i = hashBytes(text.data(), text.size()) & base.slotMask;;
+             i = (i + 1) & base.slotMask) {
+            uint32_t slot = base.slots[i];
+            if (slot == 0) return NONE;
+            if (baseName(slot - 1) == text) return slot - 1;
+        }
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: lookup
+    // Purpose: Finds the id of an existing atom
+    // Returns: The atom id, or NONE if the text was never interned
+    // ------------------------------------------------------------------------
+    uint32_t lookup(string_view text) const {
+        uint32_t atom = baseLookup(text);
+        if (atom != NONE) return atom;
+        
+        const uint32_t* id = stripes[stripeOf(text)].ids.find(text);
+        return id ? *id : NONE;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: intern
+    // Purpose: Returns the id of an atom, creating it if needed
+    // ------------------------------------------------------------------------
+    uint32_t intern(string_view text) {
+        uint32_t id = lookup(text);
+        if (id != NONE) return id;
+        
+        // Intern the lowercase spelling first (it folds to itself)
+        uint32_t fold = NONE;
+        if (hasAsciiUpper(text)) {
+            fold = intern(toLowerAscii(text));
+        }
+        
+        size_t index = stripeOf(text);
+        Stripe& stripe = stripes[index];
+        lock_guard<mutex> lock(stripe.writeMutex);
+        
+        return stripe.ids.findOrInsert(string(text), [&](uint32_t& slot) {
+            size_t local = stripe.names.push_back(string(text));
+            slot = base.count + static_cast<uint32_t>((local << STRIPE_BITS) | index);
+            stripe.folded.push_back(fold == NONE ? slot : fold);
+        });
+    }
+    
+    // Text of an atom
+    string_view name(uint32_t atom) const {
+        if (atom < base.count) return baseName(atom);
+        atom -= base.count;
+        return stripes[atom & (STRIPES - 1)].names[atom >> STRIPE_BITS];
+    }
+    
+    // Id of the atom's lowercase spelling
+    uint32_t folded(uint32_t atom) const {
+        if (atom < base.count) return base.folded[atom];
+        atom -= base.count;
+        return stripes[atom & (STRIPES - 1)].folded[atom >> STRIPE_BITS];
+    }
+    
+    // Number of atoms interned so far
+    size_t size() const {
+        size_t total = base.count;
+        for (const Stripe& stripe : stripes) total += stripe.names.size();
+        return total;
+    }
+    
+    // One past the largest atom id handed out so far
+    size_t idLimit() const {
+        size_t limit = 0;
+        for (size_t i = 0; i < STRIPES; i++) {
+            size_t count = stripes[i].names.size();
+            if (count) limit = max(limit, ((count - 1) << STRIPE_BITS | i) + 1);
+        }
+        return base.count + limit;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: memoryUse
+    // Purpose: Adds up the heap bytes of the atom spellings, the lookup
+    //          tables and the lowercase ids; returns the bytes of snapshot
+    //          atoms read in place. Caller must hold an epoch guard.
+    // ------------------------------------------------------------------------
+    uint64_t memoryUse(MemoryUse& text, MemoryUse& lookup, MemoryUse& foldedIds) const {
+        for (const Stripe& stripe : stripes) {
+            text += stripe.names.memoryUse([](const string& name) {
+                MemoryUse use;
+                use.add(name);
+                return use;
+            });
+            lookup += stripe.ids.memoryUse([](const string& key, uint32_t) {
+                MemoryUse use;
+                use.add(key);
+                return use;
+            });
+            foldedIds += stripe.folded.memoryUse();
+        }
+        if (base.count == 0) return 0;
+        return (base.count + 1) * sizeof(uint64_t) + base.count * sizeof(uint32_t) +
+               (base.slotMask + 1) * sizeof(uint32_t) + base.offsets[base.count];
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: attachBase
+    // Purpose: Serves the atoms of a snapshot in place. Only allowed while
+    //          the table is empty, before any other thread uses it.
+    // ------------------------------------------------------------------------
+    void attachBase(const Base& loaded) {
+        base = loaded;
+    }
+};
+
+// ============================================================================
+// CLASS: PredicateDirectory
+// Purpose: Swiss-table style map from a (name atom, arity) key to a value.
+//          Slots come in groups of 16 with one control byte each, holding 7
+//          bits of the hash or EMPTY; a probe compares a whole group's
+//          control bytes at once with SSE2 and only touches slots whose
+//          byte matches. One writer, lock-free readers: slots are filled
+//          before their control byte is released, and growing publishes a
+//          new table and retires the old one.
+// ============================================================================
+template <typename Value>
+class PredicateDirectory {
+private:
+    static constexpr size_t GROUP = 16;
+    static constexpr uint8_t EMPTY = 0x80;
+    
+    struct Slot {
+        uint64_t key;
+        Value* value;
+    };
+    
+    struct Table {
+        size_t groupMask;
+        unique_ptr<uint8_t[]> control;
+        unique_ptr<Slot[]> slots;
+        
+        explicit Table(size_t groups)
+            : groupMask(groups - 1),
+              control(new uint8_t[groups * GROUP]),
+              slots(new Slot[groups * GROUP]) {
+            memset(control.get(), EMPTY, groups * GROUP);
+        }
+        size_t capacity() const { return (groupMask + 1) * GROUP; }
+    };
+    
+    atomic<Table*> table;
+    vector<unique_ptr<Value>> owned;         // Writer only
+    
+    // Bitmask of the positions in a group whose control byte equals byte.
+    // The group is read as two relaxed 64-bit atomic loads, since the
+    // writer may be filling in one of its bytes concurrently.
+    static uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+        uint64_t low = __atomic_load_n(reinterpret_cast<const uint64_t*>(group),
+                                       __ATOMIC_RELAXED);
+        uint64_t high = __atomic_load_n(reinterpret_cast<const uint64_t*>(group + 8),
+                                        __ATOMIC_RELAXED);
+#ifdef __SSE2__
+        __m128i control = _mm_set_epi64x(static_cast<long long>(high),
+                                         static_cast<long long>(low));
+        return static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP; i++) {
+            uint64_t half = i < 8 ? low : high;
+            if (static_cast<uint8_t>(half >> (8 * (i % 8))) == byte) {
+                mask |= uint32_t(1) << i;
+            }
+        }
+        return mask;
+#endif
+    }
+    
+    // Writes a new entry into a table (writer only)
+    static void place(Table& target, uint64_t key, Value* value) {
+        uint64_t hash = mixHash(key);
+        uint8_t tag = static_cast<uint8_t>(hash & 0x7f);
+        size_t group = (hash >> 7) & target.groupMask;
+        
+        for (size_t step = 1;; step++) {
+            uint8_t* control = target.control.get() + group * GROUP;
+            uint32_t empty = matchByte(control, EMPTY);
+            if (empty) {
+                size_t i = __builtin_ctz(empty);
+                target.slots[group * GROUP + i] = {key, value};
+                __atomic_store_n(&control[i], tag, __ATOMIC_RELEASE);
+                return;
+            }
+            group = (group + step) & target.groupMask;
+        }
+    }
+
+public:
+    PredicateDirectory() : table(new Table(1)) {}
+    ~PredicateDirectory() { delete table.load(); }
+    
+    PredicateDirectory(const PredicateDirectory&) = delete;
+    PredicateDirectory& operator=(const PredicateDirectory&) = delete;
+    
+    static uint64_t makeKey(uint32_t name, size_t arity) {
+        return (uint64_t(name) << 32) | static_cast<uint32_t>(arity);
+    }
+    
+    // Number of entries (writer only)
+    size_t size() const { return owned.size(); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: find
+    // Purpose: Looks a key up; safe from any thread holding an epoch guard
+    // Returns: The value, or nullptr if absent
+    // ------------------------------------------------------------------------
+    Value* find(uint64_t key) const {
+        const Table* current = table.load(memory_order_acquire);
+        uint64_t hash = mixHash(key);
+        uint8_t tag = static_cast<uint8_t>(hash & 0x7f);
+        size_t group = (hash >> 7) & current->groupMask;
+        
+        // Triangular probing over groups visits every group once
+        for (size_t step = 1; step <= current->groupMask + 1; step++) {
+            const uint8_t* control = current->control.get() + group * GROUP;
+            
+            for (uint32_t match = matchByte(control, tag); match;
+                 match &= match - 1) {
+                size_t i = __builtin_ctz(match);
+                
+                // Re-read the byte with acquire before trusting the slot
+                if (__atomic_load_n(&control[i], __ATOMIC_ACQUIRE) == tag &&
+                    current->slots[group * GROUP + i].key == key) {
+                    return current->slots[group * GROUP + i].value;
+                }
+            }
+            if (matchByte(control, EMPTY)) return nullptr;
+            group = (group + step) & current->groupMask;
+        }
+        return nullptr;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: findOrInsert
+    // Purpose: Returns the value for a key. A missing entry is
+    //          default-constructed and passed to init() before readers can
+    //          see it (writer only).
+    // ------------------------------------------------------------------------
+    template <typename Init>
+    Value& findOrInsert(uint64_t key, Init init) {
+        if (Value* existing = find(key)) return *existing;
+        
+        // Keep the load factor at or below 7/8
+        Table* current = table.load(memory_order_relaxed);
+        if ((owned.size() + 1) * 8 > current->capacity() * 7) {
+            Table* grown = new Table((current->groupMask + 1) * 2);
+            for (size_t i = 0; i < current->capacity(); i++) {
+                if (current->control[i] != EMPTY) {
+                    place(*grown, current->slots[i].key, current->slots[i].value);
+                }
+            }
+            table.store(grown, memory_order_release);
+            EpochManager::instance().retire([current] { delete current; });
+            current = grown;
+        }
+        
+        owned.emplace_back(new Value());
+        Value* value = owned.back().get();
+        init(*value);
+        place(*current, key, value);
+        return *value;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: memoryUse
+    // Purpose: Bytes held by the table and the values themselves (writer,
+    //          or a caller holding the writer's lock); what a value owns is
+    //          left to the caller
+    // ------------------------------------------------------------------------
+    MemoryUse memoryUse() const {
+        MemoryUse use;
+        const Table* current = table.load(memory_order_acquire);
+        size_t entries = owned.size();
+        use.add(current, sizeof(Table), sizeof(Table));
+        use.add(current->control.get(), current->capacity(), entries);
+        use.add(current->slots.get(), current->capacity() * sizeof(Slot),
+                entries * sizeof(Slot));
+        use.add(owned);
+        for (const auto& value : owned) use.add(value.get(), sizeof(Value), sizeof(Value));
+        return use;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: forEach
+    // Purpose: Visits every entry as visit(key, value); safe for readers
+    // ------------------------------------------------------------------------
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        const Table* current = table.load(memory_order_acquire);
+        for (size_t i = 0; i < current->capacity(); i++) {
+            if (__atomic_load_n(&current->control[i], __ATOMIC_ACQUIRE) != EMPTY) {
+                visit(current->slots[i].key, *current->slots[i].value);
+            }
+        }
+    }
+};
+
+// ============================================================================
+// CLASS: Metrics
+// Purpose: Process-wide counters and latency histograms for the hot paths.
+//          Every metric is a slot number; each thread adds to its own copy
+//          of the slots without atomic read-modify-writes or shared cache
+//          lines, and a report sums the copies of all threads. Slots are
+//          registered once (by name and labels) and then cached by the
+//          code that counts. Histograms are HDR style: 16 linear
+//          sub-buckets per power of two, about 6% precision from 1 ns up.
+// Example: query_calls{predicate="parent/2",mode="?+"} 42
+// ============================================================================
+enum class MetricsFormat { Text, Json };
+
+class Metrics {
+public:
+    typedef vector<pair<string, string>> Labels;
+    
+    // Slots of one predicate/arity, from PredicateMetrics::first on
+    enum PredicateSlot : uint32_t {
+        FACTS_ADDED,
+        TUPLES_SCANNED,               // Visited by queries, matching or not
+        TUPLES_MATCHED,
+        INDEX_LOOKUPS,                // Queries answered from a column index
+        FULL_SCANS,
+        QUERY_CALLS                   // One slot per binding mode from here
+    };
+    static constexpr size_t MAX_MODE_ARITY = 6;
+    
+    struct PredicateMetrics {
+        uint32_t first = 0;
+        size_t arity = 0;
+        bool other = false;           // Counted under predicate="other"
+        
+        // Slot counting queries with the given bound argument positions
+        uint32_t modeSlot(const vector<uint32_t>& pattern, uint32_t wildcard) const {
+            if (other || arity > MAX_MODE_ARITY) return first + QUERY_CALLS;
+            uint32_t mode = 0;
+            for (size_t i = 0; i < arity; i++) {
+                if (pattern[i] != wildcard) mode |= 1u << i;
+            }
+            return first + QUERY_CALLS + mode;
+        }
+    };
+    
+private:
+    static constexpr size_t MAX_THREADS = 256;
+    static constexpr size_t CHUNK = 1024;          // Slots per allocation
+    static constexpr size_t MAX_CHUNKS = 256;
+    static constexpr size_t SUB_BUCKETS = 16;
+    static constexpr size_t BUCKETS = SUB_BUCKETS + 60 * SUB_BUCKETS;
+    static constexpr size_t HISTOGRAM_SLOTS = BUCKETS + 2;   // + sum, max
+    
+    // One thread's copy of every slot. Written by its owner only; readers
+    // may see a count a moment late but never a torn one.
+    struct alignas(64) ThreadSlots {
+        atomic<atomic<uint64_t>*> chunks[MAX_CHUNKS] = {};
+        atomic<bool> inUse{false};
+    };
+    
+    // Releases the calling thread's copy when the thread exits; the counts
+    // stay and are continued by the next thread to take it
+    struct SlotOwner {
+        ThreadSlots* slots = nullptr;
+        ~SlotOwner() {
+            if (slots) slots->inUse.store(false, memory_order_release);
+        }
+    };
+    
+    struct SlotInfo {
+        string name;
+        Labels labels;
+        bool histogram;               // First slot of a histogram block
+    };
+    
+    ThreadSlots threads[MAX_THREADS];
+    atomic<bool> on{true};
+    
+    mutex registryMutex;
+    vector<SlotInfo> slots;           // Registered slot -> what it counts
+    map<pair<string, Labels>, uint32_t> registered;
+    PredicateDirectory<PredicateMetrics> predicates;   // Writer: registryMutex
+    PredicateMetrics otherPredicates;   // Shared once the slots run out
+    
+    ThreadSlots& localSlots() {
+        static thread_local SlotOwner owner;
+        if (owner.slots) return *owner.slots;
+        
+        for (ThreadSlots& candidate : threads) {
+            bool expected = false;
+            if (!candidate.inUse.load(memory_order_relaxed) &&
+                candidate.inUse.compare_exchange_strong(expected, true)) {
+                owner.slots = &candidate;
+                return candidate;
+            }
+        }
+        throw runtime_error("Metrics: too many concurrent threads");
+    }
+    
+    // Helper function to find the calling thread's copy of a slot
+    atomic<uint64_t>& localSlot(uint32_t slot) {
+        atomic<atomic<uint64_t>*>& chunk = localSlots().chunks[slot / CHUNK];
+        atomic<uint64_t>* values = chunk.load(memory_order_relaxed);
+        if (!values) {
+            values = new atomic<uint64_t>[CHUNK];
+            for (size_t i = 0; i < CHUNK; i++) values[i].store(0, memory_order_relaxed);
+            chunk.store(values, memory_order_release);
+        }
+        return values[slot % CHUNK];
+    }
+    
+    // Helper function to reserve count consecutive slots within one chunk.
+    // Caller must hold registryMutex.
+    // Returns: The first slot, or NO_SLOT if they do not fit
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    uint32_t tryAllocate(size_t count) {
+        size_t first = slots.size();
+        if (first / CHUNK != (first + count - 1) / CHUNK) {
+            first = (first / CHUNK + 1) * CHUNK;            // After padding
+        }
+        if (first + count > CHUNK * MAX_CHUNKS) return NO_SLOT;
+        slots.resize(first + count);
+        return static_cast<uint32_t>(first);
+    }
+    
+    uint32_t allocate(size_t count) {
+        uint32_t first = tryAllocate(count);
+        if (first == NO_SLOT) throw runtime_error("Metrics: too many metrics");
+        return first;
+    }
+    
+    // Helper function to name the slots of a predicate, or of the shared
+    // "other" block (one query_calls slot). Caller must hold registryMutex.
+    void nameSlots(const PredicateMetrics& metrics, const string& name) {
+        const char* names[] = {"facts_added", "tuples_scanned", "tuples_matched",
+                               "index_lookups", "full_scans"};
+        for (uint32_t i = 0; i < QUERY_CALLS; i++) {
+            slots[metrics.first + i] = {names[i], {{"predicate", name}}, false};
+        }
+        bool anyMode = metrics.other || metrics.arity > MAX_MODE_ARITY;
+        size_t modes = anyMode ? 1 : size_t(1) << metrics.arity;
+        for (size_t mode = 0; mode < modes; mode++) {
+            string bound;
+            for (size_t i = 0; i < metrics.arity; i++) bound += mode >> i & 1 ? '+' : '?';
+            if (anyMode) bound = "*";
+            slots[metrics.first + QUERY_CALLS + mode] =
+                {"query_calls", {{"predicate", name}, {"mode", bound}}, false};
+        }
+    }
+    
+    // Helper function to register a counter; once the slots run out it is
+    // counted in metrics_overflow. Caller must hold registryMutex.
+    uint32_t registerCounter(const string& name, const Labels& labels) {
+        auto found = registered.find({name, labels});
+        if (found != registered.end()) return found->second;
+        uint32_t slot = tryAllocate(1);
+        if (slot == NO_SLOT) return overflowCounter;
+        slots[slot] = {name, labels, false};
+        registered[{name, labels}] = slot;
+        return slot;
+    }
+    
+    // Helper function for the histogram bucket of a value
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        unsigned exponent = 63 - __builtin_clzll(value);
+        return SUB_BUCKETS * (exponent - 3) + ((value >> (exponent - 4)) & (SUB_BUCKETS - 1));
+    }
+    
+    // Helper function for the middle of a histogram bucket
+    static uint64_t bucketValue(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        unsigned exponent = static_cast<unsigned>(bucket / SUB_BUCKETS) + 3;
+        uint64_t low = (SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 4);
+        return low + (uint64_t(1) << (exponent - 4)) / 2;
+    }
+    
+    // Helper function to sum the copies of every slot
+    vector<uint64_t> totals(size_t count) const {
+        vector<uint64_t> sums(count, 0);
+        for (const ThreadSlots& thread : threads) {
+            for (size_t c = 0; c * CHUNK < count; c++) {
+                const atomic<uint64_t>* values = thread.chunks[c].load(memory_order_acquire);
+                if (!values) continue;
+                for (size_t i = 0; i < CHUNK && c * CHUNK + i < count; i++) {
+                    sums[c * CHUNK + i] += values[i].load(memory_order_relaxed);
+                }
+            }
+        }
+        return sums;
+    }
+    
+    Metrics() {
+        slots.reserve(CHUNK);
+        overflowCounter = counter("metrics_overflow");
+        unresolvedQueries = counter("query_unresolved");
+        unparsedSentences = counter("sentences_unparsed");
+        queryLatency = histogram("query_latency_ns");
+        parseLatency = histogram("parse_text_latency_ns");
+        processQueryLatency = histogram("process_query_latency_ns");
+        
+        otherPredicates.other = true;
+        otherPredicates.first = allocate(QUERY_CALLS + 1);
+        nameSlots(otherPredicates, "other");
+    }
+    
+public:
+    // Slots of the metrics that have no labels
+    uint32_t overflowCounter;         // Counters registered after slots ran out
+    uint32_t unresolvedQueries;       // Unknown predicate or argument atoms
+    uint32_t unparsedSentences;       // "Could not parse sentence pattern"
+    uint32_t queryLatency;
+    uint32_t parseLatency;
+    uint32_t processQueryLatency;
+    
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+    
+    ~Metrics() {
+        for (ThreadSlots& thread : threads) {
+            for (auto& chunk : thread.chunks) delete[] chunk.load();
+        }
+    }
+    
+    // Counting can be switched off; the slots keep what they have
+    bool enabled() const { return on.load(memory_order_relaxed); }
+    void setEnabled(bool enabled) { on.store(enabled); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: counter / histogram
+    // Purpose: Registers a metric, or finds the one registered before
+    // Returns: Its slot, to pass to add() or record()
+    // ------------------------------------------------------------------------
+    uint32_t counter(const string& name, const Labels& labels = {}) {
+        lock_guard<mutex> lock(registryMutex);
+        return registerCounter(name, labels);
+    }
+    
+    uint32_t histogram(const string& name, const Labels& labels = {}) {
+        lock_guard<mutex> lock(registryMutex);
+        auto found = registered.find({name, labels});
+        if (found != registered.end()) return found->second;
+        uint32_t slot = allocate(HISTOGRAM_SLOTS);
+        slots[slot] = {name, labels, true};
+        registered[{name, labels}] = slot;
+        return slot;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: predicate
+    // Purpose: Finds the slots of one predicate/arity, registering them on
+    //          first use. Once the slots run out, further predicates share
+    //          the predicate="other" slots. Caller must hold an epoch guard.
+    // Parameters:
+    //   - key: PredicateDirectory key of the predicate
+    //   - label: Called once, to name the predicate ("parent/2")
+    // ------------------------------------------------------------------------
+    template <typename Label>
+    const PredicateMetrics& predicate(uint64_t key, size_t arity, Label label) {
+        if (const PredicateMetrics* found = predicates.find(key)) return *found;
+        
+        lock_guard<mutex> lock(registryMutex);
+        return predicates.findOrInsert(key, [&](PredicateMetrics& created) {
+            size_t modes = arity > MAX_MODE_ARITY ? 1 : size_t(1) << arity;
+            created.arity = arity;
+            created.first = tryAllocate(QUERY_CALLS + modes);
+            if (created.first == NO_SLOT) {
+                created = otherPredicates;
+                return;
+            }
+            nameSlots(created, label());
+        });
+    }
+    
+    // Adds to a counter of the calling thread
+    void add(uint32_t slot, uint64_t count = 1) {
+        atomic<uint64_t>& value = localSlot(slot);
+        value.store(value.load(memory_order_relaxed) + count, memory_order_relaxed);
+    }
+    
+    // Records one value, e.g. a latency in nanoseconds, in a histogram
+    void record(uint32_t histogramSlot, uint64_t value) {
+        add(histogramSlot + static_cast<uint32_t>(bucketOf(value)));
+        add(histogramSlot + BUCKETS, value);
+        atomic<uint64_t>& maximum = localSlot(histogramSlot + BUCKETS + 1);
+        if (value > maximum.load(memory_order_relaxed)) {
+            maximum.store(value, memory_order_relaxed);
+        }
+    }
+    
+    // Helper for timing a call: the current time in nanoseconds
+    static uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: write
+    // Purpose: Writes every counter that is not zero and a summary of every
+    //          histogram that has values, as text or as one JSON object
+    // ------------------------------------------------------------------------
+    void write(ostream& out, MetricsFormat format) {
+        vector<SlotInfo> info;
+        {
+            lock_guard<mutex> lock(registryMutex);
+            info = slots;
+        }
+        vector<uint64_t> sums = totals(info.size());
+        
+        auto labelText = [&](const Labels& labels, bool json) {
+            string text;
+            for (const auto& label : labels) {
+                if (!text.empty()) text += ',';
+                text += json ? "\"" + label.first + "\":\"" : label.first + "=\"";
+                for (char c : label.second) {
+                    if (c == '"' || c == '\\') text += '\\';
+                    text += c;
+                }
+                text += '"';
+            }
+            return text;
+        };
+        
+        string counters;
+        string histograms;
+        for (size_t slot = 0; slot < info.size(); slot++) {
+            const SlotInfo& metric = info[slot];
+            if (metric.name.empty()) continue;
+            
+            if (!metric.histogram) {
+                if (sums[slot] == 0) continue;
+                if (format == MetricsFormat::Json) {
+                    counters += counters.empty() ? "" : ",";
+                    counters += "{\"name\":\"" + metric.name + "\",\"labels\":{" +
+                                labelText(metric.labels, true) + "},\"value\":" +
+                                to_string(sums[slot]) + "}";
+                } else {
+                    counters += metric.name;
+                    if (!metric.labels.empty()) {
+                        counters += "{" + labelText(metric.labels, false) + "}";
+                    }
+                    counters += " " + to_string(sums[slot]) + "\n";
+                }
+                continue;
+            }
+            
+            // Maximum over threads; the sums of the max slots mean nothing
+            uint64_t maximum = 0;
+            for (const ThreadSlots& thread : threads) {
+                size_t at = slot + BUCKETS + 1;
+                const atomic<uint64_t>* values =
+                    thread.chunks[at / CHUNK].load(memory_order_acquire);
+                if (values) maximum = max(maximum, values[at % CHUNK].load(memory_order_relaxed));
+            }
+            uint64_t count = 0;
+            for (size_t b = 0; b < BUCKETS; b++) count += sums[slot + b];
+            if (count == 0) continue;
+            
+            auto percentile = [&](double fraction) {
+                uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * count)));
+                uint64_t seen = 0;
+                for (size_t b = 0; b < BUCKETS; b++) {
+                    seen += sums[slot + b];
+                    if (seen >= rank) return min(bucketValue(b), maximum);
+                }
+                return maximum;
+            };
+            const pair<const char*, double> quantiles[] = {
+                {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+            uint64_t mean = sums[slot + BUCKETS] / count;
+            
+            if (format == MetricsFormat::Json) {
+                histograms += histograms.empty() ? "" : ",";
+                histograms += "{\"name\":\"" + metric.name + "\",\"labels\":{" +
+                              labelText(metric.labels, true) + "},\"count\":" +
+                              to_string(count) + ",\"mean\":" + to_string(mean);
+                for (const auto& quantile : quantiles) {
+                    histograms += ",\"" + string(quantile.first) + "\":" +
+                                  to_string(percentile(quantile.second));
+                }
+                histograms += ",\"max\":" + to_string(maximum) + "}";
+            } else {
+                histograms += metric.name;
+                if (!metric.labels.empty()) {
+                    histograms += "{" + labelText(metric.labels, false) + "}";
+                }
+                histograms += " count=" + to_string(count) + " mean=" + to_string(mean);
+                for (const auto& quantile : quantiles) {
+                    histograms += " " + string(quantile.first) + "=" +
+                                  to_string(percentile(quantile.second));
+                }
+                histograms += " max=" + to_string(maximum) + "\n";
+            }
+        }
+        
+        if (format == MetricsFormat::Json) {
+            out << "{\"counters\":[" << counters << "],\"histograms\":["
+                << histograms << "]}\n";
+        } else {
+            out << "# Counters\n" << counters
+                << "# Latency histograms (nanoseconds)\n" << histograms;
+        }
+    }
+};
+
+// ============================================================================
+// UTILITY: allocation counting
+// Purpose: Counts the heap allocations made by each thread, so a query
+//          profile can say how much memory a query allocated. The global
+//          operator new is replaced by one that adds to thread-local
+//          totals (two additions, no atomics). That affects the whole
+//          program, so it is opt-in: the command-line build turns it on
+//          (-DPROLOG_NO_ALLOCATION_COUNTING turns it off again), programs
+//          that include this file with PROLOG_NO_MAIN build with
+//          -DPROLOG_COUNT_ALLOCATIONS to get it. Without it, profiles
+//          leave allocations out.
+// ============================================================================
+#if !defined(PROLOG_NO_MAIN) && !defined(PROLOG_NO_ALLOCATION_COUNTING) && \
+    !defined(PROLOG_COUNT_ALLOCATIONS)
+#define PROLOG_COUNT_ALLOCATIONS 1
+#endif
+
+#ifdef PROLOG_COUNT_ALLOCATIONS
+static constexpr bool ALLOCATION_COUNTING = true;
+#else
+static constexpr bool ALLOCATION_COUNTING = false;
+#endif
+
+struct AllocationTotals {
+    uint64_t bytes = 0;
+    uint64_t count = 0;
+    
+    AllocationTotals operator-(const AllocationTotals& earlier) const {
+        return {bytes - earlier.bytes, count - earlier.count};
+    }
+};
+
+thread_local AllocationTotals threadAllocations;
+
+#ifdef PROLOG_COUNT_ALLOCATIONS
+void* operator new(size_t size) {
+    threadAllocations.bytes += size;
+    threadAllocations.count++;
+    for (;;) {
+        if (void* block = malloc(size ? size : 1)) return block;
+        new_handler handler = get_new_handler();
+        if (!handler) throw bad_alloc();
+        handler();
+    }
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return operator new(size, nothrow);
+}
+
+// Kept out of line: inlined into a container, GCC would see free() paired
+// with operator new and warn
+[[gnu::noinline]] void operator delete(void* block) noexcept {
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete[](void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    operator delete(block);
+}
+
+void operator delete[](void* block, size_t) noexcept {
+    operator delete[](block);
+}
+
+void operator delete(void* block, const nothrow_t&) noexcept {
+    operator delete(block);
+}
+
+void operator delete[](void* block, const nothrow_t&) noexcept {
+    operator delete[](block);
+}
+#endif
+
+// ============================================================================
+// STRUCT: QueryProfile
+// Purpose: EXPLAIN ANALYZE for a query or a question: what each goal (one
+//          database lookup) resolved to, the access path taken in each
+//          place its facts live (full scan or which column index), the
+//          tuples examined and produced, the time of every stage and the
+//          memory allocated. Filled in by PrologDatabase::profileQuery and
+//          QueryEngine::explain.
+// ============================================================================
+struct QueryProfile {
+    // One search of the snapshot or of a shard
+    struct Access {
+        string source;                    // "snapshot" or "shard N"
+        string path;                      // e.g. "index on argument 2 (3 postings)"
+        uint64_t examined = 0;            // Tuples looked at
+        uint64_t produced = 0;            // Tuples that matched
+        uint64_t nanos = 0;
+    };
+    
+    struct Goal {
+        string goal;                      // As asked, e.g. parent(?, mary)
+        string predicate;                 // Resolved, e.g. parent/2
+        string unresolved;                // Why it could not be resolved
+        vector<Access> accesses;
+        uint64_t rows = 0;
+        uint64_t resolveNanos = 0;        // Atom lookups of the pattern
+        uint64_t nanos = 0;
+        AllocationTotals allocated;
+    };
+    
+    string question;                      // Empty when profiling one query
+    vector<pair<string, uint64_t>> stages;   // Question stages and their times
+    vector<Goal> goals;
+    string answer;                        // What the question printed
+    uint64_t nanos = 0;
+    AllocationTotals allocated;
+    
+    // Helper function to write a goal as Prolog, e.g. parent(?, mary)
+    static string describe(const string& predicate, const vector<string>& arguments) {
+        string text = predicate;
+        if (arguments.empty()) return text;
+        text += '(';
+        for (size_t i = 0; i < arguments.size(); i++) {
+            if (i) text += ", ";
+            text += arguments[i];
+        }
+        return text + ')';
+    }
+    
+    static string milliseconds(uint64_t nanos) {
+        ostringstream text;
+        text << fixed << setprecision(3) << nanos / 1e6 << " ms";
+        return text.str();
+    }
+    
+    static string allocations(const AllocationTotals& totals) {
+        if (!ALLOCATION_COUNTING) return "allocations not counted";
+        return to_string(totals.count) +
+               (totals.count == 1 ? " allocation, " : " allocations, ") +
+               formatBytes(totals.bytes);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: write
+    // Purpose: Prints the profile as an indented plan, one line per stage
+    //          and per access
+    // ------------------------------------------------------------------------
+    void write(ostream& out) const {
+        if (!question.empty()) out << "Question: " << question << "\n";
+        out << "Total: " << milliseconds(nanos) << ", " << allocations(allocated) << "\n";
+        for (const auto& stage : stages) {
+            out << "  " << left << setw(24) << stage.first << right
+                << milliseconds(stage.second) << "\n";
+        }
+        for (size_t g = 0; g < goals.size(); g++) {
+            const Goal& goal = goals[g];
+            out << "Goal " << g + 1 << ": " << goal.goal << "\n";
+            if (goal.predicate.empty()) {
+                out << "  Not resolved: " << goal.unresolved << "\n";
+            } else {
+                out << "  Predicate: " << goal.predicate << "\n";
+            }
+            out << "  Rows: " << goal.rows << ", " << milliseconds(goal.nanos)
+                << " (resolve " << milliseconds(goal.resolveNanos) << "), "
+                << allocations(goal.allocated) << "\n";
+            for (const Access& access : goal.accesses) {
+                out << "  -> " << access.source << ": " << access.path
+                    << "  examined=" << access.examined
+                    << " produced=" << access.produced << "  "
+                    << milliseconds(access.nanos) << "\n";
+            }
+        }
+        if (!answer.empty()) {
+            out << "Answer:\n";
+            istringstream lines(answer);
+            for (string line; getline(lines, line);) {
+                if (!line.empty()) out << "  " << line << "\n";
+            }
+        }
+    }
+};
+
+// ============================================================================
+// CLASS: Tracer
+// Purpose: Optional timeline of the ingest and query pipelines, written as
+//          Chrome Trace Event JSON (chrome://tracing or ui.perfetto.dev).
+//          Each thread records its events into its own ring buffer with
+//          relaxed stores and no locks; a full ring overwrites its oldest
+//          events. Off until setEnabled(true), and then a disabled scope
+//          costs one relaxed load; build with -DPROLOG_NO_TRACING to
+//          compile the scopes away altogether.
+// Example: { TraceScope scope("query", "database"); ... }
+// ============================================================================
+class Tracer {
+public:
+    static constexpr size_t RING_EVENTS = size_t(1) << 16;   // Per thread
+    
+private:
+    static constexpr size_t MAX_THREADS = 256;
+    
+    // A complete event. Fields are atomics only so that a flush running
+    // alongside the owner is well defined; torn events are discarded.
+    struct Event {
+        atomic<const char*> name{nullptr};
+        atomic<const char*> category{nullptr};
+        atomic<const char*> valueName{nullptr};   // Optional argument
+        atomic<uint64_t> value{0};
+        atomic<uint64_t> begin{0};
+        atomic<uint64_t> end{0};
+    };
+    
+    // One thread's ring. The owner bumps claimed before it overwrites a
+    // slot and head after, so a reader can tell which slots it may have
+    // seen half written.
+    struct alignas(64) Ring {
+        atomic<Event*> events{nullptr};           // Made on the first event
+        atomic<uint64_t> claimed{0};
+        atomic<uint64_t> head{0};                 // Events completed
+        atomic<const char*> threadName{nullptr};
+        atomic<bool> inUse{false};
+    };
+    
+    // Releases the calling thread's ring when the thread exits; its events
+    // stay until the next thread to take the ring overwrites them
+    struct RingOwner {
+        Ring* ring = nullptr;
+        ~RingOwner() {
+            if (ring) ring->inUse.store(false, memory_order_release);
+        }
+    };
+    
+    Ring rings[MAX_THREADS];
+    uint64_t origin = Metrics::now();         // Time zero of the trace
+    mutex namesMutex;
+    set<string> names;                        // Interned event names
+    
+#ifndef PROLOG_NO_TRACING
+    static inline atomic<bool> active{false};
+#endif
+    
+    Ring& localRing() {
+        static thread_local RingOwner owner;
+        if (owner.ring) return *owner.ring;
+        
+        for (Ring& candidate : rings) {
+            bool expected = false;
+            if (!candidate.inUse.load(memory_order_relaxed) &&
+                candidate.inUse.compare_exchange_strong(expected, true)) {
+                owner.ring = &candidate;
+                return candidate;
+            }
+        }
+        throw runtime_error("Tracer: too many concurrent threads");
+    }
+    
+    Tracer() = default;
+    
+    ~Tracer() {
+        for (Ring& ring : rings) delete[] ring.events.load(memory_order_relaxed);
+    }
+
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+    
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+    
+    static bool enabled() {
+#ifdef PROLOG_NO_TRACING
+        return false;
+#else
+        return active.load(memory_order_relaxed);
+#endif
+    }
+    
+    static void setEnabled(bool on) {
+#ifndef PROLOG_NO_TRACING
+        active.store(on, memory_order_relaxed);
+#else
+        (void)on;
+#endif
+    }
+    
+    // Interns a name made at run time, e.g. of a grammar pattern; the
+    // result stays valid for the life of the process
+    const char* intern(const string& name) {
+        lock_guard<mutex> lock(namesMutex);
+        return names.insert(name).first->c_str();
+    }
+    
+    // Names the calling thread in the timeline (a string literal)
+    void setThreadName(const char* name) {
+        if (enabled()) localRing().threadName.store(name, memory_order_relaxed);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: record
+    // Purpose: Adds a complete event to the calling thread's ring. The
+    //          strings must outlive the tracer (literals or interned).
+    // ------------------------------------------------------------------------
+    void record(const char* name, const char* category, uint64_t begin, uint64_t end,
+                const char* valueName = nullptr, uint64_t value = 0) {
+        Ring& ring = localRing();
+        Event* events = ring.events.load(memory_order_relaxed);
+        if (!events) {
+            events = new Event[RING_EVENTS];
+            ring.events.store(events, memory_order_release);
+        }
+        uint64_t index = ring.head.load(memory_order_relaxed);
+        ring.claimed.store(index + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        
+        Event& event = events[index & (RING_EVENTS - 1)];
+        event.name.store(name, memory_order_relaxed);
+        event.category.store(category, memory_order_relaxed);
+        event.valueName.store(valueName, memory_order_relaxed);
+        event.value.store(value, memory_order_relaxed);
+        event.begin.store(begin, memory_order_relaxed);
+        event.end.store(end, memory_order_relaxed);
+        ring.head.store(index + 1, memory_order_release);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: write
+    // Purpose: Writes the events of every ring as Chrome Trace Event JSON,
+    //          with one timeline row per thread. Safe while threads are
+    //          still recording; their newest events may be missing.
+    // ------------------------------------------------------------------------
+    void write(ostream& out) {
+        struct Copied {
+            const char* name;
+            const char* category;
+            const char* valueName;
+            uint64_t value;
+            uint64_t begin;
+            uint64_t end;
+            size_t thread;
+        };
+        vector<Copied> copied;
+        
+        auto quoted = [](const char* text) {
+            string result = "\"";
+            for (const char* c = text; *c; c++) {
+                if (*c == '"' || *c == '\\') result += '\\';
+                if (static_cast<unsigned char>(*c) >= 0x20) result += *c;
+            }
+            return result + "\"";
+        };
+        auto micros = [](uint64_t nanos) {
+            string fraction = to_string(nanos % 1000);
+            return to_string(nanos / 1000) + "." + string(3 - fraction.size(), '0') +
+                   fraction;
+        };
+        
+        string text = "{\"traceEvents\":[\n"
+                      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"args\":{\"name\":\"prolog_text_parser\"}}";
+        for (size_t t = 0; t < MAX_THREADS; t++) {
+            Ring& ring = rings[t];
+            const Event* events = ring.events.load(memory_order_acquire);
+            if (!events) continue;
+            
+            const char* threadName = ring.threadName.load(memory_order_relaxed);
+            text += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+                    to_string(t) + ",\"args\":{\"name\":" +
+                    quoted(threadName ? threadName : ("thread " + to_string(t)).c_str()) +
+                    "}}";
+            
+            uint64_t head = ring.head.load(memory_order_acquire);
+            uint64_t first = head > RING_EVENTS ? head - RING_EVENTS : 0;
+            size_t start = copied.size();
+            for (uint64_t index = first; index < head; index++) {
+                const Event& event = events[index & (RING_EVENTS - 1)];
+                copied.push_back({event.name.load(memory_order_relaxed),
+                                  event.category.load(memory_order_relaxed),
+                                  event.valueName.load(memory_order_relaxed),
+                                  event.value.load(memory_order_relaxed),
+                                  event.begin.load(memory_order_relaxed),
+                                  event.end.load(memory_order_relaxed), t});
+            }
+            
+            // Drop the slots the owner has started to overwrite since
+            atomic_thread_fence(memory_order_acquire);
+            uint64_t claimed = ring.claimed.load(memory_order_relaxed);
+            if (claimed > first + RING_EVENTS) {
+                size_t torn = min<uint64_t>(claimed - RING_EVENTS - first, head - first);
+                copied.erase(copied.begin() + start, copied.begin() + start + torn);
+            }
+        }
+        
+        stable_sort(copied.begin(), copied.end(),
+                    [](const Copied& a, const Copied& b) { return a.begin < b.begin; });
+        for (const Copied& event : copied) {
+            text += ",\n{\"name\":" + quoted(event.name) + ",\"cat\":" +
+                    quoted(event.category) + ",\"ph\":\"X\",\"pid\":1,\"tid\":" +
+                    to_string(event.thread) + ",\"ts\":" +
+                    micros(event.begin > origin ? event.begin - origin : 0) +
+                    ",\"dur\":" + micros(event.end - event.begin);
+            if (event.valueName) {
+                text += ",\"args\":{" + quoted(event.valueName) + ":" +
+                        to_string(event.value) + "}";
+            }
+            text += "}";
+            if (text.size() > 1 << 20) {
+                out << text;
+                text.clear();
+            }
+        }
+        out << text << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+};
+
+// ============================================================================
+// CLASS: TraceScope
+// Purpose: Records one Tracer event covering its own lifetime, if tracing
+//          was on when it began. An optional number (rows, facts, ...) is
+//          shown with the event.
+// ============================================================================
+class TraceScope {
+private:
+    const char* name = nullptr;
+    const char* category = nullptr;
+    const char* valueName = nullptr;
+    uint64_t value = 0;
+    uint64_t begin = 0;
+
+public:
+    // A null name records nothing, for names that are costly to make
+    TraceScope(const char* eventName, const char* eventCategory) {
+        if (Tracer::enabled() && eventName) {
+            name = eventName;
+            category = eventCategory;
+            begin = Metrics::now();
+        }
+    }
+    
+    ~TraceScope() {
+        if (name) {
+            Tracer::instance().record(name, category, begin, Metrics::now(),
+                                      valueName, value);
+        }
+    }
+    
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+    
+    void setValue(const char* label, uint64_t number) {
+        valueName = label;
+        value = number;
+    }
+};
+
+// ============================================================================
+// CLASS: FactBatch
+// Purpose: A list of facts whose spellings are stored back to back in one
+//          buffer, so a batch can be filled on one thread and inserted on
+//          another without allocating per fact
+// ============================================================================
+class FactBatch {
+private:
+    string text;                          // Every term of every fact, in order
+    vector<uint32_t> termEnds;            // End offset of each term in text
+    vector<uint32_t> factStarts;          // First term (the predicate) of each fact
+    
+    string_view term(size_t index) const {
+        size_t begin = index ? termEnds[index - 1] : 0;
+        return string_view(text.data() + begin, termEnds[index] - begin);
+    }
+
+public:
+    void clear() {
+        text.clear();
+        termEnds.clear();
+        factStarts.clear();
+    }
+    bool empty() const { return factStarts.empty(); }
+    size_t size() const { return factStarts.size(); }
+    
+    void add(string_view predicate, const string_view* arguments, size_t count) {
+        factStarts.push_back(static_cast<uint32_t>(termEnds.size()));
+        text.append(predicate);
+        termEnds.push_back(static_cast<uint32_t>(text.size()));
+        for (size_t i = 0; i < count; i++) {
+            text.append(arguments[i]);
+            termEnds.push_back(static_cast<uint32_t>(text.size()));
+        }
+    }
+    
+    // Calls visit(predicate, arguments, count) for each fact in order
+    template <typename Visitor>
+    void forEach(Visitor&& visit) const {
+        string_view local[8];
+        vector<string_view> spill;
+        for (size_t f = 0; f < factStarts.size(); f++) {
+            size_t first = factStarts[f];
+            size_t end = f + 1 < factStarts.size() ? factStarts[f + 1]
+                                                   : termEnds.size();
+            size_t count = end - first - 1;
+            
+            string_view* arguments = local;
+            if (count > 8) {
+                spill.resize(count);
+                arguments = spill.data();
+            }
+            for (size_t i = 0; i < count; i++) {
+                arguments[i] = term(first + 1 + i);
+            }
+            visit(term(first), static_cast<const string_view*>(arguments), count);
+        }
+    }
+};
+
+// ============================================================================
+// CLASS: WriteAheadLog
+// Purpose: Append-only log of database changes, so that facts survive a
+//          crash. Records are buffered in memory and written by whichever
+//          thread needs them on disk first: with SyncPolicy::Commit every
+//          writer waits for its record to be synced, but writers that
+//          arrive while a sync is running share the next one (group commit).
+//          Record: payload size (uint32), checksum (uint32), payload.
+//          A change is visible to readers as soon as it is applied, which is
+//          before it is durable under every policy: the writer releases its
+//          locks first so that others can join its sync. A reader may thus
+//          act on a fact that a crash then loses; only the return of the
+//          call that made the change says it is on disk (SyncPolicy::Commit).
+// ============================================================================
+class WriteAheadLog {
+public:
+    enum class SyncPolicy {
+        Commit,         // A change is synced before the call making it returns
+        Interval,       // Synced in the background; a crash loses one interval
+        None            // Written in the background, synced by the OS
+    };
+    
+    enum RecordType : uint8_t {
+        ADD = 1,        // predicate, arguments...
+        RETRACT = 2     // One fact removed: predicate, arguments...
+    };
+
+private:
+    string path;
+    SyncPolicy policy;
+    chrono::milliseconds interval;
+#ifdef PROLOG_HAVE_POSIX
+    int fd = -1;
+#else
+    ofstream file;
+#endif
+    
+    mutex logMutex;
+    condition_variable flushed;
+    string pending;                       // Appended but not yet written
+    string writing;                       // Buffer of the flush in progress
+    uint64_t appendedEnd = 0;             // Log positions, in bytes
+    uint64_t durableEnd = 0;
+    bool flushing = false;
+    bool failed = false;
+    bool shuttingDown = false;
+    
+    condition_variable flushWanted;
+    thread flusher;                       // Interval and None policies only
+    
+    static void appendRecord(string& out, RecordType type, string_view predicate,
+                             const string_view* arguments, size_t count) {
+        BinaryWriter payload;
+        payload.pod(static_cast<uint8_t>(type));
+        payload.pod(static_cast<uint32_t>(count + 1));
+        payload.str(predicate);
+        for (size_t i = 0; i < count; i++) payload.str(arguments[i]);
+        
+        BinaryWriter record;
+        record.pod(static_cast<uint32_t>(payload.bytes.size()));
+        record.pod(static_cast<uint32_t>(
+            hashBytes(payload.bytes.data(), payload.bytes.size())));
+        out += record.bytes;
+        out += payload.bytes;
+    }
+    
+    void writeOut(const string& bytes, bool sync) {
+#ifdef PROLOG_HAVE_POSIX
+        for (size_t done = 0; done < bytes.size();) {
+            ssize_t written = ::write(fd, bytes.data() + done, bytes.size() - done);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Cannot write " + path);
+            }
+            done += static_cast<size_t>(written);
+        }
+        if (sync && fdatasync(fd) != 0) throw runtime_error("Cannot sync " + path);
+#else
+        file.write(bytes.data(), bytes.size());
+        if (sync) file.flush();
+        if (!file) throw runtime_error("Cannot write " + path);
+#endif
+    }
+    
+    // Writes everything appended so far; lock is released meanwhile.
+    // Only one flush runs at a time.
+    void flushLocked(unique_lock<mutex>& lock, bool sync) {
+        flushing = true;
+        writing.swap(pending);
+        uint64_t end = appendedEnd;
+        lock.unlock();
+        
+        bool ok = true;
+        try {
+            writeOut(writing, sync);
+        } catch (const runtime_error&) {
+            ok = false;
+        }
+        writing.clear();
+        
+        lock.lock();
+        flushing = false;
+        if (ok) {
+            durableEnd = max(durableEnd, end);
+        } else {
+            failed = true;
+        }
+        flushed.notify_all();
+    }
+    
+    void flushLoop() {
+        unique_lock<mutex> lock(logMutex);
+        while (!shuttingDown) {
+            flushWanted.wait_for(lock, interval);
+            if (!flushing && !pending.empty()) {
+                flushLocked(lock, policy == SyncPolicy::Interval);
+            }
+        }
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // Constructor: opens (or creates) the log for appending. Call replay()
+    // first to read back what an earlier run left in it.
+    // Throws runtime_error if the file cannot be opened.
+    // ------------------------------------------------------------------------
+    WriteAheadLog(const string& logPath, SyncPolicy syncPolicy = SyncPolicy::Commit,
+                  chrono::milliseconds syncInterval = chrono::milliseconds(100))
+        : path(logPath), policy(syncPolicy), interval(syncInterval) {
+#ifdef PROLOG_HAVE_POSIX
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) throw runtime_error("Cannot open " + path);
+#else
+        file.open(path, ios::binary | ios::app);
+        if (!file) throw runtime_error("Cannot open " + path);
+#endif
+        if (policy != SyncPolicy::Commit) {
+            flusher = thread([this] { flushLoop(); });
+        }
+    }
+    
+    // Destructor: writes out whatever is still buffered
+    ~WriteAheadLog() {
+        {
+            unique_lock<mutex> lock(logMutex);
+            shuttingDown = true;
+            while (flushing) flushed.wait(lock);
+            if (!pending.empty() && !failed) {
+                flushLocked(lock, policy != SyncPolicy::None);
+            }
+        }
+        flushWanted.notify_all();
+        if (flusher.joinable()) flusher.join();
+#ifdef PROLOG_HAVE_POSIX
+        ::close(fd);
+#endif
+    }
+    
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    
+    SyncPolicy syncPolicy() const { return policy; }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: replay
+    // Purpose: Reads the records of a log file in order. A torn or damaged
+    //          record ends the log: it and everything after it are cut off,
+    //          so that new records follow the last good one.
+    // Parameters:
+    //   - visit: Called as visit(type, predicate, arguments, count)
+    // Returns: Number of records replayed
+    // ------------------------------------------------------------------------
+    template <typename Visitor>
+    static size_t replay(const string& logPath, Visitor visit) {
+        {
+            ifstream probe(logPath);
+            if (!probe) return 0;         // No log yet
+        }
+        MappedFile file(logPath);
+        string_view rest(file.data(), file.size());
+        size_t records = 0;
+        size_t good = 0;
+        vector<string_view> terms;
+        
+        while (rest.size() >= 8) {
+            BinaryReader header{rest.substr(0, 8)};
+            uint32_t size = header.pod<uint32_t>();
+            uint32_t checksum = header.pod<uint32_t>();
+            if (rest.size() - 8 < size) break;
+            string_view payload = rest.substr(8, size);
+            if (static_cast<uint32_t>(hashBytes(payload.data(), payload.size())) !=
+                checksum) {
+                break;
+            }
+            
+            BinaryReader in{payload};
+            uint8_t type = in.pod<uint8_t>();
+            uint32_t count = in.pod<uint32_t>();
+            if (count == 0 || count > in.bytes.size()) break;
+            terms.clear();
+            for (uint32_t i = 0; i < count && in.ok; i++) {
+                uint32_t length = in.pod<uint32_t>();
+                if (in.bytes.size() < length) in.ok = false;
+                if (!in.ok) break;
+                terms.push_back(in.bytes.substr(0, length));
+                in.bytes.remove_prefix(length);
+            }
+            if (!in.ok || (type != ADD && type != RETRACT)) break;
+            
+            visit(static_cast<RecordType>(type), terms[0],
+                  static_cast<const string_view*>(terms.data() + 1), terms.size() - 1);
+            records++;
+            good += 8 + size;
+            rest.remove_prefix(8 + size);
+        }
+        
+        if (good < file.size()) {
+            cerr << "Write-ahead log " << logPath << ": dropping "
+                 << file.size() - good << " bytes of incomplete records\n";
+            file = MappedFile();
+#ifdef PROLOG_HAVE_POSIX
+            if (truncate(logPath.c_str(), static_cast<off_t>(good)) != 0) {
+                throw runtime_error("Cannot truncate " + logPath);
+            }
+#else
+            string kept;
+            {
+                ifstream in(logPath, ios::binary);
+                kept.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+            }
+            ofstream out(logPath, ios::binary | ios::trunc);
+            out.write(kept.data(), good);
+#endif
+        }
+        return records;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: append
+    // Purpose: Buffers one record. Nothing is written yet.
+    // Returns: The log position to pass to waitDurable
+    // ------------------------------------------------------------------------
+    uint64_t append(RecordType type, string_view predicate,
+                    const string_view* arguments, size_t count) {
+        lock_guard<mutex> lock(logMutex);
+        if (failed) throw runtime_error("Write-ahead log " + path + " failed");
+        size_t before = pending.size();
+        appendRecord(pending, type, predicate, arguments, count);
+        appendedEnd += pending.size() - before;
+        return appendedEnd;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: appendBatch
+    // Purpose: Buffers an ADD record for every fact of a batch at once
+    // Returns: The log position to pass to waitDurable
+    // ------------------------------------------------------------------------
+    uint64_t appendBatch(const FactBatch& batch) {
+        string records;
+        batch.forEach([&](string_view predicate, const string_view* arguments,
+                          size_t count) {
+            appendRecord(records, ADD, predicate, arguments, count);
+        });
+        
+        lock_guard<mutex> lock(logMutex);
+        if (failed) throw runtime_error("Write-ahead log " + path + " failed");
+        pending += records;
+        appendedEnd += records.size();
+        return appendedEnd;
+    }
+    
+    // Position just past the last record buffered so far
+    uint64_t end() {
+        lock_guard<mutex> lock(logMutex);
+        return appendedEnd;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: waitDurable
+    // Purpose: With SyncPolicy::Commit, blocks until the log is synced up to
+    //          the given position. The first waiter to find no sync running
+    //          writes out everyone's records; the rest wait for it.
+    //          Returns at once under the other policies.
+    //          Throws runtime_error if the log could not be written.
+    // ------------------------------------------------------------------------
+    void waitDurable(uint64_t position) {
+        if (policy != SyncPolicy::Commit) return;
+        
+        unique_lock<mutex> lock(logMutex);
+        while (durableEnd < position && !failed) {
+            if (flushing) {
+                flushed.wait(lock);
+            } else {
+                flushLocked(lock, true);
+            }
+        }
+        if (failed) throw runtime_error("Write-ahead log " + path + " failed");
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: reset
+    // Purpose: Empties the log after a checkpoint made its records
+    //          redundant. The caller must keep writers out meanwhile.
+    // ------------------------------------------------------------------------
+    void reset() {
+        unique_lock<mutex> lock(logMutex);
+        while (flushing) flushed.wait(lock);
+        pending.clear();
+#ifdef PROLOG_HAVE_POSIX
+        if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+            throw runtime_error("Cannot truncate " + path);
+        }
+#else
+        file.close();
+        file.open(path, ios::binary | ios::trunc);
+        if (!file) throw runtime_error("Cannot truncate " + path);
+#endif
+        durableEnd = appendedEnd;
+        flushed.notify_all();
+    }
+};
+
+// How PrologDatabase spreads facts over its shards
+enum class ShardingMode {
+    ByPredicate,        // Every fact of a predicate lives in one shard
+    ByFirstArgument     // Facts are spread by predicate + first argument
+};
+
 // ============================================================================
 // CLASS: PrologDatabase
 // Purpose: Stores PROLOG facts and rules, and provides querying functionality
 // ============================================================================
-class PrologDatabase {
+class PrologDatabase {
+public:
+    // A consistent read view: facts committed after it was taken stay
+    // invisible, and storage it can reach is never freed underneath it.
+    // Cheap to take; must be released on the thread that took it.
+    typedef EpochManager::Guard Snapshot;
+    
+private:
+    static constexpr size_t MAX_INDEXED_COLUMNS = 8;
+    static constexpr uint32_t WILDCARD = AtomTable::NONE;
+    
+    // MVCC lifetime [born, died) of one stored fact
+    struct TupleVersion {
+        atomic<uint64_t> born{EpochManager::NEVER};
+        atomic<uint64_t> died{EpochManager::NEVER};
+        
+        bool visibleAt(uint64_t version) const {
+            return born.load(memory_order_acquire) <= version &&
+                   died.load(memory_order_acquire) > version;
+        }
+    };
+    
+    // Per-column hash index: lowercase argument atom -> tuple positions
+    typedef ConcurrentMap<uint32_t, SegmentedVector<uint32_t, 2>, AtomHasher>
+        ColumnIndex;
+    
+    // Storage for one predicate/arity. Arguments are atom ids, arity per
+    // tuple, in one flat array. Retracted facts stay in place as tombstones
+    // until the background compactor rewrites the relation, so retraction is
+    // O(1) per matching fact and index positions never shift underneath us.
+    // Example: parent/2 -> [john, mary, mary, susan]
+    struct RelationData {
+        SegmentedVector<uint32_t, 8> args;
+        SegmentedVector<TupleVersion, 6> versions;   // Size = tuple count
+        atomic<ColumnIndex*> indexes[MAX_INDEXED_COLUMNS];
+        size_t deadCount = 0;              // Writer only
+        
+        RelationData() {
+            for (auto& index : indexes) index.store(nullptr);
+        }
+        ~RelationData() {
+            for (auto& index : indexes) delete index.load();
+        }
+    };
+    
+    // Incrementally maintained statistics of one relation
+    struct ColumnSketch {
+        HyperLogLog distinct;
+        HeavyHitters heavy;
+    };
+    struct RelationSketch {
+        uint64_t rowCount = 0;
+        vector<ColumnSketch> columns;
+        
+        void merge(const RelationSketch& other) {
+            rowCount += other.rowCount;
+            if (columns.size() < other.columns.size()) {
+                columns.resize(other.columns.size());
+            }
+            for (size_t i = 0; i < other.columns.size(); i++) {
+                columns[i].distinct.merge(other.columns[i].distinct);
+                columns[i].heavy.merge(other.columns[i].heavy);
+            }
+        }
+        
+        // Counts one lowercase atom in a column (rowCount is the caller's)
+        void add(size_t column, uint32_t value) {
+            columns[column].distinct.add(mixHash(value));
+            columns[column].heavy.add(value);
+        }
+        
+        void save(BinaryWriter& out) const {
+            out.pod(rowCount);
+            out.pod(static_cast<uint32_t>(columns.size()));
+            for (const ColumnSketch& column : columns) {
+                column.distinct.save(out);
+                column.heavy.save(out);
+            }
+        }
+        
+        void load(BinaryReader& in) {
+            rowCount = in.pod<uint64_t>();
+            uint32_t count = in.pod<uint32_t>();
+            if (count > in.bytes.size()) in.ok = false;
+            columns.assign(in.ok ? count : 0, ColumnSketch());
+            for (size_t i = 0; i < columns.size() && in.ok; i++) {
+                columns[i].distinct.load(in);
+                columns[i].heavy.load(in);
+            }
+        }
+    };
+    
+    // The compactor swaps in a fresh RelationData and retires the old one,
+    // so readers that loaded it before the swap keep a valid view
+    struct Relation {
+        uint32_t name = 0;                 // Predicate name atom
+        size_t arity = 0;
+        atomic<RelationData*> data{new RelationData()};
+        RelationSketch sketch;             // Guarded by the shard's writeMutex
+        
+        ~Relation() { delete data.load(); }
+    };
+    
+    // One partition of the database with its own writer lock, storage,
+    // indexes and statistics. Readers never take the lock.
+    struct Shard {
+        mutex writeMutex;
+        PredicateDirectory<Relation> facts;
+        set<uint64_t> compactionQueue;
+    };
+    
+    // Snapshot file layout. All sections start 8-byte aligned and hold
+    // host-endian integers, so a loaded snapshot is used in place.
+    //   header | atom offsets | atom folded ids | atom hash slots | atom text
+    //   | per relation: arguments, sketch, column indexes | relation table
+    static constexpr uint32_t SNAPSHOT_MAGIC = 0x42444c50;   // "PLDB"
+    static constexpr uint32_t SNAPSHOT_FORMAT = 1;
+    
+    struct SnapshotHeader {
+        uint32_t magic;
+        uint32_t format;
+        uint64_t fileSize;
+        uint64_t checksum;                // Over the body and this header
+        uint64_t atomCount;
+        uint64_t atomSlotCount;
+        uint64_t atomOffsets;             // File offsets of the sections
+        uint64_t atomFolded;
+        uint64_t atomSlots;
+        uint64_t atomText;
+        uint64_t relationCount;
+        uint64_t relations;
+    };
+    
+    struct SnapshotRelation {
+        uint32_t name;
+        uint32_t arity;
+        uint64_t tupleCount;
+        uint64_t args;                    // uint32_t[tupleCount * arity]
+        uint64_t sketch;                  // RelationSketch::save bytes
+        uint64_t sketchSize;
+        uint64_t indexes[MAX_INDEXED_COLUMNS];  // 0 = column not indexed
+    };
+    
+    // A column index is this header, then slotCount open-addressed slots
+    // (probed from mixHash(key)), then postingCount tuple positions
+    struct SnapshotIndex {
+        uint64_t slotCount;
+        uint64_t postingCount;
+    };
+    struct SnapshotIndexSlot {
+        uint32_t key;                     // Lowercase atom, NONE if empty
+        uint32_t count;
+        uint64_t start;                   // First of its postings
+    };
+    
+    struct BaseIndex {
+        const SnapshotIndexSlot* slots = nullptr;
+        uint64_t slotMask = 0;
+        const uint32_t* postings = nullptr;
+    };
+    
+    // A relation of the loaded snapshot, read in place. Its tuples are born
+    // at version 0; retracting one stamps a died version in a side array
+    // that is allocated on the first retraction.
+    struct BaseRelation {
+        uint32_t name = 0;
+        size_t arity = 0;
+        size_t count = 0;
+        const uint32_t* args = nullptr;
+        BaseIndex indexes[MAX_INDEXED_COLUMNS];
+        atomic<atomic<uint64_t>*> died{nullptr};
+        RelationSketch sketch;            // Guarded by baseMutex
+        
+        ~BaseRelation() { delete[] died.load(); }
+    };
+    
+    MappedFile mapping;                   // Declared first: freed last
+    vector<unique_ptr<BaseRelation>> baseRelations;
+    unordered_map<uint64_t, BaseRelation*> baseDirectory;   // Fixed after load
+    mutex baseMutex;                      // Serializes retractions from the base
+    
+    AtomTable atoms;
+    vector<unique_ptr<Shard>> shards;
+    ShardingMode shardingMode;
+    
+    // Durability: changes are logged while checkpointMutex is held shared;
+    // a checkpoint holds it exclusively
+    unique_ptr<WriteAheadLog> wal;
+    shared_mutex checkpointMutex;
+    
+    // Compaction settings and the background compactor thread
+    static constexpr size_t MIN_DEAD_FOR_COMPACTION = 64;
+    atomic<double> compactionThreshold{0.25};  // Dead fraction that triggers it
+    mutex compactorMutex;
+    bool shuttingDown = false;
+    
+    atomic<bool> verbose{true};           // Echo every added fact to cout
+    condition_variable compactionWanted;
+    thread compactor;                     // Declared last, started last
+    
+    // Helper function to convert string to lowercase for case-insensitive matching
+    string toLower(const string& str) {
+        return toLowerAscii(str);
+    }
+    
+    // Helper function to trim whitespace from both ends of a string
+    string trim(const string& str) {
+        return string(trimAscii(str));
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // Constructor: creates the shards and starts the background compactor
+    //   The compactor is started in the body rather than the initializer
+    //   list, so every member it touches has been constructed first.
+    // Parameters:
+    //   - shardCount: Number of independently locked partitions
+    //   - mode: Whether to partition by predicate or by first argument
+    // ------------------------------------------------------------------------
+    explicit PrologDatabase(size_t shardCount = 1,
+                            ShardingMode mode = ShardingMode::ByPredicate)
+        : shardingMode(mode) {
+        for (size_t i = 0; i < max<size_t>(shardCount, 1); i++) {
+            shards.emplace_back(new Shard());
+        }
+        compactor = thread([this] { compactionLoop(); });
+    }
+    
+    // Destructor: stops the compactor before the storage goes away
+    ~PrologDatabase() {
+        {
+            lock_guard<mutex> lock(compactorMutex);
+            shuttingDown = true;
+        }
+        compactionWanted.notify_all();
+        compactor.join();
+    }
+    
+    PrologDatabase(const PrologDatabase&) = delete;
+    PrologDatabase& operator=(const PrologDatabase&) = delete;
+    
+    size_t shardCount() const { return shards.size(); }
+    
+    // Bulk loads turn off the "Added fact" echo
+    void setVerbose(bool enabled) { verbose.store(enabled); }
+    bool isVerbose() const { return verbose.load(); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: snapshot
+    // Purpose: Takes a read snapshot to pass to query() so that several
+    //          reads see the same state of the database
+    // ------------------------------------------------------------------------
+    Snapshot snapshot() const {
+        return EpochManager::instance().pin();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: addFact
+    // Purpose: Adds a new fact to the database
+    // Parameters:
+    //   - predicate: The name of the predicate (e.g., "parent", "likes")
+    //   - arguments: Vector of arguments for this predicate
+    // ------------------------------------------------------------------------
+    void addFact(const string& predicate, const vector<string>& arguments) {
+        vector<string_view> views(arguments.begin(), arguments.end());
+        addFact(predicate, views.data(), views.size());
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: addFact (views)
+    // Purpose: Same as above for arguments that live in a caller's buffer.
+    //          Nothing is allocated when every atom is already interned.
+    // ------------------------------------------------------------------------
+    void addFact(string_view predicate, const string_view* arguments,
+                 size_t count) {
+        TraceScope scope("addFact", "database");
+        uint64_t logged = 0;
+        {
+            // Interning looks atoms up lock-free, which needs a guard
+            Snapshot guard = snapshot();
+            shared_lock<shared_mutex> logging = lockForLogging();
+            
+            uint32_t name = internPredicate(predicate);
+            
+            uint32_t local[MAX_INDEXED_COLUMNS];
+            vector<uint32_t> spill;
+            uint32_t* ids = local;
+            if (count > MAX_INDEXED_COLUMNS) {
+                spill.resize(count);
+                ids = spill.data();
+            }
+            for (size_t i = 0; i < count; i++) {
+                ids[i] = atoms.intern(arguments[i]);
+            }
+            if (wal) {
+                logged = wal->append(WriteAheadLog::ADD, predicate, arguments, count);
+            }
+            insertTuple(name, ids, count);
+        }
+        if (wal) wal->waitDurable(logged);
+        
+        // Print confirmation for user
+        if (!verbose.load(memory_order_relaxed)) return;
+        cout << "Added fact: " << predicate << "(";
+        for (size_t i = 0; i < count; i++) {
+            cout << arguments[i];
+            if (i < count - 1) cout << ", ";
+        }
+        cout << ")" << endl;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: addFacts
+    // Purpose: Adds a batch of facts silently. Only the shards it writes to are
+    //          locked, once for the whole batch, and the batch becomes visible
+    //          to readers all at once, in a single commit.
+    // ------------------------------------------------------------------------
+    void addFacts(const FactBatch& batch) {
+        if (batch.empty()) return;
+        
+        TraceScope scope("addFacts", "database");
+        scope.setValue("facts", batch.size());
+        uint64_t logged = 0;
+        {
+            Snapshot guard = snapshot();
+            shared_lock<shared_mutex> logging = lockForLogging();
+            if (wal) logged = wal->appendBatch(batch);
+            
+            // Intern the whole batch first, so the shards it writes to are
+            // known before any of them is locked
+            struct Pending {
+                uint32_t name;
+                size_t first;                  // Offset of the arguments in ids
+                size_t count;
+            };
+            vector<Pending> pending;
+            pending.reserve(batch.size());
+            vector<uint32_t> ids;
+            vector<bool> targeted(shards.size(), false);
+            batch.forEach([&](string_view predicate, const string_view* arguments,
+                              size_t count) {
+                uint32_t name = internPredicate(predicate);
+                size_t first = ids.size();
+                for (size_t i = 0; i < count; i++) {
+                    ids.push_back(atoms.intern(arguments[i]));
+                }
+                uint64_t key = PredicateDirectory<Relation>::makeKey(name, count);
+                targeted[shardFor(key, count ? atoms.folded(ids[first]) : WILDCARD)] = true;
+                pending.push_back({name, first, count});
+            });
+            
+            vector<unique_lock<mutex>> locks = lockShards(targeted);
+            vector<TupleVersion*> added;
+            added.reserve(pending.size());
+            for (const Pending& fact : pending) {
+                added.push_back(&appendFact(fact.name, ids.data() + fact.first,
+                                            fact.count));
+            }
+            
+            EpochManager::instance().commit([&](uint64_t version) {
+                for (TupleVersion* tuple : added) {
+                    tuple->born.store(version, memory_order_release);
+                }
+            });
+        }
+        
+        // Wait for the log with no locks held, so other writers can join
+        // the same sync
+        if (wal) wal->waitDurable(logged);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: internAtoms
+    // Purpose: Interns a run of atoms for addRows. Safe to call from many
+    //          threads at once, so bulk loaders can intern in parallel.
+    // ------------------------------------------------------------------------
+    void internAtoms(const string_view* texts, size_t count, uint32_t* ids) {
+        Snapshot guard = snapshot();
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = atoms.intern(texts[i]);
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: addRows
+    // Purpose: Adds a block of facts of one predicate silently. The rows
+    //          are appended as whole blocks, then indexed one column at a
+    //          time with each value's postings looked up once per block, and
+    //          become visible together in one commit. Only the shards that
+    //          receive rows are locked.
+    // Parameters:
+    //   - predicate: The predicate of every row
+    //   - arity: Arguments per row
+    //   - ids: rows * arity atom ids from internAtoms, row after row
+    //   - rows: Number of rows
+    // ------------------------------------------------------------------------
+    void addRows(string_view predicate, size_t arity, const uint32_t* ids,
+                 size_t rows) {
+        if (rows == 0) return;
+        
+        TraceScope scope("addRows", "database");
+        scope.setValue("rows", rows);
+        uint64_t logged = 0;
+        {
+            Snapshot guard = snapshot();
+            shared_lock<shared_mutex> logging = lockForLogging();
+            uint32_t name = internPredicate(predicate);
+            uint64_t key = PredicateDirectory<Relation>::makeKey(name, arity);
+            countAdded(key, name, arity, rows);
+            
+            if (wal) {
+                FactBatch batch;
+                vector<string_view> arguments(arity);
+                for (size_t row = 0; row < rows; row++) {
+                    for (size_t i = 0; i < arity; i++) {
+                        arguments[i] = atoms.name(ids[row * arity + i]);
+                    }
+                    batch.add(predicate, arguments.data(), arity);
+                }
+                logged = wal->appendBatch(batch);
+            }
+            
+            // Rows of each shard, in order
+            vector<vector<uint32_t>> rowsOf(shards.size());
+            if (shards.size() == 1 || shardingMode == ShardingMode::ByPredicate ||
+                arity == 0) {
+                size_t shard = shardFor(key, arity ? atoms.folded(ids[0]) : WILDCARD);
+                rowsOf[shard].resize(rows);
+                for (size_t row = 0; row < rows; row++) {
+                    rowsOf[shard][row] = static_cast<uint32_t>(row);
+                }
+            } else {
+                for (size_t row = 0; row < rows; row++) {
+                    size_t shard = shardFor(key, atoms.folded(ids[row * arity]));
+                    rowsOf[shard].push_back(static_cast<uint32_t>(row));
+                }
+            }
+            
+            vector<bool> targeted(shards.size());
+            for (size_t s = 0; s < shards.size(); s++) targeted[s] = !rowsOf[s].empty();
+            vector<unique_lock<mutex>> locks = lockShards(targeted);
+            
+            struct Appended {
+                RelationData* data;
+                size_t first;
+                size_t end;
+            };
+            vector<Appended> appended;
+            for (size_t s = 0; s < shards.size(); s++) {
+                if (rowsOf[s].empty()) continue;
+                
+                Relation& relation = shards[s]->facts.findOrInsert(key,
+                    [&](Relation& created) {
+                        created.name = name;
+                        created.arity = arity;
+                    });
+                RelationData& data = *relation.data.load();
+                size_t first = data.versions.size();
+                for (uint32_t row : rowsOf[s]) {
+                    const uint32_t* tuple = ids + size_t(row) * arity;
+                    for (size_t i = 0; i < arity; i++) data.args.push_back(tuple[i]);
+                    data.versions.append([](TupleVersion& version) {
+                        version.born.store(EpochManager::NEVER, memory_order_relaxed);
+                        version.died.store(EpochManager::NEVER, memory_order_relaxed);
+                    });
+                    updateStatistics(relation, tuple);
+                }
+                indexRange(data, arity, first);
+                appended.push_back({&data, first, data.versions.size()});
+            }
+            
+            EpochManager::instance().commit([&](uint64_t version) {
+                for (const Appended& block : appended) {
+                    for (size_t pos = block.first; pos < block.end; pos++) {
+                        block.data->versions.at(pos).born.store(version,
+                                                                memory_order_release);
+                    }
+                }
+            });
+        }
+        if (wal) wal->waitDurable(logged);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: query
+    // Purpose: Queries the database for facts matching the given predicate
+    // Parameters:
+    //   - predicate: The predicate to search for
+    //   - arguments: Arguments to match (use "?" for wildcards/variables)
+    // Returns: Vector of all matching fact argument lists
+    // ------------------------------------------------------------------------
+    vector<vector<string>> query(const string& predicate, 
+                                  const vector<string>& arguments) {
+        Snapshot view = snapshot();
+        return query(predicate, arguments, view);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: query (snapshot)
+    // Purpose: Same as above, but reads the state as of the given snapshot.
+    //          Patterns that do not pin down one shard are fanned out to
+    //          all of them and the results concatenated.
+    // ------------------------------------------------------------------------
+    vector<vector<string>> query(const string& predicate,
+                                  const vector<string>& arguments,
+                                  const Snapshot& view) {
+        // Unknown predicate or argument atoms cannot match anything
+        uint32_t name;
+        vector<uint32_t> pattern;
+        if (!resolvePattern(predicate, arguments, name, pattern)) {
+            Metrics& metrics = Metrics::instance();
+            if (metrics.enabled()) metrics.add(metrics.unresolvedQueries);
+            return {}; // Empty results
+        }
+        return matchPattern(name, pattern, view);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: queryBatch
+    // Purpose: Answers several patterns of one predicate under one snapshot,
+    //          resolving the predicate once and each distinct pattern once
+    // Parameters:
+    //   - predicate: The predicate to search for
+    //   - patterns: Argument patterns as for query
+    // Returns: The results of each pattern, in order
+    // ------------------------------------------------------------------------
+    vector<vector<vector<string>>> queryBatch(const string& predicate,
+                                              const vector<vector<string>>& patterns,
+                                              const Snapshot& view) {
+        vector<vector<vector<string>>> results(patterns.size());
+        Metrics& metrics = Metrics::instance();
+        uint32_t name = atoms.lookup(toLower(predicate));
+        if (name == AtomTable::NONE) {
+            if (metrics.enabled()) metrics.add(metrics.unresolvedQueries, patterns.size());
+            return results;
+        }
+        
+        map<vector<uint32_t>, size_t> answered;
+        vector<uint32_t> pattern;
+        for (size_t k = 0; k < patterns.size(); k++) {
+            if (!resolveArguments(patterns[k], pattern)) {
+                if (metrics.enabled()) metrics.add(metrics.unresolvedQueries);
+                continue;
+            }
+            auto seen = answered.emplace(pattern, k);
+            if (seen.second) {
+                results[k] = matchPattern(name, pattern, view);
+            } else {
+                results[k] = results[seen.first->second];
+            }
+        }
+        return results;
+    }
+
+    // ------------------------------------------------------------------------
+    // METHOD: profileQuery
+    // Purpose: Runs a query like query() and records in the goal what it
+    //          did: the resolved predicate, the access path taken in the
+    //          snapshot and in each shard searched, the tuples examined and
+    //          produced, and the time and memory each step took
+    // Parameters:
+    //   - predicate, arguments: As for query
+    //   - goal: Receives the profile; goal.goal is filled in if empty
+    // Returns: The matching facts, as query() would
+    // ------------------------------------------------------------------------
+    vector<vector<string>> profileQuery(const string& predicate,
+                                        const vector<string>& arguments,
+                                        QueryProfile::Goal& goal) {
+        AllocationTotals before = threadAllocations;
+        uint64_t started = Metrics::now();
+        if (goal.goal.empty()) goal.goal = QueryProfile::describe(predicate, arguments);
+        
+        Snapshot view = snapshot();
+        uint32_t name;
+        vector<uint32_t> pattern;
+        bool resolved = resolvePattern(predicate, arguments, name, pattern);
+        goal.resolveNanos = Metrics::now() - started;
+        
+        vector<vector<string>> results;
+        if (resolved) {
+            goal.predicate = predicateLabel(name, pattern.size());
+            results = matchPattern(name, pattern, view, &goal);
+        } else {
+            goal.unresolved = atoms.lookup(toLower(predicate)) == AtomTable::NONE
+                                  ? "unknown predicate" : "unknown argument";
+            Metrics& metrics = Metrics::instance();
+            if (metrics.enabled()) metrics.add(metrics.unresolvedQueries);
+        }
+        goal.rows = results.size();
+        goal.nanos = Metrics::now() - started;
+        goal.allocated = threadAllocations - before;
+        return results;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: explain
+    // Purpose: EXPLAIN ANALYZE for one query: runs it and returns its
+    //          profile instead of its results
+    // ------------------------------------------------------------------------
+    QueryProfile explain(const string& predicate, const vector<string>& arguments) {
+        QueryProfile profile;
+        AllocationTotals before = threadAllocations;
+        uint64_t started = Metrics::now();
+        profile.goals.emplace_back();
+        profileQuery(predicate, arguments, profile.goals.back());
+        profile.nanos = Metrics::now() - started;
+        profile.allocated = threadAllocations - before;
+        return profile;
+    }
+
+private:
+    // Helper function to collect the facts matching a resolved pattern.
+    // With a profile, each place searched is recorded as an access.
+    vector<vector<string>> matchPattern(uint32_t name, const vector<uint32_t>& pattern,
+                                        const Snapshot& view,
+                                        QueryProfile::Goal* profile = nullptr) {
+        Metrics& metrics = Metrics::instance();
+        bool counting = metrics.enabled();
+        uint64_t started = counting ? Metrics::now() : 0;
+        TraceScope scope("query", "database");
+        ScanCounts counts;
+        
+        vector<vector<string>> results;
+        uint64_t key = PredicateDirectory<Relation>::makeKey(name, pattern.size());
+        
+        // Runs the search of the snapshot (no shard) or of one shard,
+        // timing it on its own when profiling
+        auto search = [&](const Shard* shard, auto&& run) {
+            if (!profile) {
+                run(counts);
+                return;
+            }
+            ScanCounts step;
+            size_t produced = results.size();
+            uint64_t began = Metrics::now();
+            bool present = run(step);
+            QueryProfile::Access access;
+            if (shard) {
+                size_t index = 0;
+                while (shards[index].get() != shard) index++;
+                access.source = "shard " + to_string(index);
+            } else {
+                access.source = "snapshot";
+            }
+            access.path = present ? step.path() : "no facts";
+            access.examined = step.scanned;
+            access.produced = results.size() - produced;
+            access.nanos = Metrics::now() - began;
+            profile->accesses.push_back(move(access));
+            counts.add(step);
+        };
+        
+        // Facts of a loaded snapshot come first
+        auto base = baseDirectory.find(key);
+        if (base != baseDirectory.end()) {
+            const BaseRelation& relation = *base->second;
+            search(nullptr, [&](ScanCounts& into) {
+                forEachBaseMatch(relation, pattern, view.version(), [&](size_t pos) {
+                    results.push_back(materialize(relation, pos));
+                    return true;
+                }, &into);
+                return true;
+            });
+        }
+        
+        forEachCandidateShard(key, pattern, [&](Shard& shard) {
+            search(&shard, [&](ScanCounts& into) {
+                // Check if this predicate exists in this shard
+                Relation* relation = shard.facts.find(key);
+                if (!relation) return false;
+                
+                // Search through all facts with this predicate visible to the view
+                const RelationData& data = *relation->data.load(memory_order_acquire);
+                forEachMatch(data, pattern, view.version(), [&](size_t pos) {
+                    results.push_back(materialize(data, pattern.size(), pos));
+                    return true;
+                }, &into);
+                return true;
+            });
+        });
+        
+        if (counting) {
+            const Metrics::PredicateMetrics& slots = metrics.predicate(key, pattern.size(),
+                [&] { return predicateLabel(name, pattern.size()); });
+            metrics.add(slots.modeSlot(pattern, WILDCARD));
+            metrics.add(slots.first + Metrics::TUPLES_SCANNED, counts.scanned);
+            metrics.add(slots.first + Metrics::TUPLES_MATCHED, results.size());
+            if (counts.indexLookups) {
+                metrics.add(slots.first + Metrics::INDEX_LOOKUPS, counts.indexLookups);
+            }
+            if (counts.fullScans) {
+                metrics.add(slots.first + Metrics::FULL_SCANS, counts.fullScans);
+            }
+            metrics.record(metrics.queryLatency, Metrics::now() - started);
+        }
+        scope.setValue("rows", results.size());
+        return results;
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: retract
+    // Purpose: Removes the first fact matching the pattern
+    // Parameters:
+    //   - predicate: The predicate to remove from
+    //   - arguments: Pattern to match (use "?" for wildcards/variables)
+    // Returns: True if a fact was removed
+    // ------------------------------------------------------------------------
+    bool retract(const string& predicate, const vector<string>& arguments) {
+        return removeMatching(predicate, arguments, 1) > 0;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: retractAll
+    // Purpose: Removes every fact matching the pattern
+    // Returns: Number of facts removed
+    // ------------------------------------------------------------------------
+    size_t retractAll(const string& predicate, const vector<string>& arguments) {
+        return removeMatching(predicate, arguments, SIZE_MAX);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: setCompactionThreshold
+    // Purpose: Sets the fraction of dead facts (0..1) at which a predicate
+    //          is compacted in the background
+    // ------------------------------------------------------------------------
+    void setCompactionThreshold(double fraction) {
+        compactionThreshold.store(fraction);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: compact
+    // Purpose: Immediately drops every tombstone no snapshot can still see
+    // ------------------------------------------------------------------------
+    void compact() {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard->writeMutex);
+            shard->facts.forEach([&](uint64_t, Relation& relation) {
+                if (relation.data.load()->deadCount > 0) {
+                    compactRelation(relation);
+                }
+            });
+            shard->compactionQueue.clear();
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: printDatabase
+    // Purpose: Displays all facts currently stored in the database
+    // ------------------------------------------------------------------------
+    void printDatabase() {
+        Snapshot view = snapshot();
+        uint64_t version = view.version();
+        
+        cout << "\n========== PROLOG DATABASE ==========\n";
+        
+        vector<ListedRelation> relations = sortedRelations();
+        if (relations.empty()) {
+            cout << "Database is empty.\n";
+            return;
+        }
+        
+        // Iterate through all predicates
+        string_view lastHeader;
+        bool headerShown = false;
+        auto printFact = [&](string_view name, size_t arity, auto argument) {
+            if (!headerShown || lastHeader != name) {
+                cout << "\nPredicate: " << name << endl;
+                lastHeader = name;
+                headerShown = true;
+            }
+            
+            cout << "  " << name << "(";
+            for (size_t i = 0; i < arity; i++) {
+                cout << atoms.name(argument(i));
+                if (i < arity - 1) cout << ", ";
+            }
+            cout << ")" << endl;
+        };
+        
+        for (const ListedRelation& listed : relations) {
+            // Print all visible facts for this predicate
+            if (const BaseRelation* relation = listed.base) {
+                const atomic<uint64_t>* died = relation->died.load(memory_order_acquire);
+                for (size_t pos = 0; pos < relation->count; pos++) {
+                    if (died && died[pos].load(memory_order_acquire) <= version) continue;
+                    const uint32_t* args = relation->args + pos * relation->arity;
+                    printFact(listed.name, relation->arity,
+                              [&](size_t i) { return args[i]; });
+                }
+                continue;
+            }
+            
+            const Relation* relation = listed.live;
+            const RelationData& data = *relation->data.load(memory_order_acquire);
+            size_t count = data.versions.size();
+            for (size_t pos = 0; pos < count; pos++) {
+                if (!data.versions[pos].visibleAt(version)) continue;
+                printFact(listed.name, relation->arity, [&](size_t i) {
+                    return data.args[pos * relation->arity + i];
+                });
+            }
+        }
+        
+        cout << "=====================================\n\n";
+    }
+    
+    // A stretch of the stored facts of one predicate, handed out by
+    // factRanges so that an exporter can scan the database in parallel.
+    // Only meaningful while the snapshot it was cut from is held.
+    struct FactRange {
+        string_view predicate;
+        size_t arity;
+        const BaseRelation* base;         // Exactly one of base and live
+        const RelationData* live;
+        size_t begin, end;                // Stored tuple positions
+    };
+    
+    // ------------------------------------------------------------------------
+    // METHOD: factRanges
+    // Purpose: Cuts the facts of a snapshot into ranges of at most maxRows
+    //          stored tuples, ordered by predicate name and arity like
+    //          printDatabase. The caller holds the snapshot the ranges are
+    //          read under from before the call until it is done with them.
+    // Parameters:
+    //   - wanted: Called with (name, arity); false skips the predicate
+    //   - maxRows: Largest range handed out
+    // ------------------------------------------------------------------------
+    template <typename Filter>
+    vector<FactRange> factRanges(Filter wanted, size_t maxRows) const {
+        vector<FactRange> ranges;
+        maxRows = max<size_t>(maxRows, 1);
+        for (const ListedRelation& listed : sortedRelations()) {
+            size_t arity = listed.base ? listed.base->arity : listed.live->arity;
+            if (!wanted(listed.name, arity)) continue;
+            
+            const RelationData* data = nullptr;
+            size_t count;
+            if (listed.base) {
+                count = listed.base->count;
+            } else {
+                data = listed.live->data.load(memory_order_acquire);
+                count = data->versions.size();
+            }
+            for (size_t begin = 0; begin < count; begin += maxRows) {
+                ranges.push_back({listed.name, arity, listed.base, data, begin,
+                                  min(count, begin + maxRows)});
+            }
+        }
+        return ranges;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: forEachFact
+    // Purpose: Calls visit(args) with the argument texts of every fact of a
+    //          range that is visible to the snapshot. Safe to run for
+    //          several ranges at once on different threads.
+    // ------------------------------------------------------------------------
+    template <typename Visitor>
+    void forEachFact(const FactRange& range, const Snapshot& view,
+                     Visitor visit) const {
+        uint64_t version = view.version();
+        vector<string_view> args(range.arity);
+        
+        if (const BaseRelation* relation = range.base) {
+            const atomic<uint64_t>* died = relation->died.load(memory_order_acquire);
+            for (size_t pos = range.begin; pos < range.end; pos++) {
+                if (died && died[pos].load(memory_order_acquire) <= version) continue;
+                const uint32_t* ids = relation->args + pos * range.arity;
+                for (size_t i = 0; i < range.arity; i++) args[i] = atoms.name(ids[i]);
+                visit(static_cast<const string_view*>(args.data()));
+            }
+            return;
+        }
+        
+        const RelationData& data = *range.live;
+        for (size_t pos = range.begin; pos < range.end; pos++) {
+            if (!data.versions[pos].visibleAt(version)) continue;
+            for (size_t i = 0; i < range.arity; i++) {
+                args[i] = atoms.name(data.args[pos * range.arity + i]);
+            }
+            visit(static_cast<const string_view*>(args.data()));
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: getStats
+    // Purpose: Returns row count, distinct-value estimates and heavy hitters
+    //          for one predicate/arity pair (rowCount is 0 if unknown)
+    // ------------------------------------------------------------------------
+    PredicateStats getStats(const string& predicate, size_t arity) {
+        string pred = toLower(predicate);
+        RelationSketch merged;
+        
+        Snapshot guard = snapshot();
+        uint32_t name = atoms.lookup(pred);
+        if (name != AtomTable::NONE) {
+            uint64_t key = PredicateDirectory<Relation>::makeKey(name, arity);
+            auto base = baseDirectory.find(key);
+            if (base != baseDirectory.end()) {
+                lock_guard<mutex> lock(baseMutex);
+                merged.merge(base->second->sketch);
+            }
+            for (auto& shard : shards) {
+                lock_guard<mutex> lock(shard->writeMutex);
+                if (Relation* relation = shard->facts.find(key)) {
+                    merged.merge(relation->sketch);
+                }
+            }
+        }
+        return summarize(pred, arity, merged);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: getAllStats
+    // Purpose: Returns statistics for every predicate/arity pair
+    // ------------------------------------------------------------------------
+    vector<PredicateStats> getAllStats() {
+        Snapshot guard = snapshot();
+        
+        map<pair<string, size_t>, RelationSketch> merged;
+        {
+            lock_guard<mutex> lock(baseMutex);
+            for (const auto& relation : baseRelations) {
+                merged[{string(atoms.name(relation->name)), relation->arity}]
+                    .merge(relation->sketch);
+            }
+        }
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard->writeMutex);
+            shard->facts.forEach([&](uint64_t, const Relation& relation) {
+                merged[{string(atoms.name(relation.name)), relation.arity}]
+                    .merge(relation.sketch);
+            });
+        }
+        
+        vector<PredicateStats> result;
+        for (const auto& entry : merged) {
+            result.push_back(summarize(entry.first.first, entry.first.second,
+                                       entry.second));
+        }
+        return result;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: printStats
+    // Purpose: Dumps the statistics of every predicate in readable form
+    // ------------------------------------------------------------------------
+    void printStats(ostream& out = cout) {
+        out << "\n========== DATABASE STATISTICS ==========\n";
+        
+        auto all = getAllStats();
+        if (all.empty()) {
+            out << "Database is empty.\n";
+        }
+        
+        for (const auto& stats : all) {
+            out << "\n" << stats.predicate << "/" << stats.arity
+                << "  rows: " << stats.rowCount << "\n";
+            
+            for (size_t col = 0; col < stats.columns.size(); col++) {
+                const ColumnStats& column = stats.columns[col];
+                out << "  arg " << col + 1 << ": distinct "
+                    << (column.exact ? "= " : "~ ") << column.distinctEstimate
+                    << ", top:";
+                for (const auto& hitter : column.heavyHitters) {
+                    out << " " << hitter.value << "(" << hitter.count << ")";
+                }
+                out << "\n";
+            }
+        }
+        
+        out << "=========================================\n\n";
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: getMemoryReport
+    // Purpose: Accounts for the memory of the database: per predicate the
+    //          heap bytes of its tuples, indexes and statistics sketches
+    //          (with unused capacity and allocator overhead) and the
+    //          snapshot bytes read in place; then the atom table and the
+    //          predicate directories. Also projects each predicate's tuple
+    //          and index bytes once the tombstones no snapshot can see any
+    //          more are compacted away. Not counted: the write-ahead log
+    //          buffer and storage retired but not yet freed.
+    // Returns: The report, predicates with the most memory first
+    // ------------------------------------------------------------------------
+    MemoryReport getMemoryReport() {
+        MemoryReport report;
+        Snapshot guard = snapshot();
+        uint64_t oldest = EpochManager::instance().oldestActiveVersion();
+        
+        map<pair<string, size_t>, PredicateMemory> merged;
+        auto entry = [&](uint32_t name, size_t arity) -> PredicateMemory& {
+            PredicateMemory& memory = merged[{string(atoms.name(name)), arity}];
+            memory.predicate = string(atoms.name(name));
+            memory.arity = arity;
+            return memory;
+        };
+        auto sketchUse = [](const RelationSketch& sketch) {
+            MemoryUse use;
+            use.add(sketch.columns);
+            for (const ColumnSketch& column : sketch.columns) {
+                use += column.distinct.memoryUse();
+                use += column.heavy.memoryUse();
+            }
+            return use;
+        };
+        
+        {
+            lock_guard<mutex> lock(baseMutex);
+            for (const auto& relation : baseRelations) {
+                PredicateMemory& memory = entry(relation->name, relation->arity);
+                memory.tuples += relation->count;
+                memory.mappedBytes += relation->count * relation->arity * sizeof(uint32_t);
+                for (const BaseIndex& index : relation->indexes) {
+                    if (!index.slots) continue;
+                    memory.mappedBytes += (index.slotMask + 1) * sizeof(SnapshotIndexSlot) +
+                                          relation->count * sizeof(uint32_t);
+                }
+                
+                // Snapshot tombstones are never compacted away
+                MemoryUse stamps;
+                const atomic<uint64_t>* died = relation->died.load(memory_order_acquire);
+                if (died) {
+                    size_t bytes = relation->count * sizeof(atomic<uint64_t>);
+                    stamps.add(died, bytes, bytes);
+                    for (size_t pos = 0; pos < relation->count; pos++) {
+                        if (died[pos].load(memory_order_relaxed) != EpochManager::NEVER) {
+                            memory.deadTuples++;
+                        }
+                    }
+                }
+                memory.tupleBytes += stamps;
+                memory.compactedBytes += stamps.requested;
+                memory.statisticsBytes += sketchUse(relation->sketch);
+                report.directories.add(relation.get(), sizeof(BaseRelation),
+                                       sizeof(BaseRelation));
+            }
+            report.directories.add(baseRelations);
+            
+            // Hash nodes of the standard map are not visible; count their size
+            size_t nodes = baseDirectory.size() *
+                           (sizeof(void*) + sizeof(pair<const uint64_t, BaseRelation*>));
+            report.directories.add(nullptr, baseDirectory.bucket_count() * sizeof(void*) +
+                                   nodes, nodes);
+        }
+        
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard->writeMutex);
+            report.directories.add(shard.get(), sizeof(Shard), sizeof(Shard));
+            report.directories += shard->facts.memoryUse();
+            shard->facts.forEach([&](uint64_t, const Relation& relation) {
+                PredicateMemory& memory = entry(relation.name, relation.arity);
+                measureRelation(relation, oldest, memory);
+                memory.statisticsBytes += sketchUse(relation.sketch);
+            });
+        }
+        
+        for (auto& predicate : merged) report.predicates.push_back(move(predicate.second));
+        stable_sort(report.predicates.begin(), report.predicates.end(),
+                    [](const PredicateMemory& a, const PredicateMemory& b) {
+            return a.heap().allocated + a.mappedBytes > b.heap().allocated + b.mappedBytes;
+        });
+        
+        report.atomCount = atoms.size();
+        report.atomMappedBytes = atoms.memoryUse(report.atomText, report.atomLookup,
+                                                 report.atomFolded);
+        report.mappedBytes = mapping.size();
+        return report;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: printMemoryReport
+    // Purpose: Prints getMemoryReport() as a table, one predicate per line
+    //          (heap columns are allocated bytes), then the totals
+    // ------------------------------------------------------------------------
+    void printMemoryReport(ostream& out = cout) {
+        MemoryReport report = getMemoryReport();
+        
+        out << "\n========== MEMORY USAGE ==========\n";
+        out << left << setw(24) << "Predicate" << right << setw(10) << "Tuples"
+            << setw(10) << "Dead" << setw(12) << "Tuple data" << setw(12) << "Indexes"
+            << setw(12) << "Statistics" << setw(12) << "Mapped" << setw(12)
+            << "Compacted" << "\n";
+        
+        uint64_t current = 0;
+        uint64_t compacted = 0;
+        uint64_t reclaimable = 0;
+        for (const PredicateMemory& memory : report.predicates) {
+            out << left << setw(24)
+                << memory.predicate + "/" + to_string(memory.arity) << right
+                << setw(10) << memory.tuples << setw(10) << memory.deadTuples
+                << setw(12) << formatBytes(memory.tupleBytes.allocated)
+                << setw(12) << formatBytes(memory.indexBytes.allocated)
+                << setw(12) << formatBytes(memory.statisticsBytes.allocated)
+                << setw(12) << formatBytes(memory.mappedBytes)
+                << setw(12) << formatBytes(memory.compactedBytes) << "\n";
+            current += memory.tupleBytes.requested + memory.indexBytes.requested;
+            compacted += memory.compactedBytes;
+            reclaimable += memory.reclaimableTuples;
+        }
+        
+        MemoryUse heap = report.heap();
+        out << "\nAtoms:       " << report.atomCount << " (text "
+            << formatBytes(report.atomText.allocated) << ", lookup "
+            << formatBytes(report.atomLookup.allocated) << ", lowercase ids "
+            << formatBytes(report.atomFolded.allocated) << ", mapped "
+            << formatBytes(report.atomMappedBytes) << ")\n";
+        out << "Directories: " << formatBytes(report.directories.allocated) << "\n";
+        out << "Heap:        " << formatBytes(heap.allocated) << " allocated, "
+            << formatBytes(heap.used) << " used, "
+            << formatBytes(heap.requested - heap.used) << " unused capacity, "
+            << formatBytes(heap.allocated - heap.requested) << " allocator overhead\n";
+        out << "Mapped:      " << formatBytes(report.mappedBytes) << " of snapshot file\n";
+        out << "Compaction:  would free "
+            << formatBytes(current > compacted ? current - compacted : 0) << " ("
+            << reclaimable << " reclaimable tombstones)\n";
+        out << "==================================\n\n";
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: save
+    // Purpose: Writes every fact visible now to a snapshot file that load()
+    //          can map straight into memory: atoms, tuples, statistics and
+    //          column indexes are laid out as the tables they become. The
+    //          file is written beside the target and renamed over it, so an
+    //          interrupted save never leaves a half-written snapshot.
+    //          Throws runtime_error if the file cannot be written.
+    // ------------------------------------------------------------------------
+    void save(const string& path) {
+        Snapshot view = snapshot();
+        uint64_t version = view.version();
+        
+        // Collect the visible tuples of each predicate/arity, base and live
+        struct Group {
+            uint32_t name;
+            size_t arity;
+            size_t count;
+            vector<uint32_t> args;
+        };
+        vector<Group> groups;
+        unordered_map<uint64_t, size_t> groupOf;
+        auto groupFor = [&](uint32_t name, size_t arity) -> Group& {
+            uint64_t key = PredicateDirectory<Relation>::makeKey(name, arity);
+            auto inserted = groupOf.emplace(key, groups.size());
+            if (inserted.second) groups.push_back({name, arity, 0, {}});
+            return groups[inserted.first->second];
+        };
+        
+        for (const auto& relation : baseRelations) {
+            Group& group = groupFor(relation->name, relation->arity);
+            const atomic<uint64_t>* died = relation->died.load(memory_order_acquire);
+            for (size_t pos = 0; pos < relation->count; pos++) {
+                if (died && died[pos].load(memory_order_acquire) <= version) continue;
+                const uint32_t* args = relation->args + pos * relation->arity;
+                group.args.insert(group.args.end(), args, args + relation->arity);
+                group.count++;
+            }
+        }
+        for (auto& shard : shards) {
+            shard->facts.forEach([&](uint64_t, const Relation& relation) {
+                Group& group = groupFor(relation.name, relation.arity);
+                const RelationData& data = *relation.data.load(memory_order_acquire);
+                size_t count = data.versions.size();
+                for (size_t pos = 0; pos < count; pos++) {
+                    if (!data.versions[pos].visibleAt(version)) continue;
+                    for (size_t i = 0; i < relation.arity; i++) {
+                        group.args.push_back(data.args[pos * relation.arity + i]);
+                    }
+                    group.count++;
+                }
+            });
+        }
+        groups.erase(remove_if(groups.begin(), groups.end(),
+                               [](const Group& group) { return group.count == 0; }),
+                     groups.end());
+        sort(groups.begin(), groups.end(), [&](const Group& a, const Group& b) {
+            string_view nameA = atoms.name(a.name);
+            string_view nameB = atoms.name(b.name);
+            return nameA != nameB ? nameA < nameB : a.arity < b.arity;
+        });
+        
+        // Renumber the atoms still in use densely, lowercase spellings
+        // included, and rewrite the tuples with the new ids
+        vector<uint32_t> remap(atoms.idLimit(), AtomTable::NONE);
+        vector<uint32_t> order;           // Old id of each new id
+        auto use = [&](uint32_t atom) {
+            if (remap[atom] == AtomTable::NONE) {
+                remap[atom] = static_cast<uint32_t>(order.size());
+                order.push_back(atom);
+            }
+            return remap[atom];
+        };
+        for (Group& group : groups) {
+            group.name = use(group.name);
+            for (uint32_t& atom : group.args) atom = use(atom);
+        }
+        for (size_t i = 0; i < order.size(); i++) use(atoms.folded(order[i]));
+        
+        string temp = path + ".tmp";
+        ofstream file(temp, ios::binary | ios::trunc);
+        if (!file) throw runtime_error("Cannot write " + temp);
+        
+        SnapshotHeader header{};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t offset = sizeof(header);
+        StreamHash body;
+        auto emit = [&](const void* data, size_t size) {
+            file.write(static_cast<const char*>(data), size);
+            body.update(static_cast<const char*>(data), size);
+            offset += size;
+        };
+        auto align = [&] {
+            static const char zeros[8] = {};
+            emit(zeros, (8 - offset % 8) % 8);
+        };
+        
+        // Atoms: offsets into the text, lowercase ids and a hash table
+        size_t atomCount = order.size();
+        vector<uint64_t> textOffsets(atomCount + 1, 0);
+        vector<uint32_t> folded(atomCount);
+        for (size_t id = 0; id < atomCount; id++) {
+            textOffsets[id + 1] = textOffsets[id] + atoms.name(order[id]).size();
+            folded[id] = remap[atoms.folded(order[id])];
+        }
+        size_t slotCount = 2;
+        while (slotCount < 2 * atomCount) slotCount <<= 1;
+        vector<uint32_t> slots(slotCount, 0);
+        for (size_t id = 0; id < atomCount; id++) {
+            string_view text = atoms.name(order[id]);
+            size_t i = hashBytes(text.data(), text.size()) & (slotCount - 1);
+            while (slots[i] != 0) i = (i + 1) & (slotCount - 1);
+            slots[i] = static_cast<uint32_t>(id + 1);
+        }
+        
+        header.atomCount = atomCount;
+        header.atomSlotCount = slotCount;
+        header.atomOffsets = offset;
+        emit(textOffsets.data(), textOffsets.size() * sizeof(uint64_t));
+        header.atomFolded = offset;
+        emit(folded.data(), folded.size() * sizeof(uint32_t));
+        align();
+        header.atomSlots = offset;
+        emit(slots.data(), slots.size() * sizeof(uint32_t));
+        align();
+        header.atomText = offset;
+        for (uint32_t atom : order) {
+            string_view text = atoms.name(atom);
+            emit(text.data(), text.size());
+        }
+        align();
+        
+        // Relations: arguments, a sketch over the new ids and an index per
+        // column with the positions of each lowercase value in order
+        vector<SnapshotRelation> table;
+        for (const Group& group : groups) {
+            SnapshotRelation entry{};
+            entry.name = group.name;
+            entry.arity = static_cast<uint32_t>(group.arity);
+            entry.tupleCount = group.count;
+            entry.args = offset;
+            emit(group.args.data(), group.args.size() * sizeof(uint32_t));
+            align();
+            
+            RelationSketch sketch;
+            sketch.rowCount = group.count;
+            sketch.columns.resize(group.arity);
+            for (size_t pos = 0; pos < group.count; pos++) {
+                for (size_t i = 0; i < group.arity; i++) {
+                    sketch.add(i, folded[group.args[pos * group.arity + i]]);
+                }
+            }
+            BinaryWriter sketchBytes;
+            sketch.save(sketchBytes);
+            entry.sketch = offset;
+            entry.sketchSize = sketchBytes.bytes.size();
+            emit(sketchBytes.bytes.data(), sketchBytes.bytes.size());
+            align();
+            
+            for (size_t i = 0; i < min(group.arity, MAX_INDEXED_COLUMNS); i++) {
+                entry.indexes[i] = offset;
+                writeBaseIndex(group.args, group.count, group.arity, i, folded,
+                               emit);
+                align();
+            }
+            table.push_back(entry);
+        }
+        
+        header.relationCount = table.size();
+        header.relations = offset;
+        emit(table.data(), table.size() * sizeof(SnapshotRelation));
+        
+        header.magic = SNAPSHOT_MAGIC;
+        header.format = SNAPSHOT_FORMAT;
+        header.fileSize = offset;
+        header.checksum = 0;
+        header.checksum = mixHash(body.finish() ^
+            hashBytes(reinterpret_cast<const char*>(&header), sizeof(header)));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+        if (!file) throw runtime_error("Cannot write " + temp);
+        
+        syncPath(temp);
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            throw runtime_error("Cannot replace " + path);
+        }
+        syncPath(parentDirectory(path));
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: load
+    // Purpose: Opens a snapshot written by save() as the starting contents of
+    //          an empty database. The file is mapped, not copied: atoms,
+    //          tuples and indexes are read in place, and only the statistics
+    //          are decoded. New facts go to the shards as usual; retracting
+    //          a snapshot fact tombstones it in memory.
+    // Parameters:
+    //   - path: The snapshot file
+    //   - verify: Checks the checksum and every stored id first. Without
+    //             it, loading costs only the pages touched, but a damaged
+    //             file gives undefined results.
+    // Throws runtime_error if the database is not empty or the file is not
+    // a valid snapshot.
+    // ------------------------------------------------------------------------
+    void load(const string& path, bool verify = true) {
+        if (atoms.size() > 0 || !baseRelations.empty()) {
+            throw runtime_error("A snapshot can only be loaded into an empty database");
+        }
+        
+        MappedFile file(path);
+        const char* bytes = file.data();
+        size_t size = file.size();
+        auto corrupt = [&](const string& problem) {
+            return runtime_error("Corrupt snapshot " + path + ": " + problem);
+        };
+        
+        SnapshotHeader header;
+        if (size < sizeof(header)) throw corrupt("truncated");
+        memcpy(&header, bytes, sizeof(header));
+        if (header.magic != SNAPSHOT_MAGIC) {
+            throw runtime_error(path + " is not a database snapshot");
+        }
+        if (header.format != SNAPSHOT_FORMAT) {
+            throw runtime_error(path + " has unsupported snapshot format " +
+                                to_string(header.format));
+        }
+        if (header.fileSize != size) throw corrupt("truncated");
+        if (verify) {
+            StreamHash body;
+            body.update(bytes + sizeof(header), size - sizeof(header));
+            uint64_t stored = header.checksum;
+            header.checksum = 0;
+            uint64_t actual = mixHash(body.finish() ^
+                hashBytes(reinterpret_cast<const char*>(&header), sizeof(header)));
+            if (actual != stored) throw corrupt("checksum mismatch");
+        }
+        
+        // Pointer to count items at a file offset, after a bounds check
+        auto section = [&](uint64_t offset, uint64_t count, size_t itemSize) {
+            if (offset % 8 != 0 || offset > size ||
+                count > (size - offset) / itemSize) {
+                throw corrupt("section out of bounds");
+            }
+            return bytes + offset;
+        };
+        
+        // Atoms
+        if (header.atomCount >= AtomTable::NONE ||
+            header.atomSlotCount <= header.atomCount ||
+            (header.atomSlotCount & (header.atomSlotCount - 1)) != 0) {
+            throw corrupt("bad atom table");
+        }
+        AtomTable::Base base;
+        base.count = static_cast<uint32_t>(header.atomCount);
+        base.offsets = reinterpret_cast<const uint64_t*>(
+            section(header.atomOffsets, header.atomCount + 1, sizeof(uint64_t)));
+        base.folded = reinterpret_cast<const uint32_t*>(
+            section(header.atomFolded, header.atomCount, sizeof(uint32_t)));
+        base.slots = reinterpret_cast<const uint32_t*>(
+            section(header.atomSlots, header.atomSlotCount, sizeof(uint32_t)));
+        base.slotMask = header.atomSlotCount - 1;
+        base.text = section(header.atomText, base.offsets[base.count], 1);
+        if (verify) {
+            bool valid = base.offsets[0] == 0;
+            for (uint32_t id = 0; id < base.count && valid; id++) {
+                valid = base.offsets[id] <= base.offsets[id + 1] &&
+                        base.folded[id] < base.count;
+            }
+            for (uint64_t i = 0; i <= base.slotMask && valid; i++) {
+                valid = base.slots[i] <= base.count;
+            }
+            if (!valid) throw corrupt("bad atom table");
+        }
+        
+        // Relations
+        const SnapshotRelation* table = reinterpret_cast<const SnapshotRelation*>(
+            section(header.relations, header.relationCount, sizeof(SnapshotRelation)));
+        vector<unique_ptr<BaseRelation>> loaded;
+        unordered_map<uint64_t, BaseRelation*> directory;
+        for (uint64_t r = 0; r < header.relationCount; r++) {
+            const SnapshotRelation& entry = table[r];
+            if (entry.name >= base.count || entry.tupleCount >= UINT32_MAX) {
+                throw corrupt("bad relation");
+            }
+            
+            unique_ptr<BaseRelation> relation(new BaseRelation());
+            relation->name = entry.name;
+            relation->arity = entry.arity;
+            relation->count = entry.tupleCount;
+            if (entry.arity > 0) {
+                relation->args = reinterpret_cast<const uint32_t*>(
+                    section(entry.args, entry.tupleCount,
+                            sizeof(uint32_t) * entry.arity));
+            }
+            
+            BinaryReader in{string_view(
+                section(entry.sketch, entry.sketchSize, 1), entry.sketchSize)};
+            relation->sketch.load(in);
+            if (!in.ok || relation->sketch.columns.size() != entry.arity) {
+                throw corrupt("bad statistics");
+            }
+            
+            for (size_t i = 0; i < min<size_t>(entry.arity, MAX_INDEXED_COLUMNS); i++) {
+                if (entry.indexes[i] == 0) continue;
+                const SnapshotIndex& index = *reinterpret_cast<const SnapshotIndex*>(
+                    section(entry.indexes[i], 1, sizeof(SnapshotIndex)));
+                uint64_t slotsAt = entry.indexes[i] + sizeof(SnapshotIndex);
+                if (index.slotCount == 0 ||
+                    (index.slotCount & (index.slotCount - 1)) != 0) {
+                    throw corrupt("bad index");
+                }
+                BaseIndex& column = relation->indexes[i];
+                column.slots = reinterpret_cast<const SnapshotIndexSlot*>(
+                    section(slotsAt, index.slotCount, sizeof(SnapshotIndexSlot)));
+                column.slotMask = index.slotCount - 1;
+                column.postings = reinterpret_cast<const uint32_t*>(
+                    section(slotsAt + index.slotCount * sizeof(SnapshotIndexSlot),
+                            index.postingCount, sizeof(uint32_t)));
+                if (verify && !validBaseIndex(column, index, relation->count)) {
+                    throw corrupt("bad index");
+                }
+            }
+            
+            if (verify) {
+                size_t total = relation->count * relation->arity;
+                for (size_t i = 0; i < total; i++) {
+                    if (relation->args[i] >= base.count) throw corrupt("bad relation");
+                }
+            }
+            
+            uint64_t key = PredicateDirectory<Relation>::makeKey(entry.name, entry.arity);
+            if (!directory.emplace(key, relation.get()).second) {
+                throw corrupt("duplicate relation");
+            }
+            loaded.push_back(move(relation));
+        }
+        
+        atoms.attachBase(base);
+        baseRelations = move(loaded);
+        baseDirectory = move(directory);
+        mapping = move(file);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: openLog
+    // Purpose: Replays a write-ahead log left by an earlier run, then logs
+    //          every later addFact, addFacts and retraction to it. Load the
+    //          snapshot the log continues from first, and open the log
+    //          before other threads use the database.
+    // Parameters:
+    //   - path: The log file; created if missing
+    //   - policy: When logged changes are synced to disk
+    // Returns: Number of records replayed
+    // ------------------------------------------------------------------------
+    size_t openLog(const string& path,
+                   WriteAheadLog::SyncPolicy policy = WriteAheadLog::SyncPolicy::Commit) {
+        if (wal) throw runtime_error("A write-ahead log is already open");
+        
+        FactBatch batch;
+        size_t records = WriteAheadLog::replay(path,
+            [&](WriteAheadLog::RecordType type, string_view predicate,
+                const string_view* arguments, size_t count) {
+                if (type == WriteAheadLog::ADD) {
+                    batch.add(predicate, arguments, count);
+                    if (batch.size() >= 4096) {
+                        addFacts(batch);
+                        batch.clear();
+                    }
+                    return;
+                }
+                addFacts(batch);
+                batch.clear();
+                retract(string(predicate), vector<string>(arguments, arguments + count));
+            });
+        addFacts(batch);
+        
+        wal.reset(new WriteAheadLog(path, policy));
+        return records;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: checkpoint
+    // Purpose: Saves a snapshot and empties the write-ahead log, whose
+    //          changes the snapshot now holds. Writers wait meanwhile.
+    // ------------------------------------------------------------------------
+    void checkpoint(const string& snapshotPath) {
+        unique_lock<shared_mutex> exclusive(checkpointMutex);
+        save(snapshotPath);
+        if (wal) wal->reset();
+    }
+
+private:
+    // Helper function to turn a textual pattern into a predicate atom and
+    // lowercase argument atoms (WILDCARD for "?")
+    // Returns: False if some atom was never interned, so nothing can match
+    bool resolvePattern(const string& predicate, const vector<string>& arguments,
+                        uint32_t& name, vector<uint32_t>& pattern) {
+        name = atoms.lookup(toLower(predicate));
+        return name != AtomTable::NONE && resolveArguments(arguments, pattern);
+    }
+    
+    // Helper function to look up the atoms of a query pattern
+    bool resolveArguments(const vector<string>& arguments,
+                          vector<uint32_t>& pattern) {
+        pattern.clear();
+        for (const string& argument : arguments) {
+            if (argument == "?") {
+                pattern.push_back(WILDCARD);
+                continue;
+            }
+            uint32_t atom = atoms.lookup(toLower(argument));
+            if (atom == AtomTable::NONE) return false;
+            pattern.push_back(atom);
+        }
+        return true;
+    }
+    
+    // Helper function to pick the shard for a relation key and the
+    // lowercase first argument (WILDCARD if unknown)
+    size_t shardFor(uint64_t key, uint32_t firstArgument) const {
+        if (shards.size() == 1) return 0;
+        
+        uint64_t hash = mixHash(key);
+        if (shardingMode == ShardingMode::ByFirstArgument &&
+            firstArgument != WILDCARD) {
+            hash = mixHash(hash ^ firstArgument);
+        }
+        return hash % shards.size();
+    }
+    
+    // Helper function to lock the shards a batch writes to. They are always
+    // locked in index order, so batches cannot deadlock with each other;
+    // everyone else holds one shard lock at a time.
+    vector<unique_lock<mutex>> lockShards(const vector<bool>& targeted) {
+        vector<unique_lock<mutex>> locks;
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (targeted[s]) locks.emplace_back(shards[s]->writeMutex);
+        }
+        return locks;
+    }
+    
+    // Helper function to visit every shard that can hold facts matching
+    // the pattern: one shard when the pattern pins it down, else all
+    template <typename Visitor>
+    void forEachCandidateShard(uint64_t key, const vector<uint32_t>& pattern,
+                               Visitor visit) {
+        bool pinned = shardingMode == ShardingMode::ByPredicate ||
+                      pattern.empty() || pattern[0] != WILDCARD;
+        if (pinned) {
+            visit(*shards[shardFor(key, pattern.empty() ? WILDCARD : pattern[0])]);
+        } else {
+            for (auto& shard : shards) visit(*shard);
+        }
+    }
+    
+    // Helper function to intern a predicate name in lowercase.
+    // Caller must hold an epoch guard.
+    uint32_t internPredicate(string_view predicate) {
+        if (hasAsciiUpper(predicate)) {
+            return atoms.intern(toLowerAscii(predicate));
+        }
+        return atoms.intern(predicate);
+    }
+    
+    // Helper function to pick the shard of an interned fact
+    Shard& shardOf(uint64_t key, const uint32_t* args, size_t arity) {
+        return *shards[shardFor(key, arity ? atoms.folded(args[0]) : WILDCARD)];
+    }
+    
+    // Helper function to add one interned fact to its shard and commit it.
+    // Caller must hold an epoch guard.
+    void insertTuple(uint32_t name, const uint32_t* args, size_t arity) {
+        uint64_t key = PredicateDirectory<Relation>::makeKey(name, arity);
+        lock_guard<mutex> lock(shardOf(key, args, arity).writeMutex);
+        
+        TupleVersion& tuple = appendFact(name, args, arity);
+        EpochManager::instance().commit([&](uint64_t version) {
+            tuple.born.store(version, memory_order_release);
+        });
+    }
+    
+    // Helper function to add one interned fact to its shard, unborn: it
+    // stays invisible until a commit stamps it with a version. Caller must
+    // hold an epoch guard and the shard's writeMutex until that commit.
+    TupleVersion& appendFact(uint32_t name, const uint32_t* args, size_t arity) {
+        uint64_t key = PredicateDirectory<Relation>::makeKey(name, arity);
+        Shard& shard = shardOf(key, args, arity);
+        
+        Relation& relation = shard.facts.findOrInsert(key, [&](Relation& created) {
+            created.name = name;
+            created.arity = arity;
+        });
+        
+        RelationData& data = *relation.data.load();
+        size_t pos = appendTuple(data, args, arity);
+        updateStatistics(relation, args);
+        countAdded(key, name, arity, 1);
+        return data.versions.at(pos);
+    }
+    
+    // Helper function to append a tuple and register it in the indexes.
+    // The tuple is published unborn unless told otherwise. Writer only.
+    size_t appendTuple(RelationData& data, const uint32_t* args, size_t arity,
+                       uint64_t born = EpochManager::NEVER,
+                       uint64_t died = EpochManager::NEVER) {
+        for (size_t i = 0; i < arity; i++) {
+            data.args.push_back(args[i]);
+        }
+        size_t pos = data.versions.append([&](TupleVersion& tuple) {
+            tuple.born.store(born, memory_order_relaxed);
+            tuple.died.store(died, memory_order_relaxed);
+        });
+        
+        size_t indexed = min(arity, MAX_INDEXED_COLUMNS);
+        for (size_t i = 0; i < indexed; i++) {
+            ColumnIndex* index = data.indexes[i].load(memory_order_relaxed);
+            if (!index) {
+                index = new ColumnIndex();
+                data.indexes[i].store(index, memory_order_release);
+            }
+            index->findOrInsert(atoms.folded(args[i]))
+                .push_back(static_cast<uint32_t>(pos));
+        }
+        return pos;
+    }
+    
+    // Helper function to index the tuples from position first on, one
+    // column at a time. Positions are sorted by value, so each posting list
+    // is found once per run of equal values rather than once per tuple.
+    // Writer only.
+    void indexRange(RelationData& data, size_t arity, size_t first) {
+        size_t end = data.versions.size();
+        vector<uint64_t> entries(end - first);
+        vector<uint64_t> scratch(end - first);
+        
+        for (size_t column = 0; column < min(arity, MAX_INDEXED_COLUMNS); column++) {
+            ColumnIndex* index = data.indexes[column].load(memory_order_relaxed);
+            if (!index) {
+                index = new ColumnIndex();
+                data.indexes[column].store(index, memory_order_release);
+            }
+            
+            for (size_t pos = first; pos < end; pos++) {
+                uint64_t value = atoms.folded(data.args[pos * arity + column]);
+                entries[pos - first] = value << 32 | pos;
+            }
+            
+            // Stable LSD radix sort on the value, 16 bits at a time; the
+            // positions are already ascending
+            for (unsigned shift = 32; shift < 64; shift += 16) {
+                vector<size_t> starts(65537, 0);
+                for (uint64_t entry : entries) starts[((entry >> shift) & 0xffff) + 1]++;
+                for (size_t digit = 1; digit <= 65536; digit++) {
+                    starts[digit] += starts[digit - 1];
+                }
+                for (uint64_t entry : entries) {
+                    scratch[starts[(entry >> shift) & 0xffff]++] = entry;
+                }
+                entries.swap(scratch);
+            }
+            
+            SegmentedVector<uint32_t, 2>* postings = nullptr;
+            uint64_t current = UINT64_MAX;
+            for (uint64_t entry : entries) {
+                if (entry >> 32 != current) {
+                    current = entry >> 32;
+                    postings = &index->findOrInsert(static_cast<uint32_t>(current));
+                }
+                postings->push_back(static_cast<uint32_t>(entry));
+            }
+        }
+    }
+    
+    // Helper function to add up the tuples and indexes of a relation, and
+    // what compacting it now would leave of them. Caller must hold the
+    // shard's writeMutex.
+    void measureRelation(const Relation& relation, uint64_t oldest,
+                         PredicateMemory& memory) const {
+        const RelationData& data = *relation.data.load(memory_order_acquire);
+        size_t arity = relation.arity;
+        size_t count = data.versions.size();
+        
+        MemoryUse tuples;
+        tuples.add(&data, sizeof(RelationData), sizeof(RelationData));
+        tuples += data.args.memoryUse();
+        tuples += data.versions.memoryUse();
+        
+        // Compaction keeps what some snapshot can still see
+        vector<bool> kept(count, true);
+        size_t live = count;
+        for (size_t pos = 0; pos < count; pos++) {
+            uint64_t died = data.versions[pos].died.load(memory_order_relaxed);
+            if (died != EpochManager::NEVER) memory.deadTuples++;
+            if (died <= oldest) {
+                kept[pos] = false;
+                live--;
+            }
+        }
+        memory.tuples += count;
+        memory.reclaimableTuples += count - live;
+        memory.tupleBytes += tuples;
+        
+        bool shrinks = live < count;
+        uint64_t compacted = shrinks ? sizeof(RelationData) +
+                                       decltype(data.args)::bytesFor(live * arity) +
+                                       decltype(data.versions)::bytesFor(live)
+                                     : tuples.requested;
+        for (size_t column = 0; column < MAX_INDEXED_COLUMNS; column++) {
+            const ColumnIndex* index = data.indexes[column].load(memory_order_acquire);
+            if (!index) continue;
+            
+            size_t keys = 0;
+            uint64_t postingBytes = 0;
+            MemoryUse use;
+            use.add(index, sizeof(ColumnIndex), sizeof(ColumnIndex));
+            use += index->memoryUse([&](uint32_t,
+                                        const SegmentedVector<uint32_t, 2>& postings) {
+                if (shrinks) {
+                    size_t remaining = 0;
+                    for (size_t i = 0; i < postings.size(); i++) {
+                        if (kept[postings[i]]) remaining++;
+                    }
+                    if (remaining) {
+                        keys++;
+                        postingBytes += SegmentedVector<uint32_t, 2>::bytesFor(remaining);
+                    }
+                }
+                return postings.memoryUse();
+            });
+            memory.indexBytes += use;
+            
+            if (!shrinks) {
+                compacted += use.requested;
+            } else if (live > 0) {
+                compacted += sizeof(ColumnIndex) + ColumnIndex::bytesFor(keys) + postingBytes;
+            }
+        }
+        memory.compactedBytes += compacted;
+    }
+    
+    // Helper function to turn a stored tuple back into strings
+    vector<string> materialize(const RelationData& data, size_t arity,
+                               size_t pos) const {
+        vector<string> fact;
+        fact.reserve(arity);
+        for (size_t i = 0; i < arity; i++) {
+            fact.emplace_back(atoms.name(data.args[pos * arity + i]));
+        }
+        return fact;
+    }
+    
+    // Helper function to turn a snapshot tuple back into strings
+    vector<string> materialize(const BaseRelation& relation, size_t pos) const {
+        vector<string> fact;
+        fact.reserve(relation.arity);
+        const uint32_t* args = relation.args + pos * relation.arity;
+        for (size_t i = 0; i < relation.arity; i++) {
+            fact.emplace_back(atoms.name(args[i]));
+        }
+        return fact;
+    }
+    
+    // What the matching loops did, for the metrics and query profiles
+    struct ScanCounts {
+        uint64_t scanned = 0;
+        uint64_t indexLookups = 0;
+        uint64_t fullScans = 0;
+        size_t column = 0;                // Argument whose index was used last
+                                          // (from 1), 0 for a full scan
+        uint64_t postings = 0;            // Its postings for the value, if any
+        
+        void add(size_t tuples, size_t indexColumn, uint64_t indexPostings = 0) {
+            scanned += tuples;
+            (indexColumn ? indexLookups : fullScans)++;
+            column = indexColumn;
+            postings = indexPostings;
+        }
+        
+        void add(const ScanCounts& other) {
+            scanned += other.scanned;
+            indexLookups += other.indexLookups;
+            fullScans += other.fullScans;
+        }
+        
+        // The access path of the last add, as shown in a profile
+        string path() const {
+            if (!column) return "full scan";
+            string text = "index on argument " + to_string(column);
+            if (!postings) return text + " (value not present)";
+            return text + " (" + to_string(postings) +
+                   (postings == 1 ? " posting)" : " postings)");
+        }
+    };
+    
+    // Helper function to name a predicate in the metrics, e.g. "parent/2"
+    string predicateLabel(uint32_t name, size_t arity) const {
+        return string(atoms.name(name)) + "/" + to_string(arity);
+    }
+    
+    // Helper function to count added facts. Caller must hold an epoch guard.
+    void countAdded(uint64_t key, uint32_t name, size_t arity, uint64_t count) {
+        Metrics& metrics = Metrics::instance();
+        if (!metrics.enabled()) return;
+        metrics.add(metrics.predicate(key, arity,
+                        [&] { return predicateLabel(name, arity); }).first +
+                    Metrics::FACTS_ADDED, count);
+    }
+    
+    // Helper function to visit the positions of tuples matching a resolved
+    // pattern that are visible at the given version. Uses the most
+    // selective bound column's index when there is one, otherwise scans.
+    // The visitor returns false to stop early.
+    template <typename Visitor>
+    void forEachMatch(const RelationData& data, const vector<uint32_t>& pattern,
+                      uint64_t version, Visitor visit,
+                      ScanCounts* counts = nullptr) const {
+        size_t arity = pattern.size();
+        const SegmentedVector<uint32_t, 2>* candidates = nullptr;
+        size_t column = 0;
+        
+        for (size_t i = 0; i < min(arity, MAX_INDEXED_COLUMNS); i++) {
+            if (pattern[i] == WILDCARD) continue;
+            
+            // A value missing from an index cannot match at all
+            const ColumnIndex* index = data.indexes[i].load(memory_order_acquire);
+            auto postings = index ? index->find(pattern[i]) : nullptr;
+            if (!postings) {
+                if (counts) counts->add(0, i + 1);
+                return;
+            }
+            if (!candidates || postings->size() < candidates->size()) {
+                candidates = postings;
+                column = i + 1;
+            }
+        }
+        
+        auto check = [&](size_t pos) {
+            if (!data.versions[pos].visibleAt(version)) return true;
+            
+            // Check each argument; wildcards match anything
+            for (size_t i = 0; i < arity; i++) {
+                if (pattern[i] != WILDCARD &&
+                    pattern[i] != atoms.folded(data.args[pos * arity + i])) {
+                    return true;
+                }
+            }
+            return visit(pos);
+        };
+        
+        size_t scanned = 0;
+        if (candidates) {
+            size_t count = candidates->size();
+            while (scanned < count && check((*candidates)[scanned++])) {}
+        } else {
+            size_t count = data.versions.size();
+            while (scanned < count && check(scanned++)) {}
+        }
+        if (counts) counts->add(scanned, column, candidates ? candidates->size() : 0);
+    }
+    
+    // Helper function shared by retract and retractAll
+    size_t removeMatching(const string& predicate,
+                          const vector<string>& arguments, size_t limit) {
+        size_t removed = 0;
+        {
+            Snapshot guard = snapshot();
+            shared_lock<shared_mutex> logging = lockForLogging();
+            
+            uint32_t name;
+            vector<uint32_t> pattern;
+            if (!resolvePattern(predicate, arguments, name, pattern)) return 0;
+            
+            uint64_t key = PredicateDirectory<Relation>::makeKey(name, pattern.size());
+            auto base = baseDirectory.find(key);
+            if (base != baseDirectory.end()) {
+                removed += removeFromBase(*base->second, pattern, limit);
+            }
+            forEachCandidateShard(key, pattern, [&](Shard& shard) {
+                if (removed < limit) {
+                    removed += removeFromShard(shard, key, pattern, limit - removed);
+                }
+            });
+        }
+        if (wal && removed > 0) wal->waitDurable(wal->end());
+        return removed;
+    }
+    
+    // Helper function to take the lock that keeps checkpoints out while a
+    // change is logged and applied (an empty lock when nothing is logged)
+    shared_lock<shared_mutex> lockForLogging() {
+        if (!wal) return shared_lock<shared_mutex>();
+        return shared_lock<shared_mutex>(checkpointMutex);
+    }
+    
+    // Helper function to log the facts a retraction is about to tombstone.
+    // Caller holds the lock that orders them with other writes to them.
+    template <typename Materialize>
+    void logRetracted(uint32_t name, const vector<size_t>& victims,
+                      Materialize materializeAt) {
+        if (!wal) return;
+        string_view predicate = atoms.name(name);
+        for (size_t pos : victims) {
+            vector<string> fact = materializeAt(pos);
+            vector<string_view> views(fact.begin(), fact.end());
+            wal->append(WriteAheadLog::RETRACT, predicate, views.data(), views.size());
+        }
+    }
+    
+    // Helper function to tombstone up to limit matches within one shard
+    size_t removeFromShard(Shard& shard, uint64_t key,
+                           const vector<uint32_t>& pattern, size_t limit) {
+        lock_guard<mutex> lock(shard.writeMutex);
+        
+        Relation* relation = shard.facts.find(key);
+        if (!relation) return 0;
+        
+        // The shard's writers are serialized and commits are ordered, so
+        // the current version sees everything this shard holds
+        RelationData& data = *relation->data.load();
+        vector<size_t> victims;
+        forEachMatch(data, pattern, EpochManager::instance().currentVersion(),
+                     [&](size_t pos) {
+            victims.push_back(pos);
+            return victims.size() < limit;
+        });
+        
+        if (victims.empty()) return 0;
+        logRetracted(relation->name, victims, [&](size_t pos) {
+            return materialize(data, relation->arity, pos);
+        });
+        
+        // Tombstone the matches in one new version; older snapshots
+        // keep seeing them until they are released
+        EpochManager::instance().commit([&](uint64_t version) {
+            for (size_t pos : victims) {
+                data.versions.at(pos).died.store(version, memory_order_release);
+            }
+        });
+        data.deadCount += victims.size();
+        
+        // Row counts stay exact; sketches only ever grow
+        relation->sketch.rowCount -= victims.size();
+        
+        if (needsCompaction(data)) {
+            shard.compactionQueue.insert(key);
+            compactionWanted.notify_one();
+        }
+        return victims.size();
+    }
+    
+    // Helper function to find the slot of a lowercase atom in a snapshot
+    // column index
+    // Returns: The slot, or nullptr if no tuple has that value
+    static const SnapshotIndexSlot* probeBaseIndex(const BaseIndex& index,
+                                                   uint32_t key) {
+        for (uint64_t i = mixHash(key) & index.slotMask;;
+             i = (i + 1) & index.slotMask) {
+            const SnapshotIndexSlot& slot = index.slots[i];
+            if (slot.key == key) return &slot;
+            if (slot.key == AtomTable::NONE) return nullptr;
+        }
+    }
+    
+    // Helper function like forEachMatch, for a relation of the snapshot
+    template <typename Visitor>
+    void forEachBaseMatch(const BaseRelation& relation,
+                          const vector<uint32_t>& pattern, uint64_t version,
+                          Visitor visit, ScanCounts* counts = nullptr) const {
+        size_t arity = pattern.size();
+        const SnapshotIndexSlot* candidates = nullptr;
+        const uint32_t* postings = nullptr;
+        size_t column = 0;
+        
+        for (size_t i = 0; i < min(arity, MAX_INDEXED_COLUMNS); i++) {
+            if (pattern[i] == WILDCARD) continue;
+            
+            const BaseIndex& index = relation.indexes[i];
+            const SnapshotIndexSlot* slot =
+                index.slots ? probeBaseIndex(index, pattern[i]) : nullptr;
+            if (!slot) {
+                if (counts) counts->add(0, i + 1);
+                return;
+            }
+            if (!candidates || slot->count < candidates->count) {
+                candidates = slot;
+                postings = index.postings + slot->start;
+                column = i + 1;
+            }
+        }
+        
+        const atomic<uint64_t>* died = relation.died.load(memory_order_acquire);
+        auto check = [&](size_t pos) {
+            if (died && died[pos].load(memory_order_acquire) <= version) return true;
+            
+            const uint32_t* args = relation.args + pos * arity;
+            for (size_t i = 0; i < arity; i++) {
+                if (pattern[i] != WILDCARD && pattern[i] != atoms.folded(args[i])) {
+                    return true;
+                }
+            }
+            return visit(pos);
+        };
+        
+        size_t scanned = 0;
+        if (candidates) {
+            while (scanned < candidates->count && check(postings[scanned++])) {}
+        } else {
+            while (scanned < relation.count && check(scanned++)) {}
+        }
+        if (counts) counts->add(scanned, column, candidates ? candidates->count : 0);
+    }
+    
+    // Helper function to tombstone up to limit matches in the snapshot.
+    // Snapshot tombstones are never compacted away.
+    size_t removeFromBase(BaseRelation& relation, const vector<uint32_t>& pattern,
+                          size_t limit) {
+        lock_guard<mutex> lock(baseMutex);
+        
+        vector<size_t> victims;
+        forEachBaseMatch(relation, pattern, EpochManager::instance().currentVersion(),
+                         [&](size_t pos) {
+            victims.push_back(pos);
+            return victims.size() < limit;
+        });
+        if (victims.empty()) return 0;
+        logRetracted(relation.name, victims,
+                     [&](size_t pos) { return materialize(relation, pos); });
+        
+        atomic<uint64_t>* died = relation.died.load();
+        if (!died) {
+            died = new atomic<uint64_t>[relation.count];
+            for (size_t pos = 0; pos < relation.count; pos++) {
+                died[pos].store(EpochManager::NEVER, memory_order_relaxed);
+            }
+            relation.died.store(died, memory_order_release);
+        }
+        
+        EpochManager::instance().commit([&](uint64_t version) {
+            for (size_t pos : victims) {
+                died[pos].store(version, memory_order_release);
+            }
+        });
+        relation.sketch.rowCount -= victims.size();
+        return victims.size();
+    }
+    
+    // Helper function to write the index of one column of a snapshot
+    // relation: the positions of each lowercase value, in ascending order
+    template <typename Emit>
+    static void writeBaseIndex(const vector<uint32_t>& args, size_t count,
+                               size_t arity, size_t column,
+                               const vector<uint32_t>& folded, Emit& emit) {
+        vector<pair<uint32_t, uint32_t>> entries(count);
+        for (size_t pos = 0; pos < count; pos++) {
+            entries[pos] = {folded[args[pos * arity + column]],
+                            static_cast<uint32_t>(pos)};
+        }
+        sort(entries.begin(), entries.end());
+        
+        size_t keys = 0;
+        for (size_t i = 0; i < count; i++) {
+            keys += i == 0 || entries[i].first != entries[i - 1].first;
+        }
+        SnapshotIndex index{2, count};
+        while (index.slotCount < 2 * keys) index.slotCount <<= 1;
+        
+        vector<SnapshotIndexSlot> slots(index.slotCount,
+                                        SnapshotIndexSlot{AtomTable::NONE, 0, 0});
+        vector<uint32_t> postings(count);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t key = entries[i].first;
+            postings[i] = entries[i].second;
+            if (i > 0 && key == entries[i - 1].first) continue;
+            
+            size_t run = i;
+            while (run < count && entries[run].first == key) run++;
+            uint64_t slot = mixHash(key) & (index.slotCount - 1);
+            while (slots[slot].key != AtomTable::NONE) {
+                slot = (slot + 1) & (index.slotCount - 1);
+            }
+            slots[slot] = {key, static_cast<uint32_t>(run - i), i};
+        }
+        
+        emit(&index, sizeof(index));
+        emit(slots.data(), slots.size() * sizeof(SnapshotIndexSlot));
+        emit(postings.data(), postings.size() * sizeof(uint32_t));
+    }
+    
+    // Helper function to check a loaded column index against its relation
+    static bool validBaseIndex(const BaseIndex& index, const SnapshotIndex& header,
+                               size_t tupleCount) {
+        bool hasEmpty = false;
+        for (uint64_t i = 0; i <= index.slotMask; i++) {
+            const SnapshotIndexSlot& slot = index.slots[i];
+            if (slot.key == AtomTable::NONE) {
+                hasEmpty = true;
+            } else if (slot.start > header.postingCount ||
+                       slot.count > header.postingCount - slot.start) {
+                return false;
+            }
+        }
+        for (uint64_t i = 0; i < header.postingCount; i++) {
+            if (index.postings[i] >= tupleCount) return false;
+        }
+        return hasEmpty;
+    }
+    
+    // Helper function to check a relation against the compaction threshold
+    bool needsCompaction(const RelationData& data) const {
+        return data.deadCount >= MIN_DEAD_FOR_COMPACTION &&
+               data.deadCount > compactionThreshold.load() * data.versions.size();
+    }
+    
+    // Helper function to rewrite a relation without the tombstones that no
+    // snapshot can see any more. Caller must hold the shard's writeMutex.
+    // Returns: False if old snapshots still pin every tombstone
+    bool compactRelation(Relation& relation) {
+        EpochManager& epochs = EpochManager::instance();
+        uint64_t oldest = epochs.oldestActiveVersion();
+        
+        RelationData* old = relation.data.load();
+        size_t count = old->versions.size();
+        
+        bool reclaimable = false;
+        for (size_t pos = 0; pos < count && !reclaimable; pos++) {
+            reclaimable = old->versions[pos].died.load(memory_order_relaxed) <= oldest;
+        }
+        if (!reclaimable) return false;
+        
+        RelationData* compacted = new RelationData();
+        vector<uint32_t> args(relation.arity);
+        for (size_t pos = 0; pos < count; pos++) {
+            const TupleVersion& tuple = old->versions[pos];
+            uint64_t died = tuple.died.load(memory_order_relaxed);
+            if (died <= oldest) continue;
+            
+            for (size_t i = 0; i < relation.arity; i++) {
+                args[i] = old->args[pos * relation.arity + i];
+            }
+            appendTuple(*compacted, args.data(), relation.arity,
+                        tuple.born.load(memory_order_relaxed), died);
+            if (died != EpochManager::NEVER) compacted->deadCount++;
+        }
+        
+        relation.data.store(compacted, memory_order_release);
+        epochs.retire([old] { delete old; });
+        return true;
+    }
+    
+    // Body of the background compactor thread
+    void compactionLoop() {
+        unique_lock<mutex> wakeLock(compactorMutex);
+        
+        while (!shuttingDown) {
+            compactionWanted.wait_for(wakeLock, chrono::milliseconds(100));
+            wakeLock.unlock();
+            
+            // Compact one predicate at a time so writers can get the shard
+            // lock in between. Predicates still pinned by old snapshots
+            // stay queued and are retried on the next round.
+            for (auto& shard : shards) {
+                unique_lock<mutex> lock(shard->writeMutex);
+                set<uint64_t> pending;
+                pending.swap(shard->compactionQueue);
+                
+                for (uint64_t key : pending) {
+                    Relation* relation = shard->facts.find(key);
+                    if (!relation) continue;
+                    
+                    compactRelation(*relation);
+                    if (needsCompaction(*relation->data.load())) {
+                        shard->compactionQueue.insert(key);
+                    }
+                    
+                    lock.unlock();
+                    this_thread::yield();
+                    lock.lock();
+                }
+            }
+            
+            EpochManager::instance().collect();
+            wakeLock.lock();
+        }
+    }
+    
+    // One entry of sortedRelations: a snapshot relation or a live one
+    struct ListedRelation {
+        string_view name;
+        size_t arity;
+        const BaseRelation* base;
+        const Relation* live;
+    };
+    
+    // Helper function to list every relation, ordered by name and arity
+    // (then snapshot before shards). Caller must hold an epoch guard.
+    vector<ListedRelation> sortedRelations() const {
+        vector<ListedRelation> relations;
+        for (const auto& relation : baseRelations) {
+            relations.push_back({atoms.name(relation->name), relation->arity,
+                                 relation.get(), nullptr});
+        }
+        for (auto& shard : shards) {
+            shard->facts.forEach([&](uint64_t, const Relation& relation) {
+                relations.push_back({atoms.name(relation.name), relation.arity,
+                                     nullptr, &relation});
+            });
+        }
+        stable_sort(relations.begin(), relations.end(),
+            [](const ListedRelation& a, const ListedRelation& b) {
+                return a.name != b.name ? a.name < b.name : a.arity < b.arity;
+            });
+        return relations;
+    }
+    
+    // Helper function to fold one new fact into the statistics
+    void updateStatistics(Relation& relation, const uint32_t* args) {
+        RelationSketch& sketch = relation.sketch;
+        if (sketch.columns.size() != relation.arity) {
+            sketch.columns.resize(relation.arity);
+        }
+        
+        sketch.rowCount++;
+        for (size_t i = 0; i < relation.arity; i++) {
+            sketch.add(i, atoms.folded(args[i]));
+        }
+    }
+    
+    // Helper function to turn internal sketches into a PredicateStats report.
+    // Caller must hold an epoch guard.
+    PredicateStats summarize(const string& pred, size_t arity,
+                             const RelationSketch& sketch) {
+        PredicateStats stats{pred, arity, sketch.rowCount, {}};
+        for (const auto& column : sketch.columns) {
+            ColumnStats summary{column.distinct.estimate(),
+                                column.distinct.isExact(), {}};
+            for (const auto& entry : column.heavy.top()) {
+                summary.heavyHitters.push_back(
+                    {string(atoms.name(static_cast<uint32_t>(entry.key))),
+                     entry.count, entry.error});
+            }
+            stats.columns.push_back(summary);
+        }
+        return stats;
+    }
+};
+
+// ============================================================================
+// CLASS: KeywordTable
+// Purpose: Small hash table from the lowercase keywords the sentence
+//          patterns care about ("is", "the", ...) to dense ids. Lookups take
+//          a string_view and never allocate.
+// ============================================================================
+class KeywordTable {
+public:
+    static constexpr uint16_t NONE = 0;     // Any word that is not a keyword
+    
+private:
+    vector<string> words{""};               // Indexed by id; 0 is NONE
+    vector<uint16_t> slots = vector<uint16_t>(16, NONE);
+    
+    void place(uint16_t id) {
+        size_t mask = slots.size() - 1;
+        size_t i = hashBytes(words[id].data(), words[id].size()) & mask;
+        while (slots[i] != NONE) i = (i + 1) & mask;
+        slots[i] = id;
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: add
+    // Purpose: Registers a keyword (given in lowercase) and returns its id
+    // ------------------------------------------------------------------------
+    uint16_t add(string_view word) {
+        uint16_t existing = lookup(word);
+        if (existing != NONE) return existing;
+        
+        words.emplace_back(word);
+        uint16_t id = static_cast<uint16_t>(words.size() - 1);
+        
+        // Keep at most half of the slots filled
+        if (words.size() * 2 > slots.size()) {
+            slots.assign(slots.size() * 2, NONE);
+            for (uint16_t i = 1; i < words.size(); i++) place(i);
+        } else {
+            place(id);
+        }
+        return id;
+    }
+    
+    // Id of a lowercase word, or NONE
+    uint16_t lookup(string_view word) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hashBytes(word.data(), word.size()) & mask;;
+             i = (i + 1) & mask) {
+            if (slots[i] == NONE) return NONE;
+            if (words[slots[i]] == word) return slots[i];
+        }
+    }
+    
+    const string& word(uint16_t id) const { return words[id]; }
+    size_t size() const { return words.size(); }
+};
+
+// ============================================================================
+// STRUCT: Token
+// Purpose: One word of a sentence. All views point into the sentence or the
+//          tokenizer's lowercase buffer and stay valid until the next call
+//          to SentenceTokenizer::tokenize.
+// ============================================================================
+struct Token {
+    string_view text;       // As written
+    string_view lower;      // Lowercase
+    string_view bare;       // Lowercase without trailing punctuation
+    uint16_t keyword;       // KeywordTable id of the lowercase form
+};
+
+// ============================================================================
+// CLASS: Gazetteer
+// Purpose: Known multi-word entities ("New York", "Bank of England") that
+//          should become single atoms. Entities are stored as lowercase
+//          words joined by single spaces in a double-array trie: state s
+//          moves on byte c to t = base[s] + c + 1 when check[t] == s, so a
+//          step is two array reads. Lookup walks a token stream and returns
+//          the longest entity starting at a given token.
+// ============================================================================
+class Gazetteer {
+private:
+    static constexpr int32_t FREE = -1;
+    
+    struct Entity {
+        string key;                       // "new york"
+        uint32_t atom;                    // Index into atomEnds
+    };
+    vector<Entity> entities;              // Until build()
+    
+    // Canonical atoms ("new_york"), back to back
+    string atomText;
+    vector<uint32_t> atomEnds;
+    
+    // The trie
+    vector<int32_t> base{0};
+    vector<int32_t> check{0};             // Root is its own parent
+    vector<int32_t> value{-1};            // Atom of an entity ending here
+    
+    string_view atomAt(size_t index) const {
+        size_t begin = index ? atomEnds[index - 1] : 0;
+        return string_view(atomText.data() + begin, atomEnds[index] - begin);
+    }
+    
+    // Helper function to take one step; returns false when there is no edge
+    bool step(int32_t& state, unsigned char c) const {
+        size_t next = static_cast<size_t>(base[state]) + c + 1;
+        if (next >= check.size() || check[next] != state) return false;
+        state = static_cast<int32_t>(next);
+        return true;
+    }
+    
+    // Helper function to walk the bytes of one word
+    bool walk(int32_t& state, string_view word) const {
+        for (char c : word) {
+            if (!step(state, static_cast<unsigned char>(c))) return false;
+        }
+        return true;
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: add
+    // Purpose: Registers an entity; call build() once all are added
+    // Parameters:
+    //   - entity: The words as written ("New York")
+    //   - atom: Its atom; by default the lowercase words joined by '_'
+    // ------------------------------------------------------------------------
+    void add(string_view entity, string_view atom = string_view()) {
+        string key;
+        for (size_t i = skipSpace(entity.data(), entity.size());
+             i < entity.size();) {
+            size_t end = i + findSpace(entity.data() + i, entity.size() - i);
+            if (!key.empty()) key += ' ';
+            key += toLowerAscii(entity.substr(i, end - i));
+            i = end + skipSpace(entity.data() + end, entity.size() - end);
+        }
+        if (key.empty()) return;
+        
+        string canonical(trimAscii(atom));
+        if (canonical.empty()) {
+            canonical = key;
+            replace(canonical.begin(), canonical.end(), ' ', '_');
+        }
+        atomText += canonical;
+        atomEnds.push_back(static_cast<uint32_t>(atomText.size()));
+        entities.push_back({move(key), static_cast<uint32_t>(atomEnds.size() - 1)});
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: build
+    // Purpose: Compiles the added entities into the double array. Each
+    //          state's children are placed at the first base where all of
+    //          their slots are free. The first of duplicate entities wins.
+    // ------------------------------------------------------------------------
+    void build() {
+        // Plain trie first; children are kept sorted by byte
+        struct Node {
+            vector<pair<unsigned char, uint32_t>> children;
+            int32_t value = -1;
+        };
+        vector<Node> nodes(1);
+        for (const Entity& entity : entities) {
+            uint32_t node = 0;
+            for (char ch : entity.key) {
+                unsigned char c = static_cast<unsigned char>(ch);
+                auto& children = nodes[node].children;
+                auto it = lower_bound(children.begin(), children.end(),
+                                      make_pair(c, 0u));
+                if (it == children.end() || it->first != c) {
+                    uint32_t created = static_cast<uint32_t>(nodes.size());
+                    it = children.insert(it, make_pair(c, created));
+                    nodes.emplace_back();
+                }
+                node = it->second;
+            }
+            if (nodes[node].value < 0) {
+                nodes[node].value = static_cast<int32_t>(entity.atom);
+            }
+        }
+        
+        base.assign(1, 0);
+        check.assign(1, 0);
+        value.assign(1, nodes[0].value);
+        
+        // nextFree[i] leads to the first free slot at or after i (path
+        // compressed), so the search for a base skips taken runs at once
+        vector<uint32_t> nextFree{1};
+        auto findFree = [&](size_t slot) {
+            size_t root = slot;
+            while (root < nextFree.size() && nextFree[root] != root) {
+                root = nextFree[root];
+            }
+            while (slot < nextFree.size() && slot != root) {
+                size_t next = nextFree[slot];
+                nextFree[slot] = static_cast<uint32_t>(root);
+                slot = next;
+            }
+            return root;
+        };
+        
+        // Place the nodes breadth-first, each state's children at the first
+        // base where the lowest child lands on a free slot and the rest fit.
+        // A node that fits none of the first few holes goes past the end,
+        // which keeps building linear at the cost of some unused slots.
+        static constexpr int MAX_ATTEMPTS = 32;
+        vector<pair<uint32_t, int32_t>> queue{{0, 0}};
+        for (size_t q = 0; q < queue.size(); q++) {
+            const Node& node = nodes[queue[q].first];
+            int32_t state = queue[q].second;
+            if (node.children.empty()) continue;
+            
+            size_t lowest = node.children.front().first + 1;
+            size_t candidate = 0;
+            for (int attempt = 0;; attempt++) {
+                if (attempt == MAX_ATTEMPTS) {
+                    candidate = check.size();
+                    break;
+                }
+                candidate = findFree(candidate + lowest) - lowest;
+                bool fits = true;
+                for (const auto& child : node.children) {
+                    size_t slot = candidate + child.first + 1;
+                    if (slot < check.size() && check[slot] != FREE) {
+                        fits = false;
+                        break;
+                    }
+                }
+                if (fits) break;
+                candidate++;
+            }
+            
+            base[state] = static_cast<int32_t>(candidate);
+            size_t needed = candidate + node.children.back().first + 2;
+            if (needed > check.size()) {
+                for (size_t i = check.size(); i < needed; i++) {
+                    nextFree.push_back(static_cast<uint32_t>(i));
+                }
+                base.resize(needed, 0);
+                check.resize(needed, FREE);
+                value.resize(needed, -1);
+            }
+            for (const auto& child : node.children) {
+                size_t slot = candidate + child.first + 1;
+                nextFree[slot] = static_cast<uint32_t>(slot + 1);
+                check[slot] = state;
+                value[slot] = nodes[child.second].value;
+                queue.push_back({child.second, static_cast<int32_t>(slot)});
+            }
+        }
+        
+        entities.clear();
+        entities.shrink_to_fit();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: loadFile
+    // Purpose: Adds the entities of a file, one per line, optionally with
+    //          their atom: "New York" or "New York City => nyc". Blank
+    //          lines and lines starting with '#' are ignored. Builds the
+    //          trie. Throws runtime_error if the file cannot be read.
+    // ------------------------------------------------------------------------
+    void loadFile(const string& path) {
+        ifstream file(path);
+        if (!file) {
+            throw runtime_error("Cannot open gazetteer file: " + path);
+        }
+        string line;
+        while (getline(file, line)) {
+            string_view text = trimAscii(line);
+            if (text.empty() || text[0] == '#') continue;
+            
+            size_t arrow = text.find("=>");
+            if (arrow == string_view::npos) {
+                add(text);
+            } else {
+                add(text.substr(0, arrow), text.substr(arrow + 2));
+            }
+        }
+        build();
+    }
+    
+    bool empty() const { return atomEnds.empty(); }
+    size_t size() const { return atomEnds.size(); }
+    size_t stateCount() const { return check.size(); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: longestMatch
+    // Purpose: Finds the longest entity starting at tokens[start]. Words
+    //          are compared in their punctuation-stripped form; a word with
+    //          trailing punctuation ("York,") can only end an entity.
+    // Returns: Number of tokens matched (0 if none) and the entity's atom
+    // ------------------------------------------------------------------------
+    size_t longestMatch(const vector<Token>& tokens, size_t start,
+                        string_view& atom) const {
+        int32_t state = 0;
+        size_t matched = 0;
+        for (size_t i = start; i < tokens.size(); i++) {
+            if (i > start && !step(state, ' ')) break;
+            if (!walk(state, tokens[i].bare)) break;
+            if (value[state] >= 0) {
+                matched = i + 1 - start;
+                atom = atomAt(static_cast<size_t>(value[state]));
+            }
+            if (tokens[i].bare.size() != tokens[i].lower.size()) break;
+        }
+        return matched;
+    }
+};
+
+// ============================================================================
+// CLASS: SentenceTokenizer
+// Purpose: Splits a sentence on whitespace in a single pass, producing
+//          Tokens with their lowercase form, punctuation-stripped form and
+//          keyword id. Buffers are reused, so after warm-up tokenizing
+//          allocates nothing. With a gazetteer, the words of a known entity
+//          are merged into one token whose bare form is the entity's atom.
+// ============================================================================
+class SentenceTokenizer {
+private:
+    const KeywordTable& keywords;
+    const Gazetteer* gazetteer = nullptr;
+    string lowerBuffer;
+    vector<Token> tokens;
+    
+    // Helper function to merge gazetteer entities into single tokens
+    void mergeEntities() {
+        size_t out = 0;
+        for (size_t i = 0; i < tokens.size();) {
+            string_view atom;
+            size_t length = gazetteer->longestMatch(tokens, i, atom);
+            if (length == 0) {
+                tokens[out++] = tokens[i++];
+                continue;
+            }
+            
+            const Token& first = tokens[i];
+            const Token& last = tokens[i + length - 1];
+            auto span = [](string_view from, string_view to) {
+                return string_view(from.data(),
+                                   to.data() + to.size() - from.data());
+            };
+            Token merged{span(first.text, last.text), span(first.lower, last.lower),
+                         atom, length == 1 ? first.keyword : KeywordTable::NONE};
+            tokens[out++] = merged;
+            i += length;
+        }
+        tokens.resize(out);
+    }
+
+public:
+    explicit SentenceTokenizer(const KeywordTable& table) : keywords(table) {}
+    
+    // Entities to merge (nullptr for none); must outlive the tokenizer
+    void setGazetteer(const Gazetteer* entities) { gazetteer = entities; }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: tokenize
+    // Purpose: Tokenizes one sentence
+    // Returns: The tokens, valid until the next call
+    // ------------------------------------------------------------------------
+    const vector<Token>& tokenize(string_view sentence) {
+        tokens.clear();
+        
+        // Lowercase the whole sentence at once; whitespace is copied as is
+        lowerBuffer.resize(sentence.size());
+        asciiLower(sentence.data(), &lowerBuffer[0], sentence.size());
+        
+        const char* data = sentence.data();
+        size_t size = sentence.size();
+        size_t i = skipSpace(data, size);
+        while (i < size) {
+            size_t end = i + findSpace(data + i, size - i);
+            
+            string_view lower(lowerBuffer.data() + i, end - i);
+            tokens.push_back({sentence.substr(i, end - i), lower,
+                              stripTrailingPunct(lower), keywords.lookup(lower)});
+            
+            i = end + skipSpace(data + end, size - end);
+        }
+        
+        if (gazetteer && !gazetteer->empty()) mergeEntities();
+        return tokens;
+    }
+    
+    // Whole sentence in lowercase (valid until the next call)
+    string_view lowercase() const { return lowerBuffer; }
+};
+
+// ============================================================================
+// CLASS: SentenceSegmenter
+// Purpose: Splits running text into sentences in one pass. A sentence ends
+//          at . ! or ? (plus any closing quotes or brackets) followed by
+//          whitespace, unless the period belongs to an abbreviation or an
+//          initial ("Dr. Smith", "J. Smith") or the next word starts in
+//          lowercase. Decimals such as 3.14 never split because no
+//          whitespace follows the period. A blank line always ends a
+//          sentence, and so does every line break in line mode.
+//          Every decision only looks at the text around the terminator,
+//          so buffers can be cut and resumed at any sentence boundary.
+// ============================================================================
+class SentenceSegmenter {
+private:
+    KeywordTable abbreviations;           // Lowercase, without the final period
+    bool lineBreaks = false;
+    
+    static constexpr size_t NOT_A_BOUNDARY = 0;
+    static constexpr size_t NEED_MORE = SIZE_MAX;
+    static constexpr size_t MAX_ABBREVIATION = 15;
+    
+    static bool isTerminator(char c) {
+        return c == '.' || c == '!' || c == '?';
+    }
+    static bool isCloser(char c) {
+        return c == '"' || c == '\'' || c == ')' || c == ']';
+    }
+    static bool isOpener(char c) {
+        return c == '"' || c == '\'' || c == '(' || c == '[';
+    }
+    
+    // Helper function to check the word ending just before a period
+    bool abbreviationBefore(const char* data, size_t period) const {
+        size_t begin = period;
+        while (begin > 0 && !isAsciiSpace(data[begin - 1])) begin--;
+        while (begin < period && isOpener(data[begin])) begin++;
+        
+        size_t length = period - begin;
+        if (length == 0 || length > MAX_ABBREVIATION) return false;
+        
+        // A single letter is an initial
+        if (length == 1 && isAsciiAlpha(data[begin])) {
+            return true;
+        }
+        
+        char lower[MAX_ABBREVIATION];
+        asciiLower(data + begin, lower, length);
+        return abbreviations.lookup(string_view(lower, length)) !=
+               KeywordTable::NONE;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: boundaryAt
+    // Purpose: Decides whether the character at data[i] ends a sentence
+    // Returns: Where the sentence ends (past closing quotes), NOT_A_BOUNDARY,
+    //          or NEED_MORE if the buffer ends before it can tell
+    // ------------------------------------------------------------------------
+    size_t boundaryAt(const char* data, size_t size, size_t i, bool atEnd) const {
+        char c = data[i];
+        
+        if (c == '\n') {
+            if (lineBreaks) return i + 1;
+            
+            // Paragraph break: only spaces up to the next line break
+            for (size_t j = i + 1; j < size; j++) {
+                if (data[j] == '\n') return i + 1;
+                if (!isAsciiSpace(data[j])) return NOT_A_BOUNDARY;
+            }
+            return atEnd ? size : NEED_MORE;
+        }
+        if (!isTerminator(c)) return NOT_A_BOUNDARY;
+        
+        // "?!" and "..." end where the last mark is
+        size_t end = i + 1;
+        if (end < size && isTerminator(data[end])) return NOT_A_BOUNDARY;
+        while (end < size && isCloser(data[end])) end++;
+        if (end == size) return atEnd ? size : NEED_MORE;
+        if (!isAsciiSpace(data[end])) return NOT_A_BOUNDARY;
+        
+        if (c == '.' && abbreviationBefore(data, i)) return NOT_A_BOUNDARY;
+        
+        // A lowercase word after the mark continues the sentence
+        size_t next = end;
+        while (next < size && isAsciiSpace(data[next])) {
+            if (data[next] == '\n' && lineBreaks) return end;
+            next++;
+        }
+        if (next == size) return atEnd ? end : NEED_MORE;
+        if (isAsciiLower(data[next])) {
+            return NOT_A_BOUNDARY;
+        }
+        return end;
+    }
+
+public:
+    SentenceSegmenter() {
+        for (const char* word : {"mr", "mrs", "ms", "dr", "prof", "st", "jr",
+                                 "sr", "mt", "vs", "no", "fig", "approx",
+                                 "dept", "gen", "col", "lt", "sgt", "capt",
+                                 "rev", "hon", "e.g", "i.e", "cf", "al"}) {
+            abbreviations.add(word);
+        }
+    }
+    
+    // Adds a word (without its period) that does not end a sentence
+    void addAbbreviation(string_view word) {
+        string lower = toLowerAscii(word);
+        if (!lower.empty() && lower.size() <= MAX_ABBREVIATION) {
+            abbreviations.add(lower);
+        }
+    }
+    
+    // Line mode: every line break ends a sentence (one sentence per line)
+    void setLineBreaks(bool enabled) { lineBreaks = enabled; }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: segment
+    // Purpose: Calls visit(sentence) for every complete, non-blank sentence
+    //          at the front of the buffer, trimmed of surrounding whitespace.
+    //          Unless atEnd, a sentence whose end cannot be decided yet is
+    //          left for the next call.
+    // Returns: Number of bytes consumed
+    // ------------------------------------------------------------------------
+    template <typename Visitor>
+    size_t segment(const char* data, size_t size, bool atEnd,
+                   Visitor&& visit) const {
+        auto emit = [&](size_t begin, size_t end) {
+            while (begin < end && isAsciiSpace(data[begin])) begin++;
+            while (end > begin && isAsciiSpace(data[end - 1])) end--;
+            if (begin < end) visit(string_view(data + begin, end - begin));
+        };
+        
+        size_t start = 0;
+        for (size_t i = 0; i < size; i++) {
+            // Jump to the next character that may end a sentence
+            i += findByte<false>(data + i, size - i, '.', '!', '?', '\n');
+            if (i == size) break;
+            
+            size_t end = boundaryAt(data, size, i, atEnd);
+            if (end == NEED_MORE) return start;
+            if (end != NOT_A_BOUNDARY) {
+                emit(start, end);
+                start = end;
+                i = end - 1;
+            }
+        }
+        if (atEnd && start < size) {
+            emit(start, size);
+            start = size;
+        }
+        return start;
+    }
+    
+    template <typename Visitor>
+    void segment(string_view text, Visitor&& visit) const {
+        segment(text.data(), text.size(), true, visit);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: lastBoundary
+    // Purpose: Finds where the last sentence that is certainly complete ends,
+    //          scanning backwards; segment() agrees with the cut
+    // Returns: The offset, or 0 if there is none
+    // ------------------------------------------------------------------------
+    size_t lastBoundary(const char* data, size_t size) const {
+        for (size_t i = size; i-- > 0;) {
+            char c = data[i];
+            if (c != '.' && c != '!' && c != '?' && c != '\n') continue;
+            
+            size_t end = boundaryAt(data, size, i, false);
+            if (end != NEED_MORE && end != NOT_A_BOUNDARY) return end;
+        }
+        return 0;
+    }
+};
+
+// ============================================================================
+// STRUCT: SentencePattern
+// Purpose: One sentence shape and the fact it produces, e.g.
+//          "$X is the $R of $Y" => "$R($X, $Y)". Each element matches exactly
+//          one token: a keyword, or any word for a $SLOT. "^" in front
+//          anchors the pattern at the first word, "$" at the end anchors it
+//          at the last word; otherwise it may match anywhere.
+// ============================================================================
+struct TemplateTerm {
+    int slot;               // Index of the slot to copy, or -1 for literal
+    string literal;
+};
+
+struct SentencePattern {
+    static constexpr int32_t SLOT = -1;
+    
+    string source;                     // Pattern text, for messages
+    vector<int32_t> elements;          // Keyword id, or SLOT
+    vector<size_t> slotPositions;      // Element position of each slot
+    bool anchorStart = false;
+    bool anchorEnd = false;
+    TemplateTerm predicate;
+    vector<TemplateTerm> arguments;
+};
+
+// ============================================================================
+// CLASS: PatternMatcher
+// Purpose: Compiles every SentencePattern into one DFA over token keyword
+//          ids, so a sentence is classified and its slots located in a
+//          single left-to-right pass whatever the number of patterns. A DFA
+//          state is the set of (pattern, elements matched) positions still
+//          alive; since every element matches one token, the slots of a
+//          match follow from where it ends. The first-listed pattern wins,
+//          and each pattern reports its leftmost match. States are built on
+//          first use, so one matcher must not be shared between threads.
+// ============================================================================
+class PatternMatcher {
+public:
+    struct Match {
+        size_t pattern;                // Index into patterns()
+        size_t start;                  // Token index of the first element
+    };
+    
+private:
+    static constexpr uint32_t MAX_STATES = 1 << 14;
+    static constexpr uint32_t UNEXPLORED = UINT32_MAX;
+    
+    KeywordTable keywords;
+    vector<SentencePattern> patternList;
+    
+    // Automaton, built lazily: a state is a sorted set of NFA positions
+    // (pattern << 16 | elements matched) and its transitions are computed
+    // the first time a sentence takes them. The cache is flushed if it
+    // ever grows past MAX_STATES.
+    size_t alphabet = 0;
+    uint32_t startState = 0;
+    vector<uint32_t> initialSet;           // Every pattern at element 0
+    vector<uint32_t> restartSet;           // Unanchored patterns at element 0
+    map<vector<uint32_t>, uint32_t> stateIds;
+    vector<vector<uint32_t>> states;
+    vector<uint32_t> transitions;          // [state * alphabet + keyword]
+    vector<vector<uint32_t>> accepts;      // Patterns completed in state
+    vector<uint8_t> deadEnd;               // No match can start or continue
+    
+    static uint32_t position(size_t pattern, size_t matched) {
+        return static_cast<uint32_t>((pattern << 16) | matched);
+    }
+    
+    // Helper function to drop every explored state but the start state
+    void resetStates() {
+        stateIds.clear();
+        states.clear();
+        transitions.clear();
+        accepts.clear();
+        deadEnd.clear();
+        
+        vector<uint32_t> initial = initialSet;
+        startState = internState(initial);
+    }
+    
+    // Helper function to find or create the state for a set of positions
+    uint32_t internState(vector<uint32_t>& set) {
+        sort(set.begin(), set.end());
+        set.erase(unique(set.begin(), set.end()), set.end());
+        auto it = stateIds.find(set);
+        if (it != stateIds.end()) return it->second;
+        
+        vector<uint32_t> accepted;
+        bool alive = false;
+        for (uint32_t pos : set) {
+            if ((pos & 0xffff) == patternList[pos >> 16].elements.size()) {
+                accepted.push_back(pos >> 16);
+            } else {
+                alive = true;
+            }
+        }
+        
+        uint32_t id = static_cast<uint32_t>(states.size());
+        stateIds.emplace(set, id);
+        states.push_back(set);
+        accepts.push_back(move(accepted));
+        deadEnd.push_back(!alive && restartSet.empty());
+        transitions.resize(states.size() * alphabet, UNEXPLORED);
+        return id;
+    }
+    
+    // Helper function to compute (and cache) one transition
+    uint32_t explore(uint32_t& state, size_t symbol) {
+        vector<uint32_t> next = restartSet;
+        for (uint32_t pos : states[state]) {
+            const SentencePattern& pattern = patternList[pos >> 16];
+            size_t matched = pos & 0xffff;
+            if (matched == pattern.elements.size()) continue;
+            
+            int32_t element = pattern.elements[matched];
+            if (element == SentencePattern::SLOT ||
+                element == static_cast<int32_t>(symbol)) {
+                next.push_back(pos + 1);
+            }
+        }
+        
+        // Flush the cache when full, keeping the state we are in
+        if (states.size() + 1 >= MAX_STATES) {
+            vector<uint32_t> current = states[state];
+            resetStates();
+            state = internState(current);
+        }
+        
+        uint32_t target = internState(next);
+        transitions[state * alphabet + symbol] = target;
+        return target;
+    }
+    
+    // Helpers for the binary cache: little-endian PODs and strings
+    static constexpr uint32_t CACHE_MAGIC = 0x43474c50;   // "PLGC"
+    static constexpr uint32_t CACHE_FORMAT = 1;
+    
+    // Helper function to parse "$X" / "word" / "name(args)" template terms
+    TemplateTerm parseTerm(string_view text, const vector<string>& slotNames,
+                           const string& source) {
+        text = trimAscii(text);
+        if (text.empty()) {
+            throw runtime_error("Empty term in pattern: " + source);
+        }
+        
+        if (text[0] == '$') {
+            auto slot = find(slotNames.begin(), slotNames.end(), text.substr(1));
+            if (slot == slotNames.end()) {
+                throw runtime_error("Unknown slot " + string(text) +
+                                    " in pattern: " + source);
+            }
+            return {static_cast<int>(slot - slotNames.begin()), ""};
+        }
+        return {-1, string(text)};
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // METHOD: addPattern
+    // Purpose: Adds a sentence shape (lower priority than those added
+    //          before it). Throws runtime_error on malformed input.
+    // Parameters:
+    //   - pattern: e.g. "^ $X is $P $"
+    //   - fact: e.g. "$P($X)"
+    // ------------------------------------------------------------------------
+    void addPattern(string_view pattern, string_view fact) {
+        SentencePattern compiled;
+        compiled.source = string(pattern) + " => " + string(fact);
+        vector<string> slotNames;
+        
+        // Pattern side: whitespace separated elements
+        stringstream ss{string(pattern)};
+        vector<string> parts;
+        string part;
+        while (ss >> part) parts.push_back(part);
+        
+        if (!parts.empty() && parts.front() == "^") {
+            compiled.anchorStart = true;
+            parts.erase(parts.begin());
+        }
+        if (!parts.empty() && parts.back() == "$") {
+            compiled.anchorEnd = true;
+            parts.pop_back();
+        }
+        if (parts.empty()) {
+            throw runtime_error("Pattern has no elements: " + compiled.source);
+        }
+        
+        for (const string& element : parts) {
+            if (element[0] == '$' && element.size() > 1) {
+                slotNames.push_back(element.substr(1));
+                compiled.slotPositions.push_back(compiled.elements.size());
+                compiled.elements.push_back(SentencePattern::SLOT);
+            } else {
+                compiled.elements.push_back(keywords.add(toLowerAscii(element)));
+            }
+        }
+        
+        // Fact side: NAME(ARG, ARG, ...) or just NAME
+        size_t open = fact.find('(');
+        size_t close = fact.rfind(')');
+        if (open == string_view::npos) {
+            compiled.predicate = parseTerm(fact, slotNames, compiled.source);
+        } else {
+            if (close == string_view::npos || close < open) {
+                throw runtime_error("Unbalanced parentheses: " + compiled.source);
+            }
+            compiled.predicate = parseTerm(fact.substr(0, open), slotNames,
+                                           compiled.source);
+            
+            string_view args = fact.substr(open + 1, close - open - 1);
+            while (!args.empty()) {
+                size_t comma = args.find(',');
+                compiled.arguments.push_back(
+                    parseTerm(args.substr(0, comma), slotNames, compiled.source));
+                if (comma == string_view::npos) break;
+                args.remove_prefix(comma + 1);
+            }
+        }
+        
+        patternList.push_back(move(compiled));
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: compile
+    // Purpose: Prepares the automaton. Must be called after the last
+    //          addPattern and before match.
+    // ------------------------------------------------------------------------
+    void compile() {
+        alphabet = keywords.size();
+        
+        initialSet.clear();
+        restartSet.clear();
+        for (size_t p = 0; p < patternList.size(); p++) {
+            initialSet.push_back(position(p, 0));
+            if (!patternList[p].anchorStart) restartSet.push_back(position(p, 0));
+        }
+        resetStates();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: match
+    // Purpose: Runs the automaton over a tokenized sentence
+    // Returns: True and the winning match, or false if no pattern applies
+    // ------------------------------------------------------------------------
+    bool match(const vector<Token>& tokens, Match& result) {
+        size_t best = SIZE_MAX;
+        size_t bestEnd = 0;
+        
+        uint32_t state = startState;
+        for (size_t i = 0; i < tokens.size() && best != 0; i++) {
+            size_t symbol = tokens[i].keyword < alphabet ? tokens[i].keyword : 0;
+            uint32_t next = transitions[state * alphabet + symbol];
+            if (next == UNEXPLORED) next = explore(state, symbol);
+            state = next;
+            
+            for (uint32_t p : accepts[state]) {
+                if (p >= best) continue;
+                if (patternList[p].anchorEnd && i + 1 != tokens.size()) continue;
+                best = p;
+                bestEnd = i;
+            }
+            if (deadEnd[state]) break;
+        }
+        
+        if (best == SIZE_MAX) return false;
+        result.pattern = best;
+        result.start = bestEnd + 1 - patternList[best].elements.size();
+        return true;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: clear
+    // Purpose: Forgets every pattern and keyword
+    // ------------------------------------------------------------------------
+    void clear() {
+        keywords = KeywordTable();
+        patternList.clear();
+        alphabet = 0;
+        initialSet.clear();
+        restartSet.clear();
+        resetStates();
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: addGrammar
+    // Purpose: Adds every pattern of a grammar text, one per line:
+    //              PATTERN => FACT
+    //          Blank lines and lines starting with '#' are ignored.
+    //          Throws runtime_error naming sourceName:line on bad input.
+    // ------------------------------------------------------------------------
+    void addGrammar(string_view text, const string& sourceName) {
+        size_t lineNumber = 0;
+        while (!text.empty()) {
+            size_t end = text.find('\n');
+            string_view line = text.substr(0, end);
+            text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+            lineNumber++;
+            
+            size_t first = skipSpace(line.data(), line.size());
+            if (first == line.size() || line[first] == '#') continue;
+            
+            size_t arrow = line.find("=>");
+            if (arrow == string_view::npos) {
+                throw runtime_error(sourceName + ":" + to_string(lineNumber) +
+                                    ": expected PATTERN => FACT");
+            }
+            try {
+                addPattern(line.substr(0, arrow), line.substr(arrow + 2));
+            } catch (const runtime_error& e) {
+                throw runtime_error(sourceName + ":" + to_string(lineNumber) +
+                                    ": " + e.what());
+            }
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: precompute
+    // Purpose: Explores the automaton breadth-first from the start state
+    //          until it has maxStates states, so common sentences never
+    //          build states while parsing (and the cache can carry them)
+    // ------------------------------------------------------------------------
+    void precompute(size_t maxStates) {
+        maxStates = min<size_t>(maxStates, MAX_STATES / 2);
+        for (uint32_t state = 0; state < states.size(); state++) {
+            for (size_t symbol = 0; symbol < alphabet; symbol++) {
+                if (states.size() >= maxStates) return;
+                if (transitions[state * alphabet + symbol] == UNEXPLORED) {
+                    uint32_t from = state;
+                    explore(from, symbol);
+                }
+            }
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: saveCache
+    // Purpose: Writes patterns, keywords and explored automaton states to a
+    //          binary file tagged with the hash of the grammar source
+    // Returns: False if the file could not be written
+    // ------------------------------------------------------------------------
+    bool saveCache(const string& path, uint64_t sourceHash) const {
+        BinaryWriter out;
+        out.pod(CACHE_MAGIC);
+        out.pod(CACHE_FORMAT);
+        out.pod(sourceHash);
+        
+        out.pod(static_cast<uint32_t>(keywords.size()));
+        for (uint16_t id = 1; id < keywords.size(); id++) out.str(keywords.word(id));
+        
+        auto writeTerm = [&](const TemplateTerm& term) {
+            out.pod(static_cast<int32_t>(term.slot));
+            out.str(term.literal);
+        };
+        out.pod(static_cast<uint32_t>(patternList.size()));
+        for (const SentencePattern& pattern : patternList) {
+            out.str(pattern.source);
+            out.pod(static_cast<uint32_t>(pattern.elements.size()));
+            for (int32_t element : pattern.elements) out.pod(element);
+            out.pod(static_cast<uint32_t>(pattern.slotPositions.size()));
+            for (size_t pos : pattern.slotPositions) out.pod(static_cast<uint32_t>(pos));
+            out.pod(static_cast<uint8_t>(pattern.anchorStart));
+            out.pod(static_cast<uint8_t>(pattern.anchorEnd));
+            writeTerm(pattern.predicate);
+            out.pod(static_cast<uint32_t>(pattern.arguments.size()));
+            for (const TemplateTerm& term : pattern.arguments) writeTerm(term);
+        }
+        
+        out.pod(static_cast<uint32_t>(states.size()));
+        for (const auto& set : states) {
+            out.pod(static_cast<uint32_t>(set.size()));
+            for (uint32_t pos : set) out.pod(pos);
+        }
+        for (uint32_t target : transitions) out.pod(target);
+        out.pod(hashBytes(out.bytes.data(), out.bytes.size()));
+        
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(out.bytes.data(), out.bytes.size());
+        return static_cast<bool>(file);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: loadCache
+    // Purpose: Replaces the current patterns with a cache written by
+    //          saveCache for the same grammar source
+    // Returns: False (leaving the matcher cleared) if the file is missing,
+    //          corrupt, or was built from a different source
+    // ------------------------------------------------------------------------
+    bool loadCache(const string& path, uint64_t sourceHash) {
+        ifstream file(path, ios::binary);
+        if (!file) return false;
+        string bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        
+        clear();
+        if (bytes.size() < sizeof(uint64_t)) return false;
+        size_t body = bytes.size() - sizeof(uint64_t);
+        uint64_t checksum;
+        memcpy(&checksum, bytes.data() + body, sizeof(checksum));
+        if (checksum != hashBytes(bytes.data(), body)) return false;
+        
+        BinaryReader in{string_view(bytes.data(), body)};
+        if (in.pod<uint32_t>() != CACHE_MAGIC || in.pod<uint32_t>() != CACHE_FORMAT ||
+            in.pod<uint64_t>() != sourceHash) {
+            return false;
+        }
+        
+        uint32_t keywordCount = in.pod<uint32_t>();
+        for (uint32_t id = 1; id < keywordCount && in.ok; id++) keywords.add(in.str());
+        
+        auto readTerm = [&]() {
+            TemplateTerm term;
+            term.slot = in.pod<int32_t>();
+            term.literal = in.str();
+            return term;
+        };
+        uint32_t patternCount = in.pod<uint32_t>();
+        for (uint32_t p = 0; p < patternCount && in.ok; p++) {
+            SentencePattern pattern;
+            pattern.source = in.str();
+            pattern.elements.resize(in.pod<uint32_t>());
+            for (int32_t& element : pattern.elements) element = in.pod<int32_t>();
+            pattern.slotPositions.resize(in.pod<uint32_t>());
+            for (size_t& pos : pattern.slotPositions) pos = in.pod<uint32_t>();
+            pattern.anchorStart = in.pod<uint8_t>() != 0;
+            pattern.anchorEnd = in.pod<uint8_t>() != 0;
+            pattern.predicate = readTerm();
+            pattern.arguments.resize(in.pod<uint32_t>());
+            for (TemplateTerm& term : pattern.arguments) term = readTerm();
+            patternList.push_back(move(pattern));
+        }
+        if (!in.ok || keywords.size() != keywordCount) {
+            clear();
+            return false;
+        }
+        compile();
+        
+        // Re-create the explored states in id order, then their transitions
+        uint32_t stateCount = in.pod<uint32_t>();
+        for (uint32_t id = 0; id < stateCount && in.ok; id++) {
+            vector<uint32_t> set(in.pod<uint32_t>());
+            for (uint32_t& pos : set) {
+                pos = in.pod<uint32_t>();
+                if ((pos >> 16) >= patternList.size() ||
+                    (pos & 0xffff) > patternList[pos >> 16].elements.size()) {
+                    in.ok = false;
+                    break;
+                }
+            }
+            if (!in.ok) break;
+            if (id == 0) continue;               // Start state, rebuilt above
+            if (internState(set) != id) in.ok = false;
+        }
+        for (uint32_t& target : transitions) {
+            target = in.pod<uint32_t>();
+            if (target != UNEXPLORED && target >= states.size()) in.ok = false;
+        }
+        if (!in.ok || !in.bytes.empty()) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+    
+    const vector<SentencePattern>& patterns() const { return patternList; }
+    const KeywordTable& keywordTable() const { return keywords; }
+    size_t stateCount() const { return states.size(); }
+};
+
+// ============================================================================
+// CLASS: TextParser
+// Purpose: Converts natural language sentences into PROLOG predicates
+// ============================================================================
+class TextParser {
+private:
+    PrologDatabase& db;
+    
+    // Sentence shapes, most specific first, compiled into one automaton
+    PatternMatcher patterns;
+    SentenceTokenizer tokenizer;
+    SentenceSegmenter segmenter;
+    
+    // Multi-word entities, shared read-only by copies of the parser
+    shared_ptr<const Gazetteer> gazetteer;
+    
+    bool verbose = true;                  // Echo sentences and failures
+    
+    // Metrics slot and trace event name of each pattern, made on first use
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    vector<uint32_t> patternSlots;
+    vector<const char*> patternTraceNames;
+    
+    // Helper function for the sentence side of a pattern's source, e.g.
+    // "$X lives in $Y", as metrics and trace events label the pattern
+    string patternLabel(size_t pattern) const {
+        const string& source = patterns.patterns()[pattern].source;
+        return string(trimAscii(string_view(source).substr(0, source.find(" => "))));
+    }
+    
+    // Helper function for the trace event of a pattern's branch, e.g.
+    // "pattern: $X lives in $Y"; null while not tracing
+    const char* traceName(size_t pattern) {
+        if (!Tracer::enabled()) return nullptr;
+        if (pattern >= patternTraceNames.size()) {
+            patternTraceNames.resize(patterns.patterns().size(), nullptr);
+        }
+        const char*& name = patternTraceNames[pattern];
+        if (!name) {
+            name = Tracer::instance().intern("pattern: " + patternLabel(pattern));
+        }
+        return name;
+    }
+    
+    // Helper function to count a sentence one of the patterns parsed
+    void countParsed(size_t pattern) {
+        Metrics& metrics = Metrics::instance();
+        if (!metrics.enabled()) return;
+        if (pattern >= patternSlots.size()) {
+            patternSlots.resize(patterns.patterns().size(), NO_SLOT);
+        }
+        uint32_t& slot = patternSlots[pattern];
+        if (slot == NO_SLOT) {
+            slot = metrics.counter("sentences_parsed",
+                                   {{"pattern", patternLabel(pattern)}});
+        }
+        metrics.add(slot);
+    }
+    
+    // Helper function to count a sentence no pattern matched
+    static void countUnparsed() {
+        Metrics& metrics = Metrics::instance();
+        if (metrics.enabled()) metrics.add(metrics.unparsedSentences);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: emitFact
+    // Purpose: Builds the fact of a matched pattern from the slot tokens and
+    //          hands it to sink(predicate, arguments, count)
+    // Example: "John is the parent of Mary" -> parent(john, mary)
+    // ------------------------------------------------------------------------
+    template <typename Sink>
+    void emitFact(const SentencePattern& pattern, const vector<Token>& words,
+                  size_t start, Sink&& sink) {
+        auto resolve = [&](const TemplateTerm& term) -> string_view {
+            if (term.slot < 0) return term.literal;
+            return words[start + pattern.slotPositions[term.slot]].bare;
+        };
+        
+        string_view local[8];
+        vector<string_view> spill;
+        string_view* arguments = local;
+        if (pattern.arguments.size() > 8) {
+            spill.resize(pattern.arguments.size());
+            arguments = spill.data();
+        }
+        for (size_t i = 0; i < pattern.arguments.size(); i++) {
+            arguments[i] = resolve(pattern.arguments[i]);
+        }
+        
+        sink(resolve(pattern.predicate),
+             static_cast<const string_view*>(arguments), pattern.arguments.size());
+    }
+
+public:
+    // Sentence shapes understood out of the box, most specific first.
+    // Grammar files use the same format.
+    static constexpr const char* DEFAULT_GRAMMAR =
+        "# Locations: \"John lives in Paris\" -> lives_in(john, paris)\n"
+        "$X lives in $Y => lives_in($X, $Y)\n"
+        "# Relationships: \"John is the parent of Mary\" -> parent(john, mary)\n"
+        "$X is the $R of $Y => $R($X, $Y)\n"
+        "# Properties: \"John is tall\" -> tall(john)\n"
+        "^ $X is $P $ => $P($X)\n"
+        "# Anything else: \"John likes Mary\" -> likes(john, mary)\n"
+        "^ $X $R $Y => $R($X, $Y)\n";
+    
+    // Constructor: Initialize with a reference to the database
+    TextParser(PrologDatabase& database)
+        : db(database), tokenizer(patterns.keywordTable()) {
+        patterns.addGrammar(DEFAULT_GRAMMAR, "<default grammar>");
+        patterns.compile();
+    }
+    
+    // Constructor: Initialize with the patterns of a grammar file
+    TextParser(PrologDatabase& database, const string& grammarPath)
+        : db(database), tokenizer(patterns.keywordTable()) {
+        loadGrammar(grammarPath);
+    }
+    
+    // Copies share the database and the patterns, so each thread of a
+    // pipeline can parse with its own copy
+    TextParser(const TextParser& other)
+        : db(other.db), patterns(other.patterns),
+          tokenizer(patterns.keywordTable()), segmenter(other.segmenter),
+          gazetteer(other.gazetteer), verbose(other.verbose),
+          patternSlots(other.patternSlots),
+          patternTraceNames(other.patternTraceNames) {
+        tokenizer.setGazetteer(gazetteer.get());
+    }
+    TextParser& operator=(const TextParser&) = delete;
+    
+    // ------------------------------------------------------------------------
+    // METHOD: loadGrammar
+    // Purpose: Replaces the sentence patterns with those of a grammar file
+    //          (one "PATTERN => FACT" per line). The compiled matcher is
+    //          cached next to the file as GRAMMAR.cache and reused while
+    //          the grammar text is unchanged. Throws runtime_error if the
+    //          file cannot be read or has a syntax error.
+    // ------------------------------------------------------------------------
+    void loadGrammar(const string& grammarPath) {
+        ifstream file(grammarPath, ios::binary);
+        if (!file) {
+            throw runtime_error("Cannot open grammar file: " + grammarPath);
+        }
+        string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        uint64_t sourceHash = hashBytes(text.data(), text.size());
+        string cachePath = grammarPath + ".cache";
+        
+        patternSlots.clear();
+        patternTraceNames.clear();
+        if (patterns.loadCache(cachePath, sourceHash)) return;
+        
+        patterns.clear();
+        patterns.addGrammar(text, grammarPath);
+        patterns.compile();
+        patterns.precompute(4096);
+        patterns.saveCache(cachePath, sourceHash);   // Best effort
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: parseText
+    // Purpose: Main parsing function - splits the text into sentences and
+    //          parses each of them
+    // Parameters:
+    //   - text: One sentence or a whole paragraph of natural language
+    // Returns: The number of facts added
+    // Example: "John likes pizza. Mary lives in London." -> 2 facts
+    // ------------------------------------------------------------------------
+    size_t parseText(string_view text) {
+        Metrics& metrics = Metrics::instance();
+        uint64_t started = metrics.enabled() ? Metrics::now() : 0;
+        TraceScope scope("parseText", "parser");
+        
+        size_t added = 0;
+        size_t sentences = 0;
+        segmenter.segment(text, [&](string_view sentence) {
+            sentences++;
+            if (parseSentence(sentence)) added++;
+        });
+        
+        // Let the sentence parser report blank input
+        if (sentences == 0) parseSentence(text);
+        
+        if (metrics.enabled()) metrics.record(metrics.parseLatency, Metrics::now() - started);
+        scope.setValue("facts", added);
+        return added;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: parseSentence
+    // Purpose: Determines the type of one sentence and extracts its fact in
+    //          one pass over the tokens
+    // Parameters:
+    //   - text: The natural language sentence to parse
+    // Returns: true if a fact was added
+    // ------------------------------------------------------------------------
+    bool parseSentence(string_view text) {
+        if (verbose) cout << "\nParsing: \"" << text << "\"" << endl;
+        
+        // Split the text into words (one pass; lowercase forms included)
+        const vector<Token>& words = tokenizer.tokenize(text);
+        
+        if (words.empty()) {
+            if (verbose) cout << "Empty sentence, nothing to parse.\n";
+            return false;
+        }
+        
+        // Determine the type of sentence and where its slots are
+        PatternMatcher::Match match;
+        if (!patterns.match(words, match)) {
+            if (verbose) cout << "Could not parse sentence pattern.\n";
+            countUnparsed();
+            return false;
+        }
+        countParsed(match.pattern);
+        
+        TraceScope branch(traceName(match.pattern), "pattern");
+        emitFact(patterns.patterns()[match.pattern], words, match.start,
+                 [&](string_view predicate, const string_view* arguments,
+                     size_t count) {
+            db.addFact(predicate, arguments, count);
+        });
+        return true;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: parseSentence (batch)
+    // Purpose: Same as above, but appends the fact to a batch instead of the
+    //          database and prints nothing. Safe to call from several
+    //          threads as long as each uses its own TextParser copy.
+    // Returns: true if a fact was added to the batch
+    // ------------------------------------------------------------------------
+    bool parseSentence(string_view text, FactBatch& batch) {
+        const vector<Token>& words = tokenizer.tokenize(text);
+        
+        PatternMatcher::Match match;
+        if (words.empty()) return false;
+        if (!patterns.match(words, match)) {
+            countUnparsed();
+            return false;
+        }
+        countParsed(match.pattern);
+        
+        TraceScope branch(traceName(match.pattern), "pattern");
+        emitFact(patterns.patterns()[match.pattern], words, match.start,
+                 [&](string_view predicate, const string_view* arguments,
+                     size_t count) {
+            batch.add(predicate, arguments, count);
+        });
+        return true;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: setGazetteer
+    // Purpose: Makes the words of known entities parse as one atom, e.g.
+    //          "Mary lives in New York" -> lives_in(mary, new_york)
+    // ------------------------------------------------------------------------
+    void setGazetteer(shared_ptr<const Gazetteer> entities) {
+        gazetteer = move(entities);
+        tokenizer.setGazetteer(gazetteer.get());
+    }
+    
+    // Loads a gazetteer file (see Gazetteer::loadFile); throws runtime_error
+    void loadGazetteer(const string& path) {
+        auto entities = make_shared<Gazetteer>();
+        entities->loadFile(path);
+        setGazetteer(move(entities));
+    }
+    
+    PrologDatabase& database() const { return db; }
+    SentenceSegmenter& sentenceSegmenter() { return segmenter; }
+    
+    // Bulk ingestion turns off the per-sentence echo
+    void setVerbose(bool enabled) { verbose = enabled; }
+    bool isVerbose() const { return verbose; }
+};
+
+// ============================================================================
+// CLASS: BoundedQueue
+// Purpose: Fixed-capacity lock-free queue for handing work between threads.
+//          Any number of producers and consumers; push waits while the queue
+//          is full, which is what gives a pipeline its backpressure.
+// ============================================================================
+template <typename T>
+class BoundedQueue {
+private:
+    // Each cell's sequence number says whose turn it is: a producer may
+    // fill it when it equals the producer's ticket, a consumer may empty it
+    // when it equals the ticket + 1
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+    
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};   // Next ticket to push
+    alignas(64) atomic<size_t> head{0};   // Next ticket to pop
+    
+    // Spin briefly, then yield, then sleep while waiting for the other side
+    static void backoff(unsigned& spins) {
+        if (++spins < 64) return;
+        if (spins < 128) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+    
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+    
+    // Returns false instead of waiting when the queue is full
+    bool tryPush(const T& value) {
+        size_t ticket = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[ticket & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t turn = static_cast<intptr_t>(sequence) -
+                            static_cast<intptr_t>(ticket);
+            if (turn == 0) {
+                if (tail.compare_exchange_weak(ticket, ticket + 1,
+                                               memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(ticket + 1, memory_order_release);
+                    return true;
+                }
+            } else if (turn < 0) {
+                return false;
+            } else {
+                ticket = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Returns false instead of waiting when the queue is empty
+    bool tryPop(T& value) {
+        size_t ticket = head.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[ticket & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t turn = static_cast<intptr_t>(sequence) -
+                            static_cast<intptr_t>(ticket + 1);
+            if (turn == 0) {
+                if (head.compare_exchange_weak(ticket, ticket + 1,
+                                               memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(ticket + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (turn < 0) {
+                return false;
+            } else {
+                ticket = head.load(memory_order_relaxed);
+            }
+        }
+    }
+    
+    void push(const T& value) {
+        if (tryPush(value)) return;
+        TraceScope stall("wait: queue full", "stall");
+        unsigned spins = 0;
+        while (!tryPush(value)) backoff(spins);
+    }
+    
+    void pop(T& value) {
+        if (tryPop(value)) return;
+        TraceScope stall("wait: queue empty", "stall");
+        unsigned spins = 0;
+        while (!tryPop(value)) backoff(spins);
+    }
+};
+
+// ============================================================================
+// CLASS: CorpusIngester
+// Purpose: Streams large text files through a TextParser one sentence at a
+//          time. Files are read in fixed-size chunks, so memory use does not
+//          depend on the file size, and throughput is reported periodically.
+//          With several workers the work runs as a pipeline:
+//            reader thread -> N parser threads -> inserting (calling) thread
+//          connected by bounded queues, with chunks recycled through a fixed
+//          pool so that a slow stage stalls the ones before it.
+// ============================================================================
+struct IngestStats {
+    uint64_t bytes = 0;
+    uint64_t sentences = 0;
+    uint64_t facts = 0;                   // Sentences that produced a fact
+    double seconds = 0;
+};
+
+class CorpusIngester {
+private:
+    TextParser& parser;
+    SentenceSegmenter segmenter;
+    size_t bufferSize;
+    size_t workerCount = 1;
+    vector<char> buffer;
+    
+    ostream* progress = nullptr;
+    double reportInterval = 5.0;          // Seconds between progress lines
+    chrono::steady_clock::time_point lastReport;
+    
+    IngestStats totals;
+    
+    // A piece of input cut at a sentence boundary, and what it parsed into
+    struct Chunk {
+        uint64_t sequence = 0;            // Position in the input
+        string text;
+        FactBatch facts;
+        uint64_t sentences = 0;
+        uint64_t parsed = 0;
+    };
+    
+    void report(const IngestStats& run, bool final) {
+        if (!progress) return;
+        double rate = run.seconds > 0 ? 1.0 / run.seconds : 0;
+        ostream& out = *progress;
+        out << (final ? "Ingested " : "Ingesting: ")
+            << run.sentences << " sentences ("
+            << static_cast<uint64_t>(run.sentences * rate) << "/s), "
+            << run.facts << " facts ("
+            << static_cast<uint64_t>(run.facts * rate) << "/s), "
+            << fixed << setprecision(1) << run.bytes / 1048576.0 << " MiB in "
+            << run.seconds << "s" << defaultfloat << setprecision(6) << endl;
+    }
+    
+    // Helper function to count the work done since before
+    IngestStats since(const IngestStats& before,
+                      chrono::steady_clock::time_point started) const {
+        IngestStats run;
+        run.bytes = totals.bytes - before.bytes;
+        run.sentences = totals.sentences - before.sentences;
+        run.facts = totals.facts - before.facts;
+        run.seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - started).count();
+        return run;
+    }
+    
+    // Helper function to print a progress line when one is due
+    void maybeReport(const IngestStats& before,
+                     chrono::steady_clock::time_point started) {
+        if (!progress) return;
+        auto now = chrono::steady_clock::now();
+        if (chrono::duration<double>(now - lastReport).count() < reportInterval) {
+            return;
+        }
+        lastReport = now;
+        report(since(before, started), false);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: ingestSequential
+    // Purpose: Reads, parses and inserts on the calling thread
+    // ------------------------------------------------------------------------
+    void ingestSequential(istream& in, const IngestStats& before,
+                          chrono::steady_clock::time_point started) {
+        buffer.resize(bufferSize);
+        
+        // The echo would dominate the run time
+        bool parserVerbose = parser.isVerbose();
+        parser.setVerbose(false);
+        
+        auto parse = [&](string_view sentence) {
+            totals.sentences++;
+            if (parser.parseSentence(sentence)) totals.facts++;
+        };
+        
+        size_t filled = 0;
+        while (true) {
+            in.read(buffer.data() + filled, buffer.size() - filled);
+            size_t got = static_cast<size_t>(in.gcount());
+            filled += got;
+            totals.bytes += got;
+            bool atEnd = !in;
+            
+            size_t consumed = segmenter.segment(buffer.data(), filled, atEnd,
+                                                parse);
+            if (consumed == 0 && filled == buffer.size()) {
+                // No sentence end in a whole buffer: cut the sentence here
+                segmenter.segment(buffer.data(), filled, true, parse);
+                consumed = filled;
+            }
+            memmove(buffer.data(), buffer.data() + consumed, filled - consumed);
+            filled -= consumed;
+            
+            maybeReport(before, started);
+            if (atEnd) break;
+        }
+        
+        parser.setVerbose(parserVerbose);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: ingestParallel
+    // Purpose: Runs the reader and parser stages on their own threads and
+    //          inserts on the calling thread. Chunks are inserted in input
+    //          order, so the database ends up exactly as a sequential run
+    //          would leave it.
+    // ------------------------------------------------------------------------
+    void ingestParallel(istream& in, const IngestStats& before,
+                        chrono::steady_clock::time_point started) {
+        // Every chunk in flight is in one of the queues or held by one
+        // stage; the pool size bounds memory, the queues never overflow
+        size_t poolSize = 2 * workerCount + 2;
+        vector<unique_ptr<Chunk>> pool;
+        BoundedQueue<Chunk*> freeChunks(poolSize);
+        BoundedQueue<Chunk*> toParse(poolSize + workerCount);
+        BoundedQueue<Chunk*> toInsert(poolSize + workerCount);
+        for (size_t i = 0; i < poolSize; i++) {
+            pool.emplace_back(new Chunk());
+            freeChunks.push(pool.back().get());
+        }
+        
+        // Each parser thread works with its own copy of the patterns
+        vector<unique_ptr<TextParser>> parsers;
+        for (size_t i = 0; i < workerCount; i++) {
+            parsers.emplace_back(new TextParser(parser));
+        }
+        
+        atomic<uint64_t> bytesRead{0};
+        atomic<bool> stopping{false};     // Set when inserting failed
+        thread reader([&] {
+            Tracer::instance().setThreadName("ingest reader");
+            vector<char> input(bufferSize);
+            size_t filled = 0;
+            uint64_t sequence = 0;
+            bool atEnd = false;
+            while (!atEnd && !stopping.load(memory_order_relaxed)) {
+                size_t got;
+                {
+                    TraceScope scope("read chunk", "ingest");
+                    in.read(input.data() + filled, input.size() - filled);
+                    got = static_cast<size_t>(in.gcount());
+                    scope.setValue("bytes", got);
+                }
+                filled += got;
+                bytesRead.fetch_add(got, memory_order_relaxed);
+                atEnd = !in;
+                
+                // Hand over whole sentences only, unless one fills the buffer
+                size_t cut = atEnd ? filled
+                                   : segmenter.lastBoundary(input.data(), filled);
+                if (cut == 0 && filled == input.size()) cut = filled;
+                if (cut == 0) continue;
+                
+                Chunk* chunk;
+                freeChunks.pop(chunk);
+                chunk->sequence = sequence++;
+                chunk->text.assign(input.data(), cut);
+                toParse.push(chunk);
+                
+                memmove(input.data(), input.data() + cut, filled - cut);
+                filled -= cut;
+            }
+            for (size_t i = 0; i < workerCount; i++) toParse.push(nullptr);
+        });
+        
+        vector<thread> workers;
+        for (size_t w = 0; w < workerCount; w++) {
+            workers.emplace_back([&, w] {
+                Tracer::instance().setThreadName("ingest parser");
+                TextParser& local = *parsers[w];
+                Chunk* chunk;
+                while (true) {
+                    toParse.pop(chunk);
+                    if (!chunk) break;
+                    
+                    TraceScope scope("parse chunk", "ingest");
+                    chunk->facts.clear();
+                    chunk->sentences = 0;
+                    chunk->parsed = 0;
+                    if (!stopping.load(memory_order_relaxed)) {
+                        segmenter.segment(chunk->text, [&](string_view sentence) {
+                            chunk->sentences++;
+                            if (local.parseSentence(sentence, chunk->facts)) {
+                                chunk->parsed++;
+                            }
+                        });
+                    }
+                    scope.setValue("sentences", chunk->sentences);
+                    toInsert.push(chunk);
+                }
+                toInsert.push(nullptr);
+            });
+        }
+        
+        // Insert stage: put the chunks back in input order, one batch each.
+        // If inserting fails, the reader stops and the chunks still in
+        // flight are drained unused, so that every thread can be joined
+        // before the error is passed on.
+        PrologDatabase& db = parser.database();
+        vector<Chunk*> arrived(poolSize, nullptr);
+        uint64_t next = 0;
+        size_t finished = 0;
+        exception_ptr failure;
+        while (finished < workerCount) {
+            Chunk* chunk;
+            toInsert.pop(chunk);
+            if (!chunk) {
+                finished++;
+                continue;
+            }
+            arrived[chunk->sequence % poolSize] = chunk;
+            
+            while (Chunk* ready = arrived[next % poolSize]) {
+                arrived[next % poolSize] = nullptr;
+                if (!failure) {
+                    try {
+                        db.addFacts(ready->facts);
+                        totals.sentences += ready->sentences;
+                        totals.facts += ready->parsed;
+                    } catch (...) {
+                        failure = current_exception();
+                        stopping.store(true, memory_order_relaxed);
+                    }
+                }
+                freeChunks.push(ready);
+                next++;
+            }
+            
+            totals.bytes = before.bytes + bytesRead.load(memory_order_relaxed);
+            maybeReport(before, started);
+        }
+        
+        reader.join();
+        for (thread& worker : workers) worker.join();
+        totals.bytes = before.bytes + bytesRead.load();
+        if (failure) rethrow_exception(failure);
+    }
+
+public:
+    // ------------------------------------------------------------------------
+    // Constructor
+    // Parameters:
+    //   - textParser: Receives the sentences
+    //   - chunkSize: Read buffer size; also the longest sentence kept whole
+    // ------------------------------------------------------------------------
+    explicit CorpusIngester(TextParser& textParser, size_t chunkSize = 1 << 20)
+        : parser(textParser), segmenter(textParser.sentenceSegmenter()),
+          bufferSize(max<size_t>(chunkSize, 64)) {
+        // Corpus dumps hold one sentence per line
+        segmenter.setLineBreaks(true);
+    }
+    
+    // Periodic progress lines go to out (nullptr for none)
+    void setProgress(ostream* out, double intervalSeconds = 5.0) {
+        progress = out;
+        reportInterval = intervalSeconds;
+    }
+    
+    // How the input is split into sentences
+    SentenceSegmenter& sentenceSegmenter() { return segmenter; }
+    
+    // Number of parser threads; 1 parses on the calling thread
+    void setWorkers(size_t count) { workerCount = max<size_t>(count, 1); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: ingest
+    // Purpose: Parses every sentence of a stream
+    // Returns: Counts for this stream alone
+    // ------------------------------------------------------------------------
+    IngestStats ingest(istream& in) {
+        IngestStats before = totals;
+        auto started = chrono::steady_clock::now();
+        lastReport = started;
+        
+        if (workerCount > 1) {
+            ingestParallel(in, before, started);
+        } else {
+            ingestSequential(in, before, started);
+        }
+        
+        IngestStats run = since(before, started);
+        totals.seconds += run.seconds;
+        report(run, true);
+        return run;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: ingestFile
+    // Purpose: Parses every sentence of a file ("-" reads standard input).
+    //          Throws runtime_error if the file cannot be opened or read.
+    // ------------------------------------------------------------------------
+    IngestStats ingestFile(const string& path) {
+        if (path == "-") return ingest(cin);
+        
+        ifstream file(path, ios::binary);
+        if (!file) {
+            throw runtime_error("Cannot open input file: " + path);
+        }
+        IngestStats run = ingest(file);
+        if (file.bad()) {
+            throw runtime_error("Error reading input file: " + path);
+        }
+        return run;
+    }
+    
+    // Counts over every stream ingested so far
+    const IngestStats& stats() const { return totals; }
+};
+
+// Stream buffer that drops everything written to it
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+// ============================================================================
+// CLASS: CorpusGenerator
+// Purpose: Writes synthetic English corpora for load tests: statements in
+//          every form the default grammar reads, and questions in every
+//          form QueryEngine answers. People come in family trees of a set
+//          number of generations. Children usually stay in their parents'
+//          city and sometimes have a friend anywhere.
+//          First names, cities and liked things are drawn from Zipf
+//          distributions, so a few names and big cities dominate as they
+//          do in real text. The output depends only on the options and is
+//          the same on every platform.
+// Example: Dorami lives in Kelubton.  Dorami is the parent of Sufa.
+//          Sufa likes chess.  Sufa is tall.  Who is the parent of Sufa?
+// ============================================================================
+struct GeneratorOptions {
+    uint64_t seed = 1;
+    uint64_t statements = 1000000;
+    size_t generations = 5;           // Depth of every family tree
+    size_t children = 3;              // Mean children per couple
+    size_t names = 20000;             // Distinct first names
+    double nameSkew = 1.0;            // Zipf exponents
+    size_t cities = 5000;
+    double citySkew = 1.2;
+    size_t things = 2000;
+    double thingSkew = 1.0;
+};
+
+class CorpusGenerator {
+private:
+    // Draws ranks 0..n-1 with probability proportional to 1 / (rank+1)^skew
+    class ZipfSampler {
+    private:
+        vector<double> cumulative;
+    public:
+        ZipfSampler(size_t n, double skew) : cumulative(max<size_t>(n, 1)) {
+            double total = 0;
+            for (size_t k = 0; k < cumulative.size(); k++) {
+                total += 1.0 / pow(static_cast<double>(k + 1), skew);
+                cumulative[k] = total;
+            }
+            for (double& value : cumulative) value /= total;
+        }
+        size_t operator()(double uniform) const {
+            size_t rank = upper_bound(cumulative.begin(), cumulative.end(), uniform) -
+                          cumulative.begin();
+            return min(rank, cumulative.size() - 1);
+        }
+    };
+    
+    // Somebody whose household is still to be written
+    struct Person {
+        uint32_t name;
+        uint32_t city;
+        uint32_t generation;
+    };
+    
+    static constexpr const char* PROPERTIES[] = {
+        "tall", "smart", "kind", "happy", "young", "old", "brave", "quiet",
+        "funny", "strong", "rich", "curious", "patient", "shy", "clever", "calm"
+    };
+    static constexpr const char* THINGS[] = {
+        "pizza", "music", "chocolate", "tea", "coffee", "chess", "football",
+        "books", "cats", "dogs", "cheese", "movies", "jazz", "tennis",
+        "painting", "gardening", "poetry", "sushi", "hiking", "apples"
+    };
+    static constexpr const char* CITY_SUFFIXES[] = {"ton", "burg", "ford", "mouth"};
+    
+    GeneratorOptions options;
+    uint64_t state;
+    ZipfSampler nameSampler;
+    ZipfSampler citySampler;
+    ZipfSampler thingSampler;
+    deque<Person> households;             // Breadth first through the tree
+    deque<string> pending;                // Statements of the last household
+    uint64_t written = 0;
+    
+    // Helper function for the next 64 random bits (splitmix64)
+    uint64_t nextRandom() {
+        state += 0x9e3779b97f4a7c15ULL;
+        return mixHash(state);
+    }
+    
+    // Helper function for a uniform double in [0, 1)
+    double uniform() { return (nextRandom() >> 11) * (1.0 / 9007199254740992.0); }
+    
+    // Helper function to spell a made-up word for a number: two or more
+    // consonant-vowel syllables
+    static string syllables(uint64_t k) {
+        static const char CONSONANTS[] = "bdfgklmnprstvz";
+        static const char VOWELS[] = "aeiou";
+        const uint64_t base = 14 * 5;
+        string word;
+        k += base;                        // At least two syllables
+        do {
+            word += CONSONANTS[k % base / 5];
+            word += VOWELS[k % 5];
+            k /= base;
+        } while (k > 0);
+        return word;
+    }
+    
+    // Helper function to capitalize a word for use in a sentence
+    static string capitalized(string word) {
+        if (!word.empty()) word[0] = toupper(static_cast<unsigned char>(word[0]));
+        return word;
+    }
+    
+    // Helper function to spell first name number k
+    static string nameOf(uint32_t k) {
+        string word = syllables(k);
+        // Words the sentence patterns look for cannot be names
+        if (word == "like" || word == "live") word += 'n';
+        return capitalized(word);
+    }
+    
+    static string cityOf(uint32_t k) {
+        return capitalized(syllables(k / 4) + CITY_SUFFIXES[k % 4]);
+    }
+    
+    static string thingOf(uint32_t k) {
+        const size_t known = sizeof(THINGS) / sizeof(THINGS[0]);
+        return k < known ? THINGS[k] : syllables(k - known);
+    }
+    
+    uint32_t drawName() { return static_cast<uint32_t>(nameSampler(uniform())); }
+    uint32_t drawCity() { return static_cast<uint32_t>(citySampler(uniform())); }
+    
+    // Helper function to queue what is said about one person
+    void describe(uint32_t name, uint32_t city) {
+        string who = nameOf(name);
+        pending.push_back(who + " lives in " + cityOf(city) + ".");
+        for (uint64_t n = nextRandom() % 3; n > 0; n--) {
+            pending.push_back(who + " likes " +
+                              thingOf(static_cast<uint32_t>(thingSampler(uniform()))) + ".");
+        }
+        if (uniform() < 0.3) {
+            const size_t count = sizeof(PROPERTIES) / sizeof(PROPERTIES[0]);
+            pending.push_back(who + " is " + PROPERTIES[nextRandom() % count] + ".");
+        }
+        if (uniform() < 0.2) {
+            pending.push_back(who + " is the friend of " + nameOf(drawName()) + ".");
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: nextHousehold
+    // Purpose: Queues the statements about the next person, their spouse
+    //          and their children, starting a new family tree when the
+    //          current one has all its generations
+    // ------------------------------------------------------------------------
+    void nextHousehold() {
+        if (households.empty()) {
+            households.push_back({drawName(), drawCity(), 0});
+        }
+        Person head = households.front();
+        households.pop_front();
+        
+        uint32_t spouse = drawName();
+        describe(head.name, head.city);
+        describe(spouse, head.city);
+        if (head.generation + 1 >= options.generations) return;
+        
+        string parents[2] = {nameOf(head.name), nameOf(spouse)};
+        for (uint64_t n = nextRandom() % (2 * options.children + 1); n > 0; n--) {
+            Person child{drawName(), head.city, head.generation + 1};
+            if (uniform() < 0.3) child.city = drawCity();
+            string name = nameOf(child.name);
+            for (const string& parent : parents) {
+                pending.push_back(parent + " is the parent of " + name + ".");
+            }
+            households.push_back(child);
+        }
+    }
+
+public:
+    explicit CorpusGenerator(const GeneratorOptions& generatorOptions)
+        : options(generatorOptions), state(mixHash(generatorOptions.seed)),
+          nameSampler(options.names, options.nameSkew),
+          citySampler(options.cities, options.citySkew),
+          thingSampler(options.things, options.thingSkew) {
+        options.generations = max<size_t>(options.generations, 1);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: nextStatement
+    // Purpose: Produces the next sentence of the corpus
+    // Returns: false once the configured number of statements is written
+    // ------------------------------------------------------------------------
+    bool nextStatement(string& sentence) {
+        if (written >= options.statements) return false;
+        while (pending.empty()) nextHousehold();
+        sentence = move(pending.front());
+        pending.pop_front();
+        written++;
+        return true;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: writeStatements
+    // Purpose: Writes the rest of the corpus, one sentence per line
+    // Returns: Number of sentences written
+    // ------------------------------------------------------------------------
+    uint64_t writeStatements(ostream& out) {
+        uint64_t count = 0;
+        string text;
+        for (string sentence; nextStatement(sentence); count++) {
+            text += sentence;
+            text += '\n';
+            if (text.size() >= (1 << 16)) {
+                out.write(text.data(), text.size());
+                text.clear();
+            }
+        }
+        out.write(text.data(), text.size());
+        return count;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: nextQuestion
+    // Purpose: Produces a question in one of the forms QueryEngine answers,
+    //          about people drawn with the same name popularity as the
+    //          statements
+    // ------------------------------------------------------------------------
+    string nextQuestion() {
+        string who = nameOf(drawName());
+        switch (nextRandom() % 5) {
+            case 0: return "Who is the parent of " + who + "?";
+            case 1: return "What does " + who + " like?";
+            case 2: return "Where does " + who + " live?";
+            case 3: {
+                const size_t count = sizeof(PROPERTIES) / sizeof(PROPERTIES[0]);
+                return "Is " + who + " " + PROPERTIES[nextRandom() % count] + "?";
+            }
+            default: return "Is " + who + " the parent of " + nameOf(drawName()) + "?";
+        }
+    }
+    
+    // Stream of the statements, to feed CorpusIngester without a file
+    class Reader : public streambuf {
+    private:
+        CorpusGenerator& generator;
+        string buffer;
+    protected:
+        int_type underflow() override {
+            buffer.clear();
+            string sentence;
+            while (buffer.size() < (1 << 16) && generator.nextStatement(sentence)) {
+                buffer += sentence;
+                buffer += '\n';
+            }
+            if (buffer.empty()) return traits_type::eof();
+            setg(&buffer[0], &buffer[0], &buffer[0] + buffer.size());
+            return traits_type::to_int_type(buffer[0]);
+        }
+    public:
+        explicit Reader(CorpusGenerator& source) : generator(source) {}
+    };
+};
+
+// Character classes of Prolog source
+enum PrologCharClass : uint8_t {
+    P_ALNUM = 1,        // Letters, digits, _ and any non-ASCII byte
+    P_SYMBOL = 2,       // + - * / \ ^ < > = ~ : . ? @ # & $
+    P_SOLO = 4,         // ! ;
+    P_PUNCT = 8,        // ( ) [ ] { } , |
+    P_LAYOUT = 16
+};
+
+struct PrologCharTable {
+    uint8_t bits[256] = {};
+    
+    constexpr PrologCharTable() {
+        for (int c = 0; c < 256; c++) {
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '_' || c >= 0x80) {
+                bits[c] = P_ALNUM;
+            }
+            if (c <= ' ' && c != 0) bits[c] = P_LAYOUT;
+        }
+        for (char c : "+-*/\\^<>=~:.?@#&$") {
+            if (c) bits[static_cast<unsigned char>(c)] = P_SYMBOL;
+        }
+        bits['!'] = bits[';'] = P_SOLO;
+        for (char c : "()[]{},|") {
+            if (c) bits[static_cast<unsigned char>(c)] = P_PUNCT;
+        }
+    }
+};
+
+static constexpr PrologCharTable PROLOG_CHARS;
+
+// Whether an atom reads back as itself without quotes
+static bool plainPrologAtom(string_view name) {
+    if (name.empty()) return false;
+    if (name == "[]" || name == "{}" || name == "!" || name == ";" ||
+        name == ",") {
+        return name != ",";
+    }
+    if (isAsciiLower(name[0])) {
+        for (char c : name) {
+            if (!isAsciiAlpha(c) && !hasCharClass(c, CHAR_DIGIT) && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (char c : name) {
+        if (!c || !strchr("+-*/\\^<>=~:.?@#&$", c)) return false;
+    }
+    // Unquoted, a lone "." would end the clause and "/*" open a comment
+    return name != "." && name.substr(0, 2) != "/*";
+}
+
+// Appends a quoted atom or string, escaping as needed
+static void appendPrologQuoted(string& out, string_view name, char quote) {
+    out += quote;
+    for (char c : name) {
+        if (c == quote || c == '\\') out += '\\';
+        if (c == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+    out += quote;
+}
+
+// ============================================================================
+// CLASS: PrologLexer
+// Purpose: Splits Prolog source text into tokens without copying: token
+//          text points into the source, except for quoted items with escape
+//          sequences, which are decoded into scratch storage that lives
+//          until clearScratch(). Bad input comes back as an Error token.
+// ============================================================================
+class PrologLexer {
+public:
+    enum class Kind : uint8_t {
+        Name,           // Atom or functor: foo, 'New York', +, !, []
+        Variable,       // X, _Y, _
+        Number,         // 42, -7, 3.14, 0'c, 0x1F
+        String,         // "text" or `text`, decoded
+        Punct,          // ( ) [ ] { } , |
+        End,            // The full stop that ends a clause
+        Eof,
+        Error           // text holds the message
+    };
+    
+    struct Token {
+        Kind kind = Kind::Eof;
+        string_view text;
+        bool quoted = false;              // Quoted names are never operators
+        bool layoutBefore = false;        // Preceded by whitespace or comment
+        size_t offset = 0;                // In the source, for error lines
+    };
+
+private:
+    const char* begin;
+    const char* pos;
+    const char* end;
+    Token lookahead;
+    bool peeked = false;
+    deque<string> scratch;
+    
+    static bool is(char c, uint8_t classes) {
+        return (PROLOG_CHARS.bits[static_cast<unsigned char>(c)] & classes) != 0;
+    }
+    
+    Token make(Kind kind, const char* start, bool layout) {
+        Token token;
+        token.kind = kind;
+        token.text = string_view(start, pos - start);
+        token.layoutBefore = layout;
+        token.offset = start - begin;
+        return token;
+    }
+    
+    Token error(const char* message, const char* start, bool layout) {
+        Token token = make(Kind::Error, start, layout);
+        token.text = message;
+        return token;
+    }
+    
+    // Skips whitespace and comments; returns false on an unclosed comment,
+    // with pos left at its start
+    bool skipLayout() {
+        while (pos < end) {
+            if (is(*pos, P_LAYOUT)) {
+                pos++;
+            } else if (*pos == '%') {
+                const char* newline = static_cast<const char*>(
+                    memchr(pos, '\n', end - pos));
+                pos = newline ? newline + 1 : end;
+            } else if (*pos == '/' && pos + 1 < end && pos[1] == '*') {
+                const char* close = nullptr;
+                for (const char* p = pos + 2; p + 1 < end; p++) {
+                    p = static_cast<const char*>(memchr(p, '*', end - 1 - p));
+                    if (!p) break;
+                    if (p[1] == '/') {
+                        close = p;
+                        break;
+                    }
+                }
+                if (!close) return false;
+                pos = close + 2;
+            } else {
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Decodes the escape sequence after a backslash into out and moves past
+    // it. Returns: False if it is not a valid escape
+    bool readEscape(string& out) {
+        if (pos >= end) return false;
+        char c = *pos++;
+        switch (c) {
+            case 'n': out += '\n'; return true;
+            case 't': out += '\t'; return true;
+            case 'r': out += '\r'; return true;
+            case 'a': out += '\a'; return true;
+            case 'b': out += '\b'; return true;
+            case 'f': out += '\f'; return true;
+            case 'v': out += '\v'; return true;
+            case 'e': out += '\x1b'; return true;
+            case 's': out += ' '; return true;
+            case '\n': return true;      // Line continuation
+            case '\\': case '\'': case '"': case '`':
+                out += c;
+                return true;
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+            case 'x': {
+                // \NNN\ octal or \xHH\ hex character code (Latin-1). The
+                // digits are read through the closing backslash even when
+                // the code is too large, so that it is not taken for the
+                // start of another escape.
+                unsigned base = 8;
+                if (c == 'x') {
+                    base = 16;
+                } else {
+                    pos--;
+                }
+                const char* digits = pos;
+                unsigned code = 0;
+                for (; pos < end; pos++) {
+                    char d = *pos;
+                    unsigned value = d >= '0' && d <= '9' ? d - '0'
+                                   : d >= 'a' && d <= 'f' ? d - 'a' + 10
+                                   : d >= 'A' && d <= 'F' ? d - 'A' + 10 : 16;
+                    if (value >= base) break;
+                    code = min(code * base + value, 256u);
+                }
+                if (pos == digits || pos >= end || *pos != '\\') return false;
+                pos++;
+                if (code > 255) return false;
+                out += static_cast<char>(code);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+    
+    // Reads a quoted item after its opening quote. Text without escapes is
+    // returned in place; otherwise it is decoded into scratch storage in the
+    // same pass.
+    // Returns: False on an unterminated quote or a bad escape. Reading then
+    //          resumes after the closing quote, or at the next full stop if
+    //          the quote is never closed.
+    bool readQuoted(char quote, string_view& text) {
+        const char* start = pos;
+        string decoded;
+        bool escaped = false;             // Whether the text is in decoded
+        bool valid = true;
+        while (pos < end) {
+            const char* run = pos;
+            while (pos < end && *pos != quote && *pos != '\\') pos++;
+            if (escaped) decoded.append(run, pos - run);
+            if (pos >= end) break;
+            
+            bool doubled = *pos == quote && pos + 1 < end && pos[1] == quote;
+            if (*pos == quote && !doubled) {
+                const char* stop = pos++;
+                if (!valid) return false;
+                if (!escaped) {
+                    text = string_view(start, stop - start);
+                } else {
+                    scratch.push_back(move(decoded));
+                    text = scratch.back();
+                }
+                return true;
+            }
+            
+            if (!escaped) {
+                decoded.assign(start, pos - start);
+                escaped = true;
+            }
+            if (doubled) {
+                decoded += quote;
+                pos += 2;
+            } else {
+                pos++;
+                if (!readEscape(decoded)) valid = false;
+            }
+        }
+        pos = nextFullStop(start);
+        return false;
+    }
+    
+    // Helper function to find the next "." that ends a clause, or the end
+    const char* nextFullStop(const char* from) const {
+        for (const char* p = from; p < end; p++) {
+            p = static_cast<const char*>(memchr(p, '.', end - p));
+            if (!p) break;
+            if (p + 1 == end || is(p[1], P_LAYOUT) || p[1] == '%') return p;
+        }
+        return end;
+    }
+    
+    Token readNumber(const char* start, bool layout) {
+        if (*pos == '0' && pos + 1 < end && pos[1] == '\'') {
+            // 0'c character code
+            pos += 2;
+            if (pos < end && *pos == '\\') pos++;
+            if (pos < end) pos++;
+            return make(Kind::Number, start, layout);
+        }
+        if (*pos == '0' && pos + 2 < end &&
+            (pos[1] == 'x' || pos[1] == 'o' || pos[1] == 'b') &&
+            isxdigit(static_cast<unsigned char>(pos[2]))) {
+            pos += 2;
+            while (pos < end && isxdigit(static_cast<unsigned char>(*pos))) pos++;
+            return make(Kind::Number, start, layout);
+        }
+        
+        while (pos < end && hasCharClass(*pos, CHAR_DIGIT)) pos++;
+        if (pos + 1 < end && *pos == '.' && hasCharClass(pos[1], CHAR_DIGIT)) {
+            pos += 2;
+            while (pos < end && hasCharClass(*pos, CHAR_DIGIT)) pos++;
+        }
+        if (pos < end && (*pos == 'e' || *pos == 'E')) {
+            const char* exponent = pos + 1;
+            if (exponent < end && (*exponent == '+' || *exponent == '-')) exponent++;
+            if (exponent < end && hasCharClass(*exponent, CHAR_DIGIT)) {
+                pos = exponent;
+                while (pos < end && hasCharClass(*pos, CHAR_DIGIT)) pos++;
+            }
+        }
+        return make(Kind::Number, start, layout);
+    }
+    
+    Token scan() {
+        const char* before = pos;
+        if (!skipLayout()) {
+            const char* comment = pos;
+            pos = end;
+            return error("unterminated comment", comment, true);
+        }
+        bool layout = pos != before;
+        const char* start = pos;
+        if (pos >= end) return make(Kind::Eof, start, layout);
+        
+        char c = *pos;
+        if (hasCharClass(c, CHAR_DIGIT)) return readNumber(start, layout);
+        
+        if (is(c, P_ALNUM)) {
+            while (pos < end && is(*pos, P_ALNUM)) pos++;
+            bool variable = c == '_' || hasCharClass(c, CHAR_UPPER);
+            return make(variable ? Kind::Variable : Kind::Name, start, layout);
+        }
+        
+        if (c == '\'' || c == '"' || c == '`') {
+            pos++;
+            Token token = make(c == '\'' ? Kind::Name : Kind::String, start, layout);
+            if (!readQuoted(c, token.text)) {
+                return error("unterminated or badly escaped quoted item", start, layout);
+            }
+            token.quoted = true;
+            return token;
+        }
+        
+        if (is(c, P_PUNCT)) {
+            pos++;
+            return make(Kind::Punct, start, layout);
+        }
+        if (is(c, P_SOLO)) {
+            pos++;
+            return make(Kind::Name, start, layout);
+        }
+        
+        if (is(c, P_SYMBOL)) {
+            while (pos < end && is(*pos, P_SYMBOL)) pos++;
+            // A lone "." before layout, a comment or the end closes a clause
+            if (pos - start == 1 && c == '.' &&
+                (pos == end || is(*pos, P_LAYOUT) || *pos == '%')) {
+                return make(Kind::End, start, layout);
+            }
+            return make(Kind::Name, start, layout);
+        }
+        
+        pos++;
+        return error("unexpected character", start, layout);
+    }
+
+public:
+    explicit PrologLexer(string_view source)
+        : begin(source.data()), pos(source.data()),
+          end(source.data() + source.size()) {}
+    
+    PrologLexer(const PrologLexer&) = delete;
+    PrologLexer& operator=(const PrologLexer&) = delete;
+    
+    Token next() {
+        if (peeked) {
+            peeked = false;
+            return lookahead;
+        }
+        return scan();
+    }
+    
+    const Token& peek() {
+        if (!peeked) {
+            lookahead = scan();
+            peeked = true;
+        }
+        return lookahead;
+    }
+    
+    // Drops decoded text; earlier tokens must no longer be in use
+    void clearScratch() {
+        if (!peeked) scratch.clear();
+    }
+    
+    // 1-based line of a source offset
+    size_t lineOf(size_t offset) const {
+        return 1 + count(begin, begin + offset, '\n');
+    }
+};
+
+// ============================================================================
+// CLASS: PrologReader
+// Purpose: Consults Prolog source: reads clauses with an operator-precedence
+//          term reader (the standard operator table) and stores every
+//          ground fact in the PrologDatabase. Atomic arguments are stored
+//          as their text; compound arguments and lists as their canonical
+//          form, e.g. point(1,2) or [a,b]. The database holds facts only,
+//          so clauses with a body, directives and facts with variables are
+//          read and counted but not stored. A syntax error is reported and
+//          reading resumes after the next full stop.
+// Example: parent(john, mary).  capital('New York', "NY").
+// ============================================================================
+struct ConsultStats {
+    uint64_t clauses = 0;
+    uint64_t facts = 0;
+    uint64_t rules = 0;           // Clauses with a body, incl. DCG rules
+    uint64_t directives = 0;
+    uint64_t nonGround = 0;       // Facts with variables
+    uint64_t errors = 0;
+};
+
+class PrologReader {
 private:
-    // Storage for facts: predicate name -> list of argument tuples
-    // Example: "parent" -> [["john", "mary"], ["mary", "susan"]]
-    map<string, vector<vector<string>>> facts;
+    typedef PrologLexer::Kind Kind;
+    typedef PrologLexer::Token Token;
+    
+    enum class OpType : uint8_t { XFX, XFY, YFX, FY, FX };
+    struct Operator {
+        const char* name;
+        OpType type;
+        uint16_t priority;
+    };
+    
+    static constexpr size_t BATCH_SIZE = 4096;
+    
+    struct Term {
+        enum Kind : uint8_t { ATOM, VARIABLE, NUMBER, STRING, COMPOUND, LIST };
+        Kind kind;
+        bool quoted;                  // Atom written in quotes
+        string_view name;             // Atom text, functor, number, ...
+        uint32_t firstArg;            // Into args
+        uint32_t arity;               // LIST: elements + 1 for the tail
+    };
+    
+    PrologDatabase& db;
+    ostream* errors = &cerr;
+    ConsultStats totals;
+    
+    // Per-clause state, reused
+    vector<Term> terms;
+    vector<uint32_t> args;
+    vector<uint32_t> pending;         // Arguments still being collected
+    bool sawVariable = false;
+    string text;                      // Canonical text of compound arguments
+    FactBatch batch;
+    
+    static const Operator* findOperator(string_view name, bool prefix) {
+        static const Operator OPERATORS[] = {
+            {":-", OpType::XFX, 1200}, {"-->", OpType::XFX, 1200},
+            {":-", OpType::FX, 1200}, {"?-", OpType::FX, 1200},
+            {";", OpType::XFY, 1100}, {"|", OpType::XFY, 1100},
+            {"->", OpType::XFY, 1050}, {"*->", OpType::XFY, 1050},
+            {",", OpType::XFY, 1000},
+            {"dynamic", OpType::FX, 1150}, {"discontiguous", OpType::FX, 1150},
+            {"initialization", OpType::FX, 1150}, {"multifile", OpType::FX, 1150},
+            {"module_transparent", OpType::FX, 1150}, {"table", OpType::FX, 1150},
+            {"\\+", OpType::FY, 900},
+            {"=", OpType::XFX, 700}, {"\\=", OpType::XFX, 700},
+            {"==", OpType::XFX, 700}, {"\\==", OpType::XFX, 700},
+            {"@<", OpType::XFX, 700}, {"@>", OpType::XFX, 700},
+            {"@=<", OpType::XFX, 700}, {"@>=", OpType::XFX, 700},
+            {"=..", OpType::XFX, 700}, {"is", OpType::XFX, 700},
+            {"=:=", OpType::XFX, 700}, {"=\\=", OpType::XFX, 700},
+            {"<", OpType::XFX, 700}, {">", OpType::XFX, 700},
+            {"=<", OpType::XFX, 700}, {">=", OpType::XFX, 700},
+            {":", OpType::XFY, 200},
+            {"+", OpType::YFX, 500}, {"-", OpType::YFX, 500},
+            {"/\\", OpType::YFX, 500}, {"\\/", OpType::YFX, 500},
+            {"xor", OpType::YFX, 500},
+            {"*", OpType::YFX, 400}, {"/", OpType::YFX, 400},
+            {"//", OpType::YFX, 400}, {"rem", OpType::YFX, 400},
+            {"mod", OpType::YFX, 400}, {"div", OpType::YFX, 400},
+            {"<<", OpType::YFX, 400}, {">>", OpType::YFX, 400},
+            {"**", OpType::XFX, 200}, {"^", OpType::XFY, 200},
+            {"-", OpType::FY, 200}, {"+", OpType::FY, 200}, {"\\", OpType::FY, 200},
+        };
+        for (const Operator& op : OPERATORS) {
+            bool isPrefix = op.type == OpType::FY || op.type == OpType::FX;
+            if (isPrefix == prefix && name == op.name) return &op;
+        }
+        return nullptr;
+    }
+    
+    [[noreturn]] static void syntaxError(const string& message) {
+        throw runtime_error(message);
+    }
+    
+    uint32_t addTerm(Term::Kind kind, string_view name, bool quoted = false) {
+        terms.push_back({kind, quoted, name, 0, 0});
+        return static_cast<uint32_t>(terms.size() - 1);
+    }
+    
+    // Turns pending[mark..] into the arguments of a new term
+    uint32_t addParent(Term::Kind kind, string_view name, size_t mark) {
+        uint32_t id = addTerm(kind, name);
+        terms[id].firstArg = static_cast<uint32_t>(args.size());
+        terms[id].arity = static_cast<uint32_t>(pending.size() - mark);
+        args.insert(args.end(), pending.begin() + mark, pending.end());
+        pending.resize(mark);
+        return id;
+    }
+    
+    uint32_t addCompound(string_view name, initializer_list<uint32_t> children) {
+        size_t mark = pending.size();
+        pending.insert(pending.end(), children);
+        return addParent(Term::COMPOUND, name, mark);
+    }
     
-    // Helper function to convert string to lowercase for case-insensitive matching
-    string toLower(const string& str) {
-        string result = str;
-        transform(result.begin(), result.end(), result.begin(), ::tolower);
-        return result;
+    // A full stop is never consumed by mistake, so recovery can find it
+    void expect(PrologLexer& lexer, const char* punct) {
+        const Token& token = lexer.peek();
+        if (token.kind != Kind::Punct || token.text != punct) {
+            syntaxError(string("expected '") + punct + "'");
+        }
+        lexer.next();
     }
     
-    // Helper function to trim whitespace from both ends of a string
-    string trim(const string& str) {
-        size_t start = str.find_first_not_of(" \t\n\r");
-        size_t end = str.find_last_not_of(" \t\n\r");
-        
-        if (start == string::npos) return "";
-        return str.substr(start, end - start + 1);
+    static bool isPunct(const Token& token, char c) {
+        return token.kind == Kind::Punct && token.text.size() == 1 &&
+               token.text[0] == c;
     }
-
-public:
+    
+    // True if the token can begin a term
+    static bool startsTerm(const Token& token) {
+        switch (token.kind) {
+            case Kind::Name:
+            case Kind::Variable:
+            case Kind::Number:
+            case Kind::String:
+                return true;
+            case Kind::Punct:
+                return isPunct(token, '(') || isPunct(token, '[') ||
+                       isPunct(token, '{');
+            default:
+                return false;
+        }
+    }
+    
     // ------------------------------------------------------------------------
-    // METHOD: addFact
-    // Purpose: Adds a new fact to the database
+    // METHOD: parse
+    // Purpose: Reads a term of at most the given priority
     // Parameters:
-    //   - predicate: The name of the predicate (e.g., "parent", "likes")
-    //   - arguments: Vector of arguments for this predicate
+    //   - priority: Upper bound from the context (1200 for a clause, 999
+    //               for an argument)
+    //   - termPriority: Receives the priority of the term read
+    // Returns: Index of the term
     // ------------------------------------------------------------------------
-    void addFact(const string& predicate, const vector<string>& arguments) {
-        string pred = toLower(predicate);
-        
-        // Add the fact to our database
-        facts[pred].push_back(arguments);
+    uint32_t parse(PrologLexer& lexer, unsigned priority, unsigned& termPriority) {
+        uint32_t left = parsePrimary(lexer, priority, termPriority);
         
-        // Print confirmation for user
-        cout << "Added fact: " << predicate << "(";
-        for (size_t i = 0; i < arguments.size(); i++) {
-            cout << arguments[i];
-            if (i < arguments.size() - 1) cout << ", ";
+        // Infix operators, left to right
+        for (;;) {
+            const Token& next = lexer.peek();
+            bool candidate = (next.kind == Kind::Name && !next.quoted) ||
+                             isPunct(next, ',') || isPunct(next, '|');
+            if (!candidate) break;
+            const Operator* op = findOperator(next.text, false);
+            if (!op || op->priority > priority) break;
+            
+            unsigned leftMax = op->type == OpType::YFX ? op->priority
+                                                       : op->priority - 1;
+            unsigned rightMax = op->type == OpType::XFY ? op->priority
+                                                        : op->priority - 1;
+            if (termPriority > leftMax) break;
+            
+            // "a | b" in a body means (a ; b)
+            string_view name = next.text == "|" ? string_view(";") : next.text;
+            lexer.next();
+            unsigned rightPriority;
+            uint32_t right = parse(lexer, rightMax, rightPriority);
+            left = addCompound(name, {left, right});
+            termPriority = op->priority;
         }
-        cout << ")" << endl;
+        return left;
     }
     
-    // ------------------------------------------------------------------------
-    // METHOD: query
-    // Purpose: Queries the database for facts matching the given predicate
-    // Parameters:
-    //   - predicate: The predicate to search for
-    //   - arguments: Arguments to match (use "?" for wildcards/variables)
-    // Returns: Vector of all matching fact argument lists
-    // ------------------------------------------------------------------------
-    vector<vector<string>> query(const string& predicate, 
-                                  const vector<string>& arguments) {
-        vector<vector<string>> results;
-        string pred = toLower(predicate);
+    uint32_t parsePrimary(PrologLexer& lexer, unsigned priority,
+                          unsigned& termPriority) {
+        termPriority = 0;
+        Kind kind = lexer.peek().kind;
+        if (kind == Kind::End || kind == Kind::Eof) {
+            syntaxError("unexpected end of clause");
+        }
+        Token token = lexer.next();
         
-        // Check if this predicate exists in our database
-        if (facts.find(pred) == facts.end()) {
-            return results; // Empty results
+        switch (token.kind) {
+            case Kind::Number:
+                return addTerm(Term::NUMBER, token.text);
+            case Kind::Variable:
+                sawVariable = true;
+                return addTerm(Term::VARIABLE, token.text);
+            case Kind::String:
+                return addTerm(Term::STRING, token.text);
+            case Kind::Error:
+                syntaxError(string(token.text));
+            case Kind::End:
+            case Kind::Eof:
+                syntaxError("unexpected end of clause");
+            case Kind::Punct:
+                return parseBracketed(lexer, token);
+            case Kind::Name:
+                break;
         }
         
-        // Search through all facts with this predicate
-        for (const auto& fact : facts[pred]) {
-            bool matches = true;
-            
-            // Check if the number of arguments matches
-            if (fact.size() != arguments.size()) {
-                matches = false;
-                continue;
+        const Token& next = lexer.peek();
+        
+        // Functional notation: the "(" must follow the name directly
+        if (isPunct(next, '(') && !next.layoutBefore) {
+            lexer.next();
+            size_t mark = pending.size();
+            do {
+                unsigned argumentPriority;
+                pending.push_back(parse(lexer, 999, argumentPriority));
+            } while (isPunct(lexer.peek(), ',') && (lexer.next(), true));
+            expect(lexer, ")");
+            uint32_t id = addParent(Term::COMPOUND, token.text, mark);
+            terms[id].quoted = token.quoted;
+            return id;
+        }
+        
+        // Negative numeric literal
+        if (token.text == "-" && !token.quoted && next.kind == Kind::Number &&
+            !next.layoutBefore) {
+            Token number = lexer.next();
+            return addTerm(Term::NUMBER, string_view(token.text.data(),
+                                                     token.text.size() +
+                                                     number.text.size()));
+        }
+        
+        // Prefix operator applied to an operand
+        if (!token.quoted && startsTerm(next)) {
+            const Operator* op = findOperator(token.text, true);
+            bool infixNext = next.kind == Kind::Name && !next.quoted &&
+                             findOperator(next.text, false) &&
+                             !findOperator(next.text, true);
+            if (op && op->priority <= priority && !infixNext) {
+                unsigned operandMax = op->type == OpType::FY ? op->priority
+                                                             : op->priority - 1;
+                unsigned operandPriority;
+                uint32_t operand = parse(lexer, operandMax, operandPriority);
+                termPriority = op->priority;
+                return addCompound(token.text, {operand});
             }
-            
-            // Check each argument
-            for (size_t i = 0; i < arguments.size(); i++) {
-                // "?" is a wildcard that matches anything
-                if (arguments[i] != "?" && 
-                    toLower(arguments[i]) != toLower(fact[i])) {
-                    matches = false;
+        }
+        
+        return addTerm(Term::ATOM, token.text, token.quoted);
+    }
+    
+    // Helper function for terms opening with ( [ or {
+    uint32_t parseBracketed(PrologLexer& lexer, const Token& open) {
+        unsigned inner;
+        if (isPunct(open, '(')) {
+            uint32_t term = parse(lexer, 1200, inner);
+            expect(lexer, ")");
+            return term;
+        }
+        
+        if (isPunct(open, '{')) {
+            if (isPunct(lexer.peek(), '}')) {
+                lexer.next();
+                return addTerm(Term::ATOM, "{}");
+            }
+            uint32_t term = parse(lexer, 1200, inner);
+            expect(lexer, "}");
+            return addCompound("{}", {term});
+        }
+        
+        if (!isPunct(open, '[')) {
+            syntaxError("unexpected '" + string(open.text) + "'");
+        }
+        if (isPunct(lexer.peek(), ']')) {
+            lexer.next();
+            return addTerm(Term::ATOM, "[]");
+        }
+        
+        size_t mark = pending.size();
+        do {
+            pending.push_back(parse(lexer, 999, inner));
+        } while (isPunct(lexer.peek(), ',') && (lexer.next(), true));
+        
+        uint32_t tail;
+        if (isPunct(lexer.peek(), '|')) {
+            lexer.next();
+            tail = parse(lexer, 999, inner);
+        } else {
+            tail = addTerm(Term::ATOM, "[]");
+        }
+        pending.push_back(tail);
+        expect(lexer, "]");
+        return addParent(Term::LIST, "[]", mark);
+    }
+    
+    // Helper function to append the canonical text of a term
+    void writeTerm(string& out, uint32_t id) const {
+        const Term& term = terms[id];
+        switch (term.kind) {
+            case Term::ATOM:
+                if (plainPrologAtom(term.name)) {
+                    out += term.name;
+                } else {
+                    appendPrologQuoted(out, term.name, '\'');
+                }
+                return;
+            case Term::VARIABLE:
+            case Term::NUMBER:
+                out += term.name;
+                return;
+            case Term::STRING:
+                appendPrologQuoted(out, term.name, '"');
+                return;
+            case Term::COMPOUND:
+                if (plainPrologAtom(term.name)) {
+                    out += term.name;
+                } else {
+                    appendPrologQuoted(out, term.name, '\'');
+                }
+                out += '(';
+                for (uint32_t i = 0; i < term.arity; i++) {
+                    if (i) out += ',';
+                    writeTerm(out, args[term.firstArg + i]);
+                }
+                out += ')';
+                return;
+            case Term::LIST: {
+                // A list tail is written as more elements: [a|[b]] is [a,b]
+                out += '[';
+                const Term* list = &term;
+                for (bool first = true;;) {
+                    for (uint32_t i = 0; i + 1 < list->arity; i++) {
+                        if (!first) out += ',';
+                        first = false;
+                        writeTerm(out, args[list->firstArg + i]);
+                    }
+                    uint32_t tailId = args[list->firstArg + list->arity - 1];
+                    const Term& tail = terms[tailId];
+                    if (tail.kind == Term::LIST) {
+                        list = &tail;
+                        continue;
+                    }
+                    if (tail.kind != Term::ATOM || tail.name != "[]") {
+                        out += '|';
+                        writeTerm(out, tailId);
+                    }
                     break;
                 }
+                out += ']';
+                return;
             }
-            
-            if (matches) {
-                results.push_back(fact);
+        }
+    }
+    
+    // Helper function to file one clause: store it if it is a ground fact
+    void storeClause(uint32_t root) {
+        const Term& clause = terms[root];
+        if (clause.kind == Term::COMPOUND &&
+            (clause.name == ":-" || clause.name == "?-" || clause.name == "-->")) {
+            if (clause.arity == 1) {
+                totals.directives++;
+            } else {
+                totals.rules++;
             }
+            return;
+        }
+        if (clause.kind != Term::ATOM && clause.kind != Term::COMPOUND) {
+            syntaxError("clause is not a callable term");
+        }
+        if (sawVariable) {
+            totals.nonGround++;
+            return;
         }
         
-        return results;
+        // Compound arguments are written out first, then viewed, so the
+        // text buffer no longer moves
+        uint32_t arity = clause.kind == Term::COMPOUND ? clause.arity : 0;
+        text.clear();
+        vector<pair<size_t, size_t>> spans(arity);
+        for (uint32_t i = 0; i < arity; i++) {
+            const Term& argument = terms[args[clause.firstArg + i]];
+            if (argument.kind == Term::COMPOUND || argument.kind == Term::LIST) {
+                size_t start = text.size();
+                writeTerm(text, args[clause.firstArg + i]);
+                spans[i] = {start, text.size() - start};
+            } else {
+                spans[i] = {SIZE_MAX, 0};
+            }
+        }
+        
+        string_view local[8];
+        vector<string_view> spill;
+        string_view* views = local;
+        if (arity > 8) {
+            spill.resize(arity);
+            views = spill.data();
+        }
+        for (uint32_t i = 0; i < arity; i++) {
+            views[i] = spans[i].first == SIZE_MAX
+                ? terms[args[clause.firstArg + i]].name
+                : string_view(text.data() + spans[i].first, spans[i].second);
+        }
+        
+        batch.add(clause.name, views, arity);
+        totals.facts++;
+        if (batch.size() >= BATCH_SIZE) flush();
     }
     
+    void flush() {
+        db.addFacts(batch);
+        batch.clear();
+    }
+
+public:
+    explicit PrologReader(PrologDatabase& database) : db(database) {}
+    
+    // Where syntax errors are reported (nullptr for nowhere)
+    void setErrorStream(ostream* out) { errors = out; }
+    
+    const ConsultStats& stats() const { return totals; }
+    
     // ------------------------------------------------------------------------
-    // METHOD: printDatabase
-    // Purpose: Displays all facts currently stored in the database
+    // METHOD: consultText
+    // Purpose: Reads every clause of some Prolog source and stores its facts
+    // Parameters:
+    //   - source: The program text
+    //   - origin: Name used in error messages (e.g. the file name)
+    // Returns: Number of facts stored
     // ------------------------------------------------------------------------
-    void printDatabase() {
-        cout << "\n========== PROLOG DATABASE ==========\n";
-        
-        if (facts.empty()) {
-            cout << "Database is empty.\n";
-            return;
-        }
+    uint64_t consultText(string_view source, const string& origin = "input") {
+        uint64_t before = totals.facts;
+        PrologLexer lexer(source);
         
-        // Iterate through all predicates
-        for (const auto& predicate : facts) {
-            cout << "\nPredicate: " << predicate.first << endl;
+        while (lexer.peek().kind != Kind::Eof) {
+            terms.clear();
+            args.clear();
+            pending.clear();
+            sawVariable = false;
+            lexer.clearScratch();
+            size_t offset = lexer.peek().offset;
             
-            // Print all facts for this predicate
-            for (const auto& fact : predicate.second) {
-                cout << "  " << predicate.first << "(";
-                for (size_t i = 0; i < fact.size(); i++) {
-                    cout << fact[i];
-                    if (i < fact.size() - 1) cout << ", ";
+            try {
+                unsigned priority;
+                uint32_t root = parse(lexer, 1200, priority);
+                Token end = lexer.next();
+                if (end.kind != Kind::End) {
+                    offset = end.offset;
+                    syntaxError(end.kind == Kind::Error ? string(end.text)
+                                                        : "operator expected");
+                }
+                totals.clauses++;
+                storeClause(root);
+            } catch (const runtime_error& e) {
+                totals.errors++;
+                if (errors) {
+                    *errors << origin << ":" << lexer.lineOf(offset)
+                            << ": syntax error: " << e.what() << "\n";
+                }
+                
+                // Resume after the next full stop
+                if (lexer.peek().kind == Kind::End) {
+                    lexer.next();
+                    continue;
+                }
+                for (;;) {
+                    Token skipped = lexer.next();
+                    if (skipped.kind == Kind::End || skipped.kind == Kind::Eof) break;
                 }
-                cout << ")" << endl;
             }
         }
         
-        cout << "=====================================\n\n";
+        flush();
+        return totals.facts - before;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: consult
+    // Purpose: Reads a Prolog source file, mapped into memory
+    // Returns: Number of facts stored
+    // Throws runtime_error if the file cannot be opened
+    // ------------------------------------------------------------------------
+    uint64_t consult(const string& path) {
+        MappedFile file(path);
+        return consultText(string_view(file.data(), file.size()), path);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: readsBackUnquoted
+    // Purpose: Tells whether a stored argument, written without quotes, is
+    //          read back as the same text: a number in any form the lexer
+    //          reads (-7, 1.5e3, 0x1F, 0'c), or the canonical form of a
+    //          compound or list. Everything else must be a quoted atom.
+    // ------------------------------------------------------------------------
+    bool readsBackUnquoted(string_view argument) {
+        terms.clear();
+        args.clear();
+        pending.clear();
+        sawVariable = false;
+        PrologLexer lexer(argument);
+        try {
+            unsigned priority;
+            uint32_t root = parse(lexer, 999, priority);
+            if (lexer.next().kind != Kind::Eof || sawVariable) return false;
+            const Term& term = terms[root];
+            if (term.kind == Term::NUMBER) return term.name == argument;
+            if (term.kind != Term::COMPOUND && term.kind != Term::LIST) return false;
+            text.clear();
+            writeTerm(text, root);
+            return text == argument;
+        } catch (const runtime_error&) {
+            return false;
+        }
     }
 };
 
 // ============================================================================
-// CLASS: TextParser
-// Purpose: Converts natural language sentences into PROLOG predicates
+// UTILITY: parallel loops
+// Purpose: Run numbered work units on worker threads. The first exception
+//          stops the units not yet handed out, and is rethrown once every
+//          thread has been joined.
 // ============================================================================
-class TextParser {
-private:
-    PrologDatabase& db;
+
+// Runs work(0..count-1) on up to workers threads, in no particular order
+template <typename Work>
+static void parallelFor(size_t count, size_t workers, Work work) {
+    atomic<size_t> next{0};
+    mutex failureMutex;
+    exception_ptr failure;
+    vector<thread> threads;
+    for (size_t t = 0; t < min(workers, count); t++) {
+        threads.emplace_back([&] {
+            try {
+                for (size_t k; (k = next.fetch_add(1)) < count;) work(k);
+            } catch (...) {
+                lock_guard<mutex> lock(failureMutex);
+                if (!failure) failure = current_exception();
+                next.store(count);
+            }
+        });
+    }
+    for (thread& worker : threads) worker.join();
+    if (failure) rethrow_exception(failure);
+}
+
+// Runs produce(0..count-1) on the worker threads and consume(k) on this
+// thread in order of k. Producers run ahead of the unit being consumed by
+// at most a window of units, which bounds the memory their output holds.
+template <typename Produce, typename Consume>
+static void orderedParallel(size_t count, size_t workers, Produce produce,
+                            Consume consume) {
+    if (workers <= 1 || count <= 1) {
+        for (size_t k = 0; k < count; k++) {
+            produce(k);
+            consume(k);
+        }
+        return;
+    }
     
-    // Helper function to split a string by delimiter
-    vector<string> split(const string& str, char delimiter) {
-        vector<string> tokens;
-        stringstream ss(str);
-        string token;
-        
-        while (getline(ss, token, delimiter)) {
-            // Trim whitespace from token
-            token.erase(0, token.find_first_not_of(" \t\n\r"));
-            token.erase(token.find_last_not_of(" \t\n\r") + 1);
-            
-            if (!token.empty()) {
-                tokens.push_back(token);
+    mutex stateMutex;
+    condition_variable changed;
+    vector<bool> done(count);
+    size_t next = 0;
+    size_t consumed = 0;
+    size_t window = 2 * workers;
+    exception_ptr failure;
+    auto fail = [&](exception_ptr error) {
+        lock_guard<mutex> lock(stateMutex);
+        if (!failure) failure = error;
+        next = count;
+        changed.notify_all();
+    };
+    
+    vector<thread> threads;
+    for (size_t t = 0; t < workers; t++) {
+        threads.emplace_back([&] {
+            for (;;) {
+                size_t k;
+                {
+                    unique_lock<mutex> lock(stateMutex);
+                    changed.wait(lock, [&] {
+                        return next >= count || next < consumed + window;
+                    });
+                    if (next >= count) return;
+                    k = next++;
+                }
+                try {
+                    produce(k);
+                } catch (...) {
+                    fail(current_exception());
+                    return;
+                }
+                lock_guard<mutex> lock(stateMutex);
+                done[k] = true;
+                changed.notify_all();
+            }
+        });
+    }
+    
+    try {
+        for (size_t k = 0; k < count; k++) {
+            {
+                unique_lock<mutex> lock(stateMutex);
+                changed.wait(lock, [&] { return done[k] || failure; });
+                if (failure) break;
             }
+            consume(k);
+            lock_guard<mutex> lock(stateMutex);
+            consumed++;
+            changed.notify_all();
         }
-        
-        return tokens;
+    } catch (...) {
+        fail(current_exception());
     }
+    for (thread& worker : threads) worker.join();
+    if (failure) rethrow_exception(failure);
+}
+
+// ============================================================================
+// CLASS: CsvLoader
+// Purpose: Bulk loads CSV or TSV exports, one predicate per file and one
+//          fact per line. The mapped file is cut into segments that worker
+//          threads parse and intern in parallel; their blocks of atom ids
+//          are then added in file order through PrologDatabase::addRows.
+//          CSV fields may be quoted ("a, b", with "" for a quote, line
+//          breaks allowed); a quote inside an unquoted field is kept as
+//          text. TSV fields are taken as they are.
+// ============================================================================
+struct LoadStats {
+    uint64_t bytes = 0;
+    uint64_t rows = 0;
+    uint64_t badRows = 0;         // Wrong number of fields, skipped
+    double seconds = 0;
+};
+
+class CsvLoader {
+private:
+    PrologDatabase& db;
+    size_t workerCount = 1;
+    size_t segmentSize = 8 << 20;
+    bool header = false;
+    LoadStats totals;
     
-    // Helper function to convert string to lowercase
-    string toLower(const string& str) {
-        string result = str;
-        transform(result.begin(), result.end(), result.begin(), ::tolower);
-        return result;
+    static constexpr size_t INTERN_BATCH = 16384;   // Fields per internAtoms call
+    static constexpr size_t CACHE_SLOTS = 4096;     // Recently interned fields
+    
+    // Exports repeat values a lot, so each worker remembers the ids of
+    // fields it interned lately and skips the shared atom table for them
+    struct CachedAtom {
+        uint64_t hash = 0;
+        string_view text;
+        uint32_t id = AtomTable::NONE;
+    };
+    
+    // What one segment parsed into
+    struct Block {
+        vector<uint32_t> ids;
+        uint64_t rows = 0;
+        uint64_t badRows = 0;
+        size_t first = 0;                 // Offset of its first record
+        size_t end = 0;                   // Offset just past its last record
+    };
+    
+    // Format of the file being loaded
+    struct Format {
+        char delimiter;
+        bool quoting;
+        size_t arity;
+    };
+    
+    // Where a scan of the file is relative to records and fields, so that
+    // a segment can find its first record. Follows readRecord: a quote
+    // opens a quoted field only at the start of the field.
+    enum ScanState : uint8_t {
+        RECORD_START, FIELD_START, UNQUOTED, QUOTED, QUOTE_SEEN, SCAN_STATES
+    };
+    
+    // Helper function for the scan state after one more byte
+    static ScanState scanByte(ScanState state, char c, const Format& format) {
+        if (state == QUOTED) return c == '"' ? QUOTE_SEEN : QUOTED;
+        if (c == '"' && (state == QUOTE_SEEN ||
+                         (format.quoting && state != UNQUOTED))) {
+            return QUOTED;
+        }
+        if (c == '\n' || c == '\r') return RECORD_START;
+        if (c == format.delimiter) return FIELD_START;
+        return UNQUOTED;
     }
     
-    // Helper function to remove punctuation from end of string
-    string removePunctuation(string str) {
-        while (!str.empty() && ispunct(str.back())) {
-            str.pop_back();
+    // Helper function to advance the scan state over [p, end), jumping over
+    // the inside of fields. With untilRecord it stops at the first record
+    // start instead (a \r\n counts as one line break).
+    // Returns: Where the scan stopped
+    static const char* scanRecords(ScanState& state, const char* p, const char* end,
+                                   const Format& format, bool untilRecord) {
+        while (p < end) {
+            if (untilRecord && state == RECORD_START) {
+                if (p[-1] == '\r' && *p == '\n') p++;
+                return p;
+            }
+            if (state == QUOTED) {
+                const char* quote = static_cast<const char*>(memchr(p, '"', end - p));
+                if (!quote) return end;
+                p = quote;
+            } else if (state == UNQUOTED) {
+                p += findByte<false>(p, end - p, format.delimiter, '\n', '\r',
+                                     format.delimiter);
+                if (p == end) return end;
+            }
+            state = scanByte(state, *p++, format);
         }
-        return str;
+        return p;
     }
     
     // ------------------------------------------------------------------------
-    // METHOD: parseRelationship
-    // Purpose: Parse sentences expressing relationships
-    // Example: "John is the parent of Mary" -> parent(john, mary)
+    // METHOD: readRecord
+    // Purpose: Splits the record starting at p into fields. Fields are views
+    //          into the file, or into decoded for quoted fields with "".
+    // Returns: Start of the next record
     // ------------------------------------------------------------------------
-    void parseRelationship(const vector<string>& words) {
-        // Look for common relationship patterns
-        // Pattern 1: "X is the RELATION of Y"
-        for (size_t i = 0; i < words.size(); i++) {
-            string word = toLower(words[i]);
-            
-            if (word == "is" && i + 3 < words.size() && 
-                toLower(words[i+1]) == "the" && 
-                toLower(words[i+3]) == "of") {
-                
-                string subject = removePunctuation(toLower(words[i-1]));
-                string relation = removePunctuation(toLower(words[i+2]));
-                string object = removePunctuation(toLower(words[i+4]));
+    static const char* readRecord(const char* p, const char* end, const Format& format,
+                                  vector<string_view>& fields, deque<string>& decoded,
+                                  bool& malformed) {
+        fields.clear();
+        malformed = false;
+        for (;;) {
+            if (format.quoting && p < end && *p == '"') {
+                // Quoted field: runs to the next quote not followed by another
+                const char* start = ++p;
+                bool doubled = false;
+                for (;;) {
+                    const char* quote = static_cast<const char*>(
+                        memchr(p, '"', end - p));
+                    if (!quote) {
+                        p = end;
+                        malformed = true;
+                        break;
+                    }
+                    if (quote + 1 < end && quote[1] == '"') {
+                        doubled = true;
+                        p = quote + 2;
+                        continue;
+                    }
+                    p = quote + 1;
+                    break;
+                }
+                string_view field(start, max<ptrdiff_t>(p - 1 - start, 0));
+                if (doubled) {
+                    string text;
+                    text.reserve(field.size());
+                    for (size_t i = 0; i < field.size(); i++) {
+                        text += field[i];
+                        if (field[i] == '"') i++;
+                    }
+                    decoded.push_back(move(text));
+                    field = decoded.back();
+                }
+                fields.push_back(field);
                 
-                db.addFact(relation, {subject, object});
-                return;
+                // Anything between the closing quote and the delimiter is junk
+                if (p < end && *p != format.delimiter && *p != '\n' && *p != '\r') {
+                    malformed = true;
+                    p += findByte<false>(p, end - p, format.delimiter, '\n', '\r',
+                                         format.delimiter);
+                }
+            } else {
+                size_t length = findByte<false>(p, end - p, format.delimiter, '\n',
+                                                '\r', format.delimiter);
+                fields.emplace_back(p, length);
+                p += length;
+            }
+            
+            if (p < end && *p == format.delimiter) {
+                p++;
+                continue;
             }
+            
+            // End of record: \n, \r\n or the end of the file
+            if (p < end && *p == '\r') p++;
+            if (p < end && *p == '\n') p++;
+            return p;
         }
+    }
+    
+    // Helper function to parse the records that start in [from, to) and
+    // intern their fields. state is the scan state at from; the first
+    // record is the first one starting at or after from.
+    void parseSegment(const char* data, size_t size, size_t from, size_t to,
+                      ScanState state, const Format& format, Block& block) {
+        const char* end = data + size;
+        const char* p = data + from;
+        if (from > 0) p = scanRecords(state, p, end, format, true);
+        block.first = p - data;
         
-        // Pattern 2: "X RELATION Y" (e.g., "John likes Mary")
-        if (words.size() >= 3) {
-            string subject = removePunctuation(toLower(words[0]));
-            string relation = removePunctuation(toLower(words[1]));
-            string object = removePunctuation(toLower(words[2]));
-            
-            db.addFact(relation, {subject, object});
+        vector<string_view> fields;
+        deque<string> decoded;
+        vector<CachedAtom> cache(CACHE_SLOTS);
+        vector<string_view> pending;      // Fields not found in the cache
+        vector<uint64_t> pendingHashes;
+        vector<size_t> pendingSlots;      // Where their ids go in block.ids
+        vector<uint32_t> interned;
+        auto internPending = [&] {
+            interned.resize(pending.size());
+            db.internAtoms(pending.data(), pending.size(), interned.data());
+            for (size_t i = 0; i < pending.size(); i++) {
+                block.ids[pendingSlots[i]] = interned[i];
+                
+                // Decoded fields do not outlive this batch, so are not cached
+                if (pending[i].data() >= data && pending[i].data() < end) {
+                    cache[pendingHashes[i] & (CACHE_SLOTS - 1)] =
+                        {pendingHashes[i], pending[i], interned[i]};
+                }
+            }
+            pending.clear();
+            pendingHashes.clear();
+            pendingSlots.clear();
+            decoded.clear();
+        };
+        
+        while (p < end && static_cast<size_t>(p - data) < to) {
+            bool malformed;
+            const char* next = readRecord(p, end, format, fields, decoded, malformed);
+            bool blank = fields.size() == 1 && fields[0].empty() && !malformed &&
+                         *p != '"';
+            p = next;
+            if (blank) continue;
+            if (malformed || fields.size() != format.arity) {
+                block.badRows++;
+                continue;
+            }
+            for (string_view field : fields) {
+                uint64_t hash = hashBytes(field.data(), field.size());
+                const CachedAtom& cached = cache[hash & (CACHE_SLOTS - 1)];
+                if (cached.id != AtomTable::NONE && cached.hash == hash &&
+                    cached.text == field) {
+                    block.ids.push_back(cached.id);
+                    continue;
+                }
+                pendingSlots.push_back(block.ids.size());
+                block.ids.push_back(AtomTable::NONE);
+                pending.push_back(field);
+                pendingHashes.push_back(hash);
+            }
+            block.rows++;
+            if (pending.size() >= INTERN_BATCH) internPending();
         }
+        internPending();
+        block.end = p - data;
     }
+
+public:
+    explicit CsvLoader(PrologDatabase& database) : db(database) {}
+    
+    // Number of parsing threads
+    void setWorkers(size_t count) { workerCount = max<size_t>(count, 1); }
+    
+    // Whether the first line of each file names the columns (and is skipped)
+    void setHeader(bool skipFirstLine) { header = skipFirstLine; }
+    
+    // Bytes per parallel work unit
+    void setSegmentSize(size_t bytes) { segmentSize = max<size_t>(bytes, 1); }
+    
+    const LoadStats& stats() const { return totals; }
     
     // ------------------------------------------------------------------------
-    // METHOD: parseProperty
-    // Purpose: Parse sentences expressing properties/attributes
-    // Example: "John is tall" -> tall(john)
+    // METHOD: loadFile
+    // Purpose: Loads one CSV/TSV file into the database
+    // Parameters:
+    //   - path: The file; *.tsv and *.tab are tab separated, others CSV
+    //   - predicate: Defaults to the file name without its extension
+    // Returns: Number of rows added
+    // Throws runtime_error if the file cannot be opened
     // ------------------------------------------------------------------------
-    void parseProperty(const vector<string>& words) {
-        if (words.size() >= 3 && toLower(words[1]) == "is") {
-            string subject = removePunctuation(toLower(words[0]));
-            string property = removePunctuation(toLower(words[2]));
-            
-            // Check if it's a property (adjective) or a noun
-            // For simplicity, we treat everything after "is" as a property
-            db.addFact(property, {subject});
+    uint64_t loadFile(const string& path, string predicate = "") {
+        auto started = chrono::steady_clock::now();
+        MappedFile file(path);
+        const char* data = file.data();
+        size_t size = file.size();
+        
+        string name = path.substr(path.find_last_of('/') + 1);
+        size_t dot = name.find_last_of('.');
+        string extension = dot == string::npos ? "" : toLowerAscii(name.substr(dot));
+        if (predicate.empty()) predicate = name.substr(0, dot);
+        
+        Format format;
+        format.delimiter = extension == ".tsv" || extension == ".tab" ? '\t' : ',';
+        format.quoting = format.delimiter == ',';
+        
+        // The first record fixes the number of columns
+        vector<string_view> fields;
+        deque<string> decoded;
+        bool malformed;
+        const char* body = readRecord(data, data + size, format, fields, decoded,
+                                      malformed);
+        format.arity = fields.size();
+        size_t start = header ? body - data : 0;
+        
+        size_t segments = size > start ? (size - start + segmentSize - 1) / segmentSize
+                                       : 0;
+        vector<Block> blocks(segments);
+        auto segmentEnd = [&](size_t k) {
+            return min(start + (k + 1) * segmentSize, size);
+        };
+        
+        // Added blocks must follow on from each other. A block whose first
+        // record is not where the previous one ended guessed its start
+        // wrong, and is parsed again from there.
+        size_t parsedEnd = start;
+        uint64_t rows = 0;
+        auto add = [&](size_t k) {
+            Block& block = blocks[k];
+            if (block.first != parsedEnd) {
+                block = Block();
+                parseSegment(data, size, parsedEnd, segmentEnd(k), RECORD_START,
+                             format, block);
+            }
+            parsedEnd = block.end;
+            db.addRows(predicate, format.arity, block.ids.data(), block.rows);
+            rows += block.rows;
+            totals.badRows += block.badRows;
+            block.ids = vector<uint32_t>();
+        };
+        
+        if (workerCount == 1 || segments <= 1) {
+            for (size_t k = 0; k < segments; k++) {
+                parseSegment(data, size, parsedEnd, segmentEnd(k), RECORD_START,
+                             format, blocks[k]);
+                add(k);
+            }
+        } else {
+            // The scan state each segment starts in: every segment is
+            // scanned from every state, then the states are chained
+            vector<array<ScanState, SCAN_STATES>> after(segments);
+            parallelFor(segments, workerCount, [&](size_t k) {
+                for (int s = 0; s < SCAN_STATES; s++) {
+                    ScanState state = static_cast<ScanState>(s);
+                    scanRecords(state, data + start + k * segmentSize,
+                                data + segmentEnd(k), format, false);
+                    after[k][s] = state;
+                }
+            });
+            vector<ScanState> startState(segments, RECORD_START);
+            for (size_t k = 1; k < segments; k++) {
+                startState[k] = after[k - 1][startState[k - 1]];
+            }
+            auto parse = [&](size_t k) {
+                parseSegment(data, size, start + k * segmentSize, segmentEnd(k),
+                             startState[k], format, blocks[k]);
+            };
+            // Workers parse ahead of the blocks being added
+            orderedParallel(segments, workerCount, parse, add);
+        }
+        
+        totals.bytes += size;
+        totals.rows += rows;
+        totals.seconds += chrono::duration<double>(
+            chrono::steady_clock::now() - started).count();
+        return rows;
+    }
+};
+
+// ============================================================================
+// CLASS: FactExporter
+// Purpose: Streams the whole database, or chosen predicates, to a file as
+//          Prolog facts, CSV or JSON Lines. Everything is read under one
+//          snapshot, so the export is consistent while writers go on.
+//          Worker threads format ranges of facts into large buffers that
+//          are written out in order, optionally through a compressor.
+//          Prolog output writes numbers and compound or list arguments as
+//          terms, e.g. p(-7, f(x), [a,b]), and every other argument as an
+//          atom, so consulting it gives back the same facts.
+// Example: parent(john, mary) is written as
+//          Prolog:     parent(john,mary).
+//          CSV:        parent,john,mary
+//          JSON Lines: {"predicate":"parent","args":["john","mary"]}
+// ============================================================================
+enum class ExportFormat {
+    Prolog,
+    Csv,                          // Predicate name first, then the arguments
+    JsonLines
+};
+
+struct ExportStats {
+    uint64_t predicates = 0;
+    uint64_t facts = 0;
+    uint64_t bytes = 0;           // Before compression
+    double seconds = 0;
+};
+
+class FactExporter {
+private:
+    PrologDatabase& db;
+    ExportFormat format = ExportFormat::Prolog;
+    size_t workerCount = 1;
+    string compressor;
+    unordered_set<string> wanted;     // "name" or "name/arity"; empty = all
+    ExportStats totals;
+    
+    static constexpr size_t RANGE_ROWS = 65536;      // Facts per work unit
+    static constexpr size_t OUTPUT_BUFFER = 4 << 20;
+    
+    // Formatted text of one range
+    struct Chunk {
+        string text;
+        uint64_t facts = 0;
+    };
+    
+    // Helper function to append an atom in Prolog syntax
+    static void appendAtom(string& out, string_view text) {
+        if (plainPrologAtom(text)) {
+            out += text;
+        } else {
+            appendPrologQuoted(out, text, '\'');
+        }
+    }
+    
+    // Helper function to append an argument in Prolog syntax. Numbers and
+    // the canonical text of compounds and lists are written as they are,
+    // so they read back as terms; the reader checks those that might be one.
+    static void appendArgument(string& out, string_view text, PrologReader& reader) {
+        size_t digits = 0;
+        while (digits < text.size() && hasCharClass(text[digits], CHAR_DIGIT)) digits++;
+        bool term = digits == text.size() ||
+            ((digits > 0 || text.front() == '-' || text.back() == ')' ||
+              text.back() == ']') &&
+             !plainPrologAtom(text) && reader.readsBackUnquoted(text));
+        if (term && !text.empty()) {
+            out += text;
+        } else {
+            appendAtom(out, text);
+        }
+    }
+    
+    // Helper function to append a CSV field, quoted only if it must be
+    static void appendCsvField(string& out, string_view text) {
+        if (text.find_first_of(",\"\n\r") == string_view::npos) {
+            out += text;
+            return;
+        }
+        out += '"';
+        for (char c : text) {
+            if (c == '"') out += '"';
+            out += c;
+        }
+        out += '"';
+    }
+    
+    // Helper function to append a JSON string
+    static void appendJsonString(string& out, string_view text) {
+        static const char HEX[] = "0123456789abcdef";
+        out += '"';
+        size_t from = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            unsigned char c = text[i];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            out.append(text.data() + from, i - from);
+            from = i + 1;
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    out += "\\u00";
+                    out += HEX[c >> 4];
+                    out += HEX[c & 15];
+            }
         }
+        out.append(text.data() + from, text.size() - from);
+        out += '"';
     }
     
     // ------------------------------------------------------------------------
-    // METHOD: parseLivesIn
-    // Purpose: Parse location-based sentences
-    // Example: "John lives in Paris" -> lives_in(john, paris)
+    // METHOD: formatRange
+    // Purpose: Formats the visible facts of one range into chunk
     // ------------------------------------------------------------------------
-    void parseLivesIn(const vector<string>& words) {
-        for (size_t i = 0; i < words.size(); i++) {
-            if (toLower(words[i]) == "lives" && i + 2 < words.size() &&
-                toLower(words[i+1]) == "in") {
-                
-                string subject = removePunctuation(toLower(words[i-1]));
-                string location = removePunctuation(toLower(words[i+2]));
-                
-                db.addFact("lives_in", {subject, location});
-                return;
+    void formatRange(const PrologDatabase::FactRange& range,
+                     const PrologDatabase::Snapshot& view, Chunk& chunk) const {
+        // The predicate part is the same for every line of the range
+        PrologReader reader(db);
+        string head;
+        switch (format) {
+            case ExportFormat::Prolog:
+                appendAtom(head, range.predicate);
+                break;
+            case ExportFormat::Csv:
+                appendCsvField(head, range.predicate);
+                break;
+            case ExportFormat::JsonLines:
+                head += "{\"predicate\":";
+                appendJsonString(head, range.predicate);
+                head += ",\"args\":[";
+                break;
+        }
+        
+        string& out = chunk.text;
+        db.forEachFact(range, view, [&](const string_view* args) {
+            out += head;
+            switch (format) {
+                case ExportFormat::Prolog:
+                    for (size_t i = 0; i < range.arity; i++) {
+                        out += i ? ',' : '(';
+                        appendArgument(out, args[i], reader);
+                    }
+                    out += range.arity ? ").\n" : ".\n";
+                    break;
+                case ExportFormat::Csv:
+                    for (size_t i = 0; i < range.arity; i++) {
+                        out += ',';
+                        appendCsvField(out, args[i]);
+                    }
+                    out += '\n';
+                    break;
+                case ExportFormat::JsonLines:
+                    for (size_t i = 0; i < range.arity; i++) {
+                        if (i) out += ',';
+                        appendJsonString(out, args[i]);
+                    }
+                    out += "]}\n";
+                    break;
+            }
+            chunk.facts++;
+        });
+    }
+    
+    // Helper function to quote a path for the shell
+    static string shellQuote(const string& text) {
+        string quoted = "'";
+        for (char c : text) {
+            if (c == '\'') {
+                quoted += "'\\''";
+            } else {
+                quoted += c;
             }
         }
+        return quoted + "'";
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: openOutput
+    // Purpose: Opens the output file, or a pipe into the compressor that
+    //          writes it; "-" is standard output
+    // ------------------------------------------------------------------------
+    FILE* openOutput(const string& path) const {
+        if (path == "-") cout.flush();
+        if (compressor.empty()) {
+            if (path == "-") return stdout;
+            FILE* file = fopen(path.c_str(), "wb");
+            if (!file) throw runtime_error("Cannot create export file: " + path);
+            return file;
+        }
+#ifdef PROLOG_HAVE_POSIX
+        string command = compressor;
+        if (path != "-") command += " > " + shellQuote(path);
+        FILE* pipe = popen(command.c_str(), "w");
+        if (!pipe) throw runtime_error("Cannot start compressor: " + compressor);
+        return pipe;
+#else
+        throw runtime_error("Compressed export is not supported on this platform");
+#endif
+    }
+    
+    // Helper function to close the output, reporting a failed write
+    void closeOutput(FILE* out, const string& path, bool failed) const {
+        failed |= fflush(out) != 0 || ferror(out);
+        if (!compressor.empty()) {
+#ifdef PROLOG_HAVE_POSIX
+            failed |= pclose(out) != 0;
+#endif
+        } else if (out != stdout) {
+            failed |= fclose(out) != 0;
+        }
+        if (failed) throw runtime_error("Error writing export file: " + path);
     }
 
 public:
-    // Constructor: Initialize with a reference to the database
-    TextParser(PrologDatabase& database) : db(database) {}
+    explicit FactExporter(PrologDatabase& database) : db(database) {}
+    
+    void setFormat(ExportFormat outputFormat) { format = outputFormat; }
+    
+    // Number of formatting threads
+    void setWorkers(size_t count) { workerCount = max<size_t>(count, 1); }
+    
+    // Shell command the output is piped through, e.g. "gzip -1" or "zstd";
+    // empty to write the file directly
+    void setCompressor(const string& command) { compressor = command; }
+    
+    // Restricts the export to a predicate, given as "name" for every arity
+    // or "name/arity"; without any, everything is exported
+    void addPredicate(const string& predicate) {
+        wanted.insert(toLowerAscii(predicate));
+    }
+    
+    const ExportStats& stats() const { return totals; }
     
     // ------------------------------------------------------------------------
-    // METHOD: parseText
-    // Purpose: Main parsing function - determines sentence type and calls
-    //          appropriate parsing method
+    // METHOD: exportTo
+    // Purpose: Writes the selected facts to a file
     // Parameters:
-    //   - text: The natural language sentence to parse
+    //   - path: The output file; "-" for standard output
+    // Returns: Number of facts written
+    // Throws runtime_error if the file cannot be written
     // ------------------------------------------------------------------------
-    void parseText(const string& text) {
-        cout << "\nParsing: \"" << text << "\"" << endl;
+    uint64_t exportTo(const string& path) {
+        auto started = chrono::steady_clock::now();
+        PrologDatabase::Snapshot view = db.snapshot();
         
-        // Split the text into words
-        vector<string> words = split(text, ' ');
+        string key;
+        vector<PrologDatabase::FactRange> ranges = db.factRanges(
+            [&](string_view name, size_t arity) {
+                if (wanted.empty()) return true;
+                key.assign(name);
+                if (wanted.count(key)) return true;
+                key += '/';
+                key += to_string(arity);
+                return wanted.count(key) > 0;
+            }, RANGE_ROWS);
         
-        if (words.empty()) {
-            cout << "Empty sentence, nothing to parse.\n";
-            return;
+        FILE* out = openOutput(path);
+        vector<char> buffer;
+        if (out != stdout) {
+            buffer.resize(OUTPUT_BUFFER);
+            setvbuf(out, buffer.data(), _IOFBF, buffer.size());
         }
         
-        // Determine the type of sentence and parse accordingly
-        string textLower = toLower(text);
+        vector<Chunk> chunks(ranges.size());
+        uint64_t facts = 0;
+        bool failed = false;
+        auto write = [&](size_t k) {
+            Chunk& chunk = chunks[k];
+            if (!failed && fwrite(chunk.text.data(), 1, chunk.text.size(), out) !=
+                           chunk.text.size()) {
+                failed = true;
+            }
+            if (k == 0 || ranges[k].predicate != ranges[k - 1].predicate ||
+                ranges[k].arity != ranges[k - 1].arity) {
+                totals.predicates++;
+            }
+            facts += chunk.facts;
+            totals.bytes += chunk.text.size();
+            chunk.text = string();
+        };
         
-        // Check for "lives in" pattern
-        if (textLower.find("lives in") != string::npos) {
-            parseLivesIn(words);
-        }
-        // Check for "is the ... of" pattern (relationships)
-        else if (textLower.find("is the") != string::npos && 
-                 textLower.find(" of ") != string::npos) {
-            parseRelationship(words);
-        }
-        // Check for simple "is" pattern (properties or relationships)
-        else if (textLower.find(" is ") != string::npos) {
-            // Try to determine if it's a property or relationship
-            if (words.size() == 3) {
-                parseProperty(words);
-            } else {
-                parseRelationship(words);
+        // Workers format ahead of the chunk being written. They read under
+        // this thread's snapshot, which outlives them.
+        auto formatChunk = [&](size_t k) { formatRange(ranges[k], view, chunks[k]); };
+        try {
+            orderedParallel(ranges.size(), workerCount, formatChunk, write);
+        } catch (...) {
+            // The output is closed before the error is passed on
+            try {
+                closeOutput(out, path, true);
+            } catch (const runtime_error&) {
             }
+            throw;
         }
-        // Default: assume it's a simple relationship
-        else if (words.size() >= 3) {
-            parseRelationship(words);
-        }
-        else {
-            cout << "Could not parse sentence pattern.\n";
-        }
+        
+        closeOutput(out, path, failed);
+        totals.facts += facts;
+        totals.seconds += chrono::duration<double>(
+            chrono::steady_clock::now() - started).count();
+        return facts;
     }
 };
 
@@ -305,19 +8830,18 @@ public:
 class QueryEngine {
 private:
     PrologDatabase& db;
+    ostream* out = &cout;                 // Where answers are written
+    QueryProfile* profile = nullptr;      // Set while explaining a question
+    uint64_t stageStart = 0;              // When the current stage began
     
     // Helper function to convert string to lowercase
     string toLower(const string& str) {
-        string result = str;
-        transform(result.begin(), result.end(), result.begin(), ::tolower);
-        return result;
+        return toLowerAscii(str);
     }
     
     // Helper function to remove punctuation
     string removePunctuation(string str) {
-        while (!str.empty() && ispunct(str.back())) {
-            str.pop_back();
-        }
+        str.resize(stripTrailingPunct(str).size());
         return str;
     }
 
@@ -325,6 +8849,9 @@ public:
     // Constructor
     QueryEngine(PrologDatabase& database) : db(database) {}
     
+    // Redirects the answers, e.g. into a server response
+    void setOutput(ostream& stream) { out = &stream; }
+    
     // ------------------------------------------------------------------------
     // METHOD: processQuery
     // Purpose: Converts a natural language question into a PROLOG query
@@ -332,24 +8859,88 @@ public:
     //   - question: Natural language question to process
     // ------------------------------------------------------------------------
     void processQuery(const string& question) {
-        cout << "\nQuery: \"" << question << "\"" << endl;
+        Metrics& metrics = Metrics::instance();
+        uint64_t started = metrics.enabled() ? Metrics::now() : 0;
+        TraceScope scope("processQuery", "engine");
+        answer(question);
+        if (metrics.enabled()) {
+            metrics.record(metrics.processQueryLatency, Metrics::now() - started);
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: explain
+    // Purpose: EXPLAIN ANALYZE for a question: answers it and returns the
+    //          profile of every stage and of every goal it looked up, with
+    //          the answer captured in the profile instead of printed
+    // Parameters:
+    //   - question: Natural language question to profile
+    // ------------------------------------------------------------------------
+    QueryProfile explain(const string& question) {
+        QueryProfile result;
+        result.question = question;
+        ostringstream captured;
+        ostream* previous = out;
+        out = &captured;
+        profile = &result;
+        
+        AllocationTotals before = threadAllocations;
+        uint64_t started = Metrics::now();
+        stageStart = started;
+        answer(question);
+        uint64_t finished = Metrics::now();
+        result.stages.emplace_back(result.goals.empty() ? "understand question"
+                                                        : "format answer",
+                                   finished - stageStart);
+        result.nanos = finished - started;
+        result.allocated = threadAllocations - before;
+        
+        profile = nullptr;
+        out = previous;
+        result.answer = captured.str();
+        return result;
+    }
+    
+private:
+    // Helper function to look up one goal, profiled while explaining
+    vector<vector<string>> lookup(const string& predicate,
+                                  const vector<string>& arguments) {
+        if (!profile) return db.query(predicate, arguments);
+        
+        uint64_t started = Metrics::now();
+        profile->stages.emplace_back(profile->goals.empty() ? "understand question"
+                                                            : "combine goals",
+                                     started - stageStart);
+        profile->goals.emplace_back();
+        auto results = db.profileQuery(predicate, arguments, profile->goals.back());
+        stageStart = Metrics::now();
+        profile->stages.emplace_back("goal " + to_string(profile->goals.size()),
+                                     stageStart - started);
+        return results;
+    }
+    
+    // Helper function to answer one question; see processQuery
+    void answer(const string& question) {
+        *out << "\nQuery: \"" << question << "\"" << endl;
         
         string questionLower = toLower(question);
         
         // Pattern 1: "Who is the RELATION of X?"
         if (questionLower.find("who is the") != string::npos) {
+            TraceScope branch("pattern: who is the R of X", "pattern");
             size_t pos = questionLower.find("of ");
             if (pos != string::npos) {
                 string relation = extractRelation(questionLower);
                 string object = extractObject(questionLower, pos + 3);
                 
                 // Query with wildcard for subject
-                auto results = db.query(relation, {"?", object});
+                auto results = lookup(relation, {"?", object});
                 printResults(results, "Who", 0);
             }
         }
         // Pattern 2: "What does X RELATION?"
         else if (questionLower.find("what does") != string::npos) {
+            TraceScope branch("pattern: what does X R", "pattern");
             size_t pos = questionLower.find("what does ");
             string rest = questionLower.substr(pos + 10);
             
@@ -362,15 +8953,18 @@ public:
             
             if (words.size() >= 2) {
                 string subject = words[0];
-                string relation = words[1];
-                
-                auto results = db.query(relation, {subject, "?"});
+                auto results = lookup(words[1], {subject, "?"});
+                // "does" carries the tense: "What does X like?" asks likes/2
+                if (results.empty()) {
+                    results = lookup(thirdPerson(words[1]), {subject, "?"});
+                }
                 printResults(results, "Answer", 1);
             }
         }
         // Pattern 3: "Where does X live?"
         else if (questionLower.find("where does") != string::npos &&
                  questionLower.find("live") != string::npos) {
+            TraceScope branch("pattern: where does X live", "pattern");
             size_t pos = questionLower.find("where does ");
             string rest = questionLower.substr(pos + 11);
             
@@ -379,11 +8973,12 @@ public:
             ss >> subject;
             subject = removePunctuation(toLower(subject));
             
-            auto results = db.query("lives_in", {subject, "?"});
+            auto results = lookup("lives_in", {subject, "?"});
             printResults(results, "Location", 1);
         }
         // Pattern 4: "Is X PROPERTY?" or "Is X RELATION Y?"
         else if (questionLower.find("is ") == 0) {
+            TraceScope branch("pattern: is X P / is X R Y", "pattern");
             vector<string> words;
             stringstream ss(questionLower);
             string word;
@@ -395,27 +8990,31 @@ public:
                 string subject = words[1];
                 string property = words[2];
                 
-                auto results = db.query(property, {subject});
+                auto results = lookup(property, {subject});
                 if (!results.empty()) {
-                    cout << "Answer: Yes\n";
+                    *out << "Answer: Yes\n";
                 } else {
-                    cout << "Answer: No (or unknown)\n";
+                    *out << "Answer: No (or unknown)\n";
                 }
-            } else if (words.size() >= 4) { // "Is X RELATION Y?"
+            } else if (words.size() >= 4) { // "Is X [the] RELATION [of] Y?"
                 string subject = words[1];
                 string relation = words[2];
                 string object = words[3];
+                if (words.size() >= 6 && words[2] == "the" && words[4] == "of") {
+                    relation = words[3];
+                    object = words[5];
+                }
                 
-                auto results = db.query(relation, {subject, object});
+                auto results = lookup(relation, {subject, object});
                 if (!results.empty()) {
-                    cout << "Answer: Yes\n";
+                    *out << "Answer: Yes\n";
                 } else {
-                    cout << "Answer: No (or unknown)\n";
+                    *out << "Answer: No (or unknown)\n";
                 }
             }
         }
         else {
-            cout << "Could not understand query format.\n";
+            *out << "Could not understand query format.\n";
         }
     }
     
@@ -431,6 +9030,23 @@ private:
         return "";
     }
     
+    // Helper function to turn a verb into its third person singular form,
+    // the way statements name their relations: like -> likes
+    static string thirdPerson(const string& verb) {
+        if (verb.empty()) return verb;
+        size_t n = verb.size();
+        char last = verb[n - 1];
+        if (last == 's' || last == 'x' || last == 'z' || last == 'o' ||
+            (n >= 2 && (verb.compare(n - 2, 2, "ch") == 0 ||
+                        verb.compare(n - 2, 2, "sh") == 0))) {
+            return verb + "es";
+        }
+        if (last == 'y' && n >= 2 && !strchr("aeiou", verb[n - 2])) {
+            return verb.substr(0, n - 1) + "ies";
+        }
+        return verb + "s";
+    }
+    
     // Helper function to extract object from question
     string extractObject(const string& question, size_t startPos) {
         string rest = question.substr(startPos);
@@ -444,34 +9060,1101 @@ private:
     void printResults(const vector<vector<string>>& results, 
                      const string& label, size_t index) {
         if (results.empty()) {
-            cout << "Answer: No matches found.\n";
+            *out << "Answer: No matches found.\n";
         } else {
-            cout << label << ":\n";
+            *out << label << ":\n";
             for (const auto& result : results) {
                 if (index < result.size()) {
-                    cout << "  - " << result[index] << endl;
+                    *out << "  - " << result[index] << endl;
+                }
+            }
+        }
+    }
+};
+
+#ifdef PROLOG_HAVE_EPOLL
+// ============================================================================
+// CLASS: QueryServer
+// Purpose: Shares one loaded database with many client processes over a
+//          Unix domain socket or localhost TCP. An epoll event loop does
+//          all socket I/O; a pool of worker threads runs the requests.
+//          A request is one line of tab separated fields (a tab, line
+//          break or backslash inside a field is written \t, \n, \\):
+//            query         PREDICATE ARG...   ("?" is a wildcard)
+//            addFact       PREDICATE ARG...
+//            parseText     TEXT
+//            processQuery  QUESTION
+//            metrics       [json]
+//          The response is "OK N" and N lines (query: one fact per line,
+//          fields tab separated; parseText: the number of facts added;
+//          processQuery: the answer; metrics: the report), or "ERR MESSAGE".
+//          Clients may pipeline requests; responses come back in request
+//          order. The requests of one connection take effect in order:
+//          reads run in parallel, but a write waits for the reads before
+//          it and holds back the requests after it. Lookups of the same
+//          predicate that are queued together are answered as one batch.
+// Example: printf 'query\tparent\t?\tmary\n' | nc -U /tmp/prolog.sock
+//          -> OK 1 / john
+// ============================================================================
+class QueryServer {
+private:
+    enum class Command : uint8_t {
+        Query, AddFact, ParseText, ProcessQuery, Metrics, Invalid
+    };
+    
+    struct Request {
+        uint64_t connection;
+        uint64_t sequence;
+        Command command;
+        vector<string> fields;        // After the command; Invalid: the error
+    };
+    
+    // A finished request on its way back to the event loop
+    struct Reply {
+        uint64_t connection;
+        uint64_t sequence;
+        bool write;
+        string text;
+    };
+    
+    // State of one client; owned by the event loop thread
+    struct Connection {
+        int fd = -1;
+        string input;
+        string output;
+        size_t written = 0;               // Of output
+        deque<Request> waiting;           // Parsed, not yet handed to workers
+        map<uint64_t, string> finished;   // Replies that are not next in line
+        uint64_t nextSequence = 0;        // Of the next request parsed
+        uint64_t nextReply = 0;           // Of the next reply to send
+        size_t running = 0;
+        bool writeRunning = false;
+        bool endOfInput = false;          // Close once everything is answered
+        bool failed = false;              // Close now
+        uint32_t events = 0;              // Registered with epoll
+    };
+    
+    static constexpr uint64_t LISTEN_ID = 0;
+    static constexpr uint64_t WAKE_ID = 1;
+    static constexpr size_t MAX_PIPELINE = 1024;     // Unanswered per client
+    static constexpr size_t MAX_LINE = 1 << 20;
+    static constexpr size_t MAX_OUTPUT = 4 << 20;    // Unsent per client
+    static constexpr size_t MAX_BATCH = 256;         // Requests per worker pass
+    
+    PrologDatabase& db;
+    const TextParser& prototype;          // Copied by each worker
+    size_t workerCount = 1;
+    
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    bool tcp = false;
+    string socketPath;                    // Removed again on close
+    atomic<bool> stopping{false};
+    
+    unordered_map<uint64_t, Connection> connections;
+    uint64_t nextConnection = WAKE_ID + 1;
+    
+    mutex queueMutex;
+    condition_variable queueReady;
+    deque<Request> queue;
+    bool shutdown = false;
+    
+    mutex replyMutex;
+    vector<Reply> replies;
+    
+    static bool isWrite(Command command) {
+        return command == Command::AddFact || command == Command::ParseText;
+    }
+    
+    // Helper function to undo the escaping of a field
+    static string unescapeField(string_view text) {
+        string field;
+        field.reserve(text.size());
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] != '\\' || i + 1 == text.size()) {
+                field += text[i];
+                continue;
+            }
+            char c = text[++i];
+            field += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+        }
+        return field;
+    }
+    
+    // Helper function to append a field, escaped
+    static void appendField(string& out, string_view text) {
+        for (char c : text) {
+            switch (c) {
+                case '\\': out += "\\\\"; break;
+                case '\t': out += "\\t"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                default: out += c;
+            }
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: parseRequest
+    // Purpose: Splits one request line into its command and fields
+    // ------------------------------------------------------------------------
+    static Request parseRequest(string_view line) {
+        Request request{0, 0, Command::Invalid, {}};
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        
+        size_t tab = line.find('\t');
+        string command = toLowerAscii(string(line.substr(0, tab)));
+        while (tab != string_view::npos) {
+            size_t next = line.find('\t', tab + 1);
+            request.fields.push_back(unescapeField(
+                line.substr(tab + 1, next == string_view::npos ? next : next - tab - 1)));
+            tab = next;
+        }
+        
+        if (command == "query") {
+            request.command = Command::Query;
+        } else if (command == "addfact") {
+            request.command = Command::AddFact;
+        } else if (command == "parsetext") {
+            request.command = Command::ParseText;
+        } else if (command == "processquery") {
+            request.command = Command::ProcessQuery;
+        } else if (command == "metrics") {
+            request.command = Command::Metrics;
+            return request;
+        } else {
+            request.fields = {"unknown command: " + command};
+            return request;
+        }
+        if (request.fields.empty() || request.fields[0].empty()) {
+            request.command = Command::Invalid;
+            request.fields = {"missing argument"};
+        }
+        return request;
+    }
+    
+    // Helper function to turn printed text into a reply, one line per line
+    static string linesReply(const string& printed) {
+        string lines;
+        size_t count = 0;
+        istringstream output(printed);
+        for (string line; getline(output, line);) {
+            if (line.empty()) continue;
+            appendField(lines, line);
+            lines += '\n';
+            count++;
+        }
+        return "OK " + to_string(count) + "\n" + lines;
+    }
+    
+    // Helper function to format the rows of a query as a reply
+    static string queryReply(const vector<vector<string>>& rows) {
+        string text = "OK " + to_string(rows.size()) + "\n";
+        for (const auto& row : rows) {
+            for (size_t i = 0; i < row.size(); i++) {
+                if (i) text += '\t';
+                appendField(text, row[i]);
+            }
+            text += '\n';
+        }
+        return text;
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: workerLoop
+    // Purpose: Takes requests off the queue a batch at a time and runs them.
+    //          Queries in a batch are grouped by predicate and arity and
+    //          each group is answered by one PrologDatabase::queryBatch.
+    // ------------------------------------------------------------------------
+    void workerLoop() {
+        Tracer::instance().setThreadName("server worker");
+        TextParser parser(prototype);
+        parser.setVerbose(false);
+        QueryEngine engine(db);
+        ostringstream answer;
+        engine.setOutput(answer);
+        
+        vector<Request> batch;
+        vector<Reply> finished;
+        map<pair<string, size_t>, vector<size_t>> groups;
+        for (;;) {
+            batch.clear();
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueReady.wait(lock, [&] { return shutdown || !queue.empty(); });
+                if (shutdown) return;
+                while (!queue.empty() && batch.size() < MAX_BATCH) {
+                    batch.push_back(move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+            
+            finished.clear();
+            groups.clear();
+            for (size_t k = 0; k < batch.size(); k++) {
+                Request& request = batch[k];
+                finished.push_back({request.connection, request.sequence,
+                                    isWrite(request.command), ""});
+                string& text = finished.back().text;
+                try {
+                    switch (request.command) {
+                        case Command::Query:
+                            groups[{toLowerAscii(request.fields[0]),
+                                    request.fields.size() - 1}].push_back(k);
+                            break;
+                        case Command::AddFact: {
+                            vector<string_view> args(request.fields.begin() + 1,
+                                                     request.fields.end());
+                            db.addFact(request.fields[0], args.data(), args.size());
+                            text = "OK 0\n";
+                            break;
+                        }
+                        case Command::ParseText:
+                            text = "OK 1\n" + to_string(parser.parseText(
+                                request.fields[0])) + "\n";
+                            break;
+                        case Command::ProcessQuery:
+                            answer.str("");
+                            engine.processQuery(request.fields[0]);
+                            text = linesReply(answer.str());
+                            break;
+                        case Command::Metrics: {
+                            bool json = !request.fields.empty() &&
+                                        toLowerAscii(request.fields[0]) == "json";
+                            ostringstream report;
+                            Metrics::instance().write(report, json ? MetricsFormat::Json
+                                                                   : MetricsFormat::Text);
+                            text = linesReply(report.str());
+                            break;
+                        }
+                        case Command::Invalid:
+                            text = "ERR " + request.fields[0] + "\n";
+                            break;
+                    }
+                } catch (const exception& e) {
+                    text = string("ERR ") + e.what() + "\n";
+                }
+            }
+            
+            if (!groups.empty()) {
+                PrologDatabase::Snapshot view = db.snapshot();
+                vector<vector<string>> patterns;
+                for (const auto& group : groups) {
+                    // A failed lookup answers every query of its group
+                    try {
+                        patterns.clear();
+                        for (size_t k : group.second) {
+                            patterns.emplace_back(batch[k].fields.begin() + 1,
+                                                  batch[k].fields.end());
+                        }
+                        auto results = db.queryBatch(group.first.first, patterns, view);
+                        for (size_t i = 0; i < group.second.size(); i++) {
+                            finished[group.second[i]].text = queryReply(results[i]);
+                        }
+                    } catch (const exception& e) {
+                        for (size_t k : group.second) {
+                            finished[k].text = string("ERR ") + e.what() + "\n";
+                        }
+                    }
+                }
+            }
+            
+            {
+                lock_guard<mutex> lock(replyMutex);
+                for (Reply& reply : finished) replies.push_back(move(reply));
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: parseInput
+    // Purpose: Turns the complete lines a client sent into waiting requests,
+    //          stopping while too many of its requests are unanswered
+    // ------------------------------------------------------------------------
+    void parseInput(uint64_t id, Connection& connection) {
+        size_t start = 0;
+        while (connection.nextSequence - connection.nextReply < MAX_PIPELINE) {
+            size_t newline = connection.input.find('\n', start);
+            string_view line;
+            if (newline != string::npos) {
+                line = string_view(connection.input).substr(start, newline - start);
+            } else if (connection.input.size() - start > MAX_LINE) {
+                // The rest of the input cannot be trusted to be in step
+                connection.waiting.push_back({id, connection.nextSequence++,
+                                              Command::Invalid, {"line too long"}});
+                connection.endOfInput = true;
+                start = connection.input.size();
+                break;
+            } else if (connection.endOfInput && start < connection.input.size()) {
+                line = string_view(connection.input).substr(start);
+                newline = connection.input.size() - 1;
+            } else {
+                break;
+            }
+            start = newline + 1;
+            if (line.empty() || line == "\r") continue;
+            
+            Request request = parseRequest(line);
+            request.connection = id;
+            request.sequence = connection.nextSequence++;
+            connection.waiting.push_back(move(request));
+        }
+        connection.input.erase(0, start);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: dispatch
+    // Purpose: Hands waiting requests of a client to the workers as far as
+    //          its ordering allows
+    // ------------------------------------------------------------------------
+    void dispatch(Connection& connection) {
+        vector<Request> ready;
+        while (!connection.waiting.empty() && !connection.writeRunning) {
+            Request& next = connection.waiting.front();
+            if (isWrite(next.command)) {
+                if (connection.running > 0) break;
+                connection.writeRunning = true;
+            }
+            connection.running++;
+            ready.push_back(move(next));
+            connection.waiting.pop_front();
+        }
+        if (ready.empty()) return;
+        
+        lock_guard<mutex> lock(queueMutex);
+        for (Request& request : ready) queue.push_back(move(request));
+        if (ready.size() == 1) {
+            queueReady.notify_one();
+        } else {
+            queueReady.notify_all();
+        }
+    }
+    
+    // Helper function to read what a client sent
+    void receive(Connection& connection) {
+        char buffer[65536];
+        for (;;) {
+            ssize_t got = read(connection.fd, buffer, sizeof(buffer));
+            if (got > 0) {
+                connection.input.append(buffer, got);
+                if (connection.input.size() > 2 * MAX_LINE) return;
+                continue;
+            }
+            if (got == 0) {
+                connection.endOfInput = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connection.failed = true;
+            }
+            return;
+        }
+    }
+    
+    // Helper function to send as much pending output as the socket takes
+    void send(Connection& connection) {
+        while (connection.written < connection.output.size()) {
+            ssize_t sent = ::send(connection.fd, connection.output.data() + connection.written,
+                                  connection.output.size() - connection.written,
+                                  MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) connection.failed = true;
+                break;
+            }
+            connection.written += sent;
+        }
+        if (connection.written == connection.output.size()) {
+            connection.output.clear();
+            connection.written = 0;
+        }
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: service
+    // Purpose: Moves a client forward after anything happened to it: queues
+    //          its finished replies in order, parses and dispatches input,
+    //          sends output, and updates its epoll interest or closes it
+    // ------------------------------------------------------------------------
+    void service(uint64_t id, Connection& connection) {
+        for (auto it = connection.finished.begin();
+             it != connection.finished.end() && it->first == connection.nextReply;
+             it = connection.finished.erase(it)) {
+            connection.output += it->second;
+            connection.nextReply++;
+        }
+        
+        if (!connection.failed) {
+            parseInput(id, connection);
+            dispatch(connection);
+            send(connection);
+        }
+        
+        bool answered = connection.nextReply == connection.nextSequence &&
+                        connection.input.empty();
+        if (connection.failed ||
+            (connection.endOfInput && answered && connection.output.empty())) {
+            // Replies still being worked on are dropped when they arrive
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.fd, nullptr);
+            close(connection.fd);
+            connections.erase(id);
+            return;
+        }
+        
+        uint32_t events = 0;
+        if (!connection.endOfInput &&
+            connection.nextSequence - connection.nextReply < MAX_PIPELINE &&
+            connection.output.size() < MAX_OUTPUT && connection.input.size() <= MAX_LINE) {
+            events |= EPOLLIN;
+        }
+        if (!connection.output.empty()) events |= EPOLLOUT;
+        if (events != connection.events) {
+            epoll_event event{};
+            event.events = events;
+            event.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+            connection.events = events;
+        }
+    }
+    
+    // Helper function to accept every pending client
+    void acceptClients() {
+        for (;;) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;                   // EAGAIN, or out of descriptors
+            }
+            if (tcp) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            uint64_t id = nextConnection++;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = id;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                continue;
+            }
+            Connection& connection = connections[id];
+            connection.fd = fd;
+            connection.events = EPOLLIN;
+        }
+    }
+    
+    // Helper function to hand the replies of the workers to their clients
+    void collectReplies() {
+        uint64_t count;
+        ssize_t ignored = read(wakeFd, &count, sizeof(count));
+        (void)ignored;
+        
+        vector<Reply> ready;
+        {
+            lock_guard<mutex> lock(replyMutex);
+            ready.swap(replies);
+        }
+        vector<uint64_t> touched;
+        for (Reply& reply : ready) {
+            auto it = connections.find(reply.connection);
+            if (it == connections.end()) continue;
+            Connection& connection = it->second;
+            connection.running--;
+            if (reply.write) connection.writeRunning = false;
+            connection.finished.emplace(reply.sequence, move(reply.text));
+            touched.push_back(reply.connection);
+        }
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for (uint64_t id : touched) {
+            auto it = connections.find(id);
+            if (it != connections.end()) service(id, it->second);
+        }
+    }
+    
+    // Helper function to create the listening socket
+    void listenOn(const string& address) {
+        int fd;
+        if (address.find('/') != string::npos || address.rfind("unix:", 0) == 0) {
+            string path = address.rfind("unix:", 0) == 0 ? address.substr(5) : address;
+            sockaddr_un local{};
+            local.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(local.sun_path)) {
+                throw runtime_error("Socket path is too long: " + path);
+            }
+            memcpy(local.sun_path, path.c_str(), path.size() + 1);
+            
+            // A socket left behind by an earlier server is replaced
+            struct stat status;
+            if (stat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+                unlink(path.c_str());
+            }
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&local),
+                                 sizeof(local)) != 0) {
+                if (fd >= 0) close(fd);
+                throw runtime_error("Cannot listen on " + path + ": " + strerror(errno));
+            }
+            socketPath = path;
+        } else {
+            // "PORT" or "HOST:PORT"; the host defaults to the loopback address
+            size_t colon = address.rfind(':');
+            string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+            string port = colon == string::npos ? address : address.substr(colon + 1);
+            if (host == "localhost") host = "127.0.0.1";
+            
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_port = htons(static_cast<uint16_t>(strtoul(port.c_str(), nullptr, 10)));
+            if (inet_pton(AF_INET, host.c_str(), &local.sin_addr) != 1) {
+                throw runtime_error("Bad listen address: " + address);
+            }
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&local),
+                                 sizeof(local)) != 0) {
+                if (fd >= 0) close(fd);
+                throw runtime_error("Cannot listen on " + address + ": " + strerror(errno));
+            }
+            tcp = true;
+        }
+        if (listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            throw runtime_error("Cannot listen on " + address + ": " + strerror(errno));
+        }
+        listenFd = fd;
+    }
+
+public:
+    QueryServer(PrologDatabase& database, const TextParser& parser)
+        : db(database), prototype(parser) {}
+    
+    ~QueryServer() {
+        for (auto& entry : connections) close(entry.second.fd);
+        if (listenFd >= 0) close(listenFd);
+        if (epollFd >= 0) close(epollFd);
+        if (wakeFd >= 0) close(wakeFd);
+        if (!socketPath.empty()) unlink(socketPath.c_str());
+    }
+    
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+    
+    // Number of threads running requests
+    void setWorkers(size_t count) { workerCount = max<size_t>(count, 1); }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: open
+    // Purpose: Starts listening
+    // Parameters:
+    //   - address: A Unix socket path (with a "/" or "unix:" prefix), or a
+    //              TCP "PORT" or "HOST:PORT"
+    // Throws runtime_error if the address cannot be used
+    // ------------------------------------------------------------------------
+    void open(const string& address) {
+        listenOn(address);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            throw runtime_error(string("Cannot start the event loop: ") + strerror(errno));
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = LISTEN_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.data.u64 = WAKE_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    }
+    
+    // ------------------------------------------------------------------------
+    // METHOD: run
+    // Purpose: Serves clients until stop() is called
+    // ------------------------------------------------------------------------
+    void run() {
+        vector<thread> workers;
+        for (size_t w = 0; w < workerCount; w++) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+        
+        epoll_event events[256];
+        while (!stopping.load()) {
+            int count = epoll_wait(epollFd, events, 256, -1);
+            for (int i = 0; i < count; i++) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    acceptClients();
+                } else if (id == WAKE_ID) {
+                    collectReplies();
+                } else {
+                    auto it = connections.find(id);
+                    if (it == connections.end()) continue;
+                    if (events[i].events & EPOLLERR) it->second.failed = true;
+                    if ((it->second.events & EPOLLIN) &&
+                        (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                        receive(it->second);
+                    }
+                    service(id, it->second);
                 }
             }
         }
+        
+        {
+            lock_guard<mutex> lock(queueMutex);
+            shutdown = true;
+        }
+        queueReady.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+    
+    // Makes run() return; safe to call from a signal handler
+    void stop() {
+        stopping.store(true);
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
     }
 };
 
+#endif
+
+// Programs that reuse the classes above, like prolog_benchmark.cpp,
+// include this file with PROLOG_NO_MAIN defined
+#ifndef PROLOG_NO_MAIN
+#ifdef PROLOG_HAVE_EPOLL
+// The server that SIGINT and SIGTERM stop
+static QueryServer* runningServer = nullptr;
+
+static void stopServer(int) {
+    if (runningServer) runningServer->stop();
+}
+#endif
+
 // ============================================================================
 // MAIN FUNCTION
 // Purpose: Demonstrates the PROLOG text parser with example data and queries
 // ============================================================================
-int main() {
+int main(int argc, char* argv[]) {
+    // Command-line options
+    bool showStats = false;
+    bool showMemory = false;
+    size_t shardCount = 1;
+    ShardingMode shardingMode = ShardingMode::ByPredicate;
+    string grammarPath;
+    string gazetteerPath;
+    vector<string> ingestPaths;
+    vector<string> consultPaths;
+    vector<string> csvPaths;
+    bool csvHeader = false;
+    size_t ingestThreads = 1;
+    bool paragraphs = false;
+    string loadPath;
+    string savePath;
+    bool verifySnapshot = true;
+    string logPath;
+    WriteAheadLog::SyncPolicy syncPolicy = WriteAheadLog::SyncPolicy::Commit;
+    string exportPath;
+    ExportFormat exportFormat = ExportFormat::Prolog;
+    vector<string> exportPredicates;
+    string compressor;
+    string serveAddress;
+    GeneratorOptions generatorOptions;
+    bool generate = false;
+    string generatePath;
+    uint64_t questionCount = 0;
+    string metricsPath;
+    MetricsFormat metricsFormat = MetricsFormat::Text;
+    vector<pair<bool, string>> explains;  // (is a goal, text), in order
+    string tracePath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--stats") {
+            showStats = true;
+        } else if (arg == "--memory") {
+            showMemory = true;
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shardCount = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--shard-by-argument") {
+            shardingMode = ShardingMode::ByFirstArgument;
+        } else if (arg == "--grammar" && i + 1 < argc) {
+            grammarPath = argv[++i];
+        } else if (arg == "--gazetteer" && i + 1 < argc) {
+            gazetteerPath = argv[++i];
+        } else if (arg == "--ingest" && i + 1 < argc) {
+            ingestPaths.push_back(argv[++i]);
+        } else if (arg == "--consult" && i + 1 < argc) {
+            consultPaths.push_back(argv[++i]);
+        } else if (arg == "--csv" && i + 1 < argc) {
+            csvPaths.push_back(argv[++i]);
+        } else if (arg == "--header") {
+            csvHeader = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            ingestThreads = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--paragraphs") {
+            paragraphs = true;
+        } else if (arg == "--load" && i + 1 < argc) {
+            loadPath = argv[++i];
+        } else if (arg == "--save" && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (arg == "--no-verify") {
+            verifySnapshot = false;
+        } else if (arg == "--log" && i + 1 < argc) {
+            logPath = argv[++i];
+        } else if (arg == "--sync" && i + 1 < argc &&
+                   (string(argv[i + 1]) == "commit" ||
+                    string(argv[i + 1]) == "interval" ||
+                    string(argv[i + 1]) == "none")) {
+            string policy = argv[++i];
+            syncPolicy = policy == "commit" ? WriteAheadLog::SyncPolicy::Commit
+                       : policy == "interval" ? WriteAheadLog::SyncPolicy::Interval
+                       : WriteAheadLog::SyncPolicy::None;
+        } else if (arg == "--export" && i + 1 < argc) {
+            exportPath = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc &&
+                   (string(argv[i + 1]) == "prolog" ||
+                    string(argv[i + 1]) == "csv" ||
+                    string(argv[i + 1]) == "jsonl")) {
+            string name = argv[++i];
+            exportFormat = name == "prolog" ? ExportFormat::Prolog
+                         : name == "csv" ? ExportFormat::Csv
+                         : ExportFormat::JsonLines;
+        } else if (arg == "--only" && i + 1 < argc) {
+            exportPredicates.push_back(argv[++i]);
+        } else if (arg == "--compress" && i + 1 < argc) {
+            compressor = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveAddress = argv[++i];
+        } else if (arg == "--generate" && i + 1 < argc) {
+            generatorOptions.statements = strtoull(argv[++i], nullptr, 10);
+            generate = true;
+        } else if (arg == "--generate-to" && i + 1 < argc) {
+            generatePath = argv[++i];
+        } else if (arg == "--questions" && i + 1 < argc) {
+            questionCount = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            generatorOptions.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--generations" && i + 1 < argc) {
+            generatorOptions.generations = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--name-skew" && i + 1 < argc) {
+            generatorOptions.nameSkew = strtod(argv[++i], nullptr);
+        } else if (arg == "--city-skew" && i + 1 < argc) {
+            generatorOptions.citySkew = strtod(argv[++i], nullptr);
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (arg == "--metrics-format" && i + 1 < argc &&
+                   (string(argv[i + 1]) == "text" || string(argv[i + 1]) == "json")) {
+            metricsFormat = string(argv[++i]) == "json" ? MetricsFormat::Json
+                                                        : MetricsFormat::Text;
+        } else if (arg == "--no-metrics") {
+            Metrics::instance().setEnabled(false);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--explain" && i + 1 < argc) {
+            explains.emplace_back(false, argv[++i]);
+        } else if (arg == "--explain-goal" && i + 1 < argc) {
+            explains.emplace_back(true, argv[++i]);
+        } else {
+            cerr << "Unknown option: " << arg << "\n";
+            cerr << "Usage: " << argv[0]
+                 << " [--stats] [--shards N] [--shard-by-argument]"
+                 << " [--grammar FILE] [--gazetteer FILE]"
+                 << " [--ingest FILE]... [--consult FILE]..."
+                 << " [--csv FILE]... [--header] [--threads N]"
+                 << " [--paragraphs] [--load FILE] [--no-verify]"
+                 << " [--save FILE] [--log FILE]"
+                 << " [--sync commit|interval|none]"
+                 << " [--export FILE] [--format prolog|csv|jsonl]"
+                 << " [--only NAME[/ARITY]]... [--compress COMMAND]"
+                 << " [--serve SOCKET|[HOST:]PORT]"
+                 << " [--generate N] [--generate-to FILE] [--questions N]"
+                 << " [--seed N] [--generations N] [--name-skew X]"
+                 << " [--city-skew X] [--metrics FILE] [--metrics-format text|json]"
+                 << " [--no-metrics] [--explain QUESTION]..."
+                 << " [--explain-goal GOAL]... [--trace FILE] [--memory]\n";
+            return 1;
+        }
+    }
+    
+    if (!tracePath.empty()) {
+        Tracer::setEnabled(true);
+        Tracer::instance().setThreadName("main");
+    }
+    
     cout << "========================================\n";
     cout << "   PROLOG TEXT PARSER IN C++\n";
     cout << "========================================\n\n";
     
     // Create the PROLOG database
-    PrologDatabase prologDB;
+    PrologDatabase prologDB(shardCount, shardingMode);
     
     // Create parser and query engine
     TextParser parser(prologDB);
+    try {
+        if (!grammarPath.empty()) parser.loadGrammar(grammarPath);
+        if (!gazetteerPath.empty()) parser.loadGazetteer(gazetteerPath);
+        if (!loadPath.empty()) {
+            auto start = chrono::steady_clock::now();
+            prologDB.load(loadPath, verifySnapshot);
+            cerr << "Loaded " << loadPath << " in "
+                 << chrono::duration_cast<chrono::milliseconds>(
+                        chrono::steady_clock::now() - start).count()
+                 << " ms" << endl;
+        }
+        if (!logPath.empty()) {
+            size_t replayed = prologDB.openLog(logPath, syncPolicy);
+            if (replayed > 0) {
+                cerr << "Replayed " << replayed << " records from " << logPath
+                     << endl;
+            }
+        }
+    } catch (const runtime_error& e) {
+        cerr << e.what() << "\n";
+        return 1;
+    }
     QueryEngine queryEngine(prologDB);
     
+    // Writes the snapshot requested with --save; with a log, as a
+    // checkpoint that empties the log
+    auto saveSnapshot = [&] {
+        if (savePath.empty()) return true;
+        try {
+            if (logPath.empty()) {
+                prologDB.save(savePath);
+            } else {
+                prologDB.checkpoint(savePath);
+            }
+        } catch (const runtime_error& e) {
+            cerr << e.what() << "\n";
+            return false;
+        }
+        cerr << "Saved " << savePath << endl;
+        return true;
+    };
+    
+    // Writes the metrics report requested with --metrics ("-" for stdout)
+    auto writeMetrics = [&] {
+        if (metricsPath.empty()) return true;
+        if (metricsPath == "-") {
+            Metrics::instance().write(cout, metricsFormat);
+            return true;
+        }
+        ofstream out(metricsPath);
+        Metrics::instance().write(out, metricsFormat);
+        if (!out.flush()) {
+            cerr << "Cannot write metrics file: " << metricsPath << "\n";
+            return false;
+        }
+        return true;
+    };
+    
+    // Writes the timeline recorded for --trace
+    auto writeTrace = [&] {
+        if (tracePath.empty()) return true;
+        ofstream out(tracePath);
+        Tracer::instance().write(out);
+        if (!out.flush()) {
+            cerr << "Cannot write trace file: " << tracePath << "\n";
+            return false;
+        }
+        cerr << "Wrote trace " << tracePath << endl;
+        return true;
+    };
+    
+    // Profiles the questions and goals given with --explain and
+    // --explain-goal. A goal is written as in Prolog, e.g. parent(X, mary);
+    // a variable or ? matches anything.
+    auto explainAll = [&] {
+        for (const auto& request : explains) {
+            QueryProfile profile;
+            if (!request.first) {
+                profile = queryEngine.explain(request.second);
+            } else {
+                string goal = request.second;
+                while (!goal.empty() && (isspace((unsigned char)goal.back()) ||
+                                         goal.back() == '.')) {
+                    goal.pop_back();
+                }
+                size_t open = goal.find('(');
+                if (open != string::npos && goal.back() != ')') {
+                    cerr << "Cannot read goal: " << request.second << "\n";
+                    return false;
+                }
+                string predicate(trimAscii(goal.substr(0, open)));
+                vector<string> arguments;
+                if (open != string::npos) {
+                    stringstream list(goal.substr(open + 1, goal.size() - open - 2));
+                    for (string argument; getline(list, argument, ',');) {
+                        argument = string(trimAscii(argument));
+                        bool variable = argument.empty() || argument[0] == '_' ||
+                                        isupper((unsigned char)argument[0]);
+                        arguments.push_back(variable ? "?" : argument);
+                    }
+                }
+                profile = prologDB.explain(predicate, arguments);
+            }
+            cout << "\nEXPLAIN ANALYZE\n";
+            profile.write(cout);
+        }
+        return true;
+    };
+    
+    // Writes the export requested with --export
+    auto exportFacts = [&] {
+        if (exportPath.empty()) return true;
+        FactExporter exporter(prologDB);
+        exporter.setFormat(exportFormat);
+        exporter.setWorkers(ingestThreads);
+        exporter.setCompressor(compressor);
+        for (const string& predicate : exportPredicates) {
+            exporter.addPredicate(predicate);
+        }
+        try {
+            exporter.exportTo(exportPath);
+        } catch (const runtime_error& e) {
+            cerr << e.what() << "\n";
+            return false;
+        }
+        const ExportStats& total = exporter.stats();
+        cerr << "Exported " << total.facts << " facts of " << total.predicates
+             << " predicates (" << fixed << setprecision(1)
+             << total.bytes / 1048576.0 << " MiB) in " << total.seconds << "s"
+             << defaultfloat << setprecision(6) << endl;
+        return true;
+    };
+    
+    // Bulk mode: parse whole files (or just open a snapshot) instead of
+    // running the demo
+    if (!ingestPaths.empty() || !consultPaths.empty() || !csvPaths.empty() ||
+        !loadPath.empty() || !logPath.empty() || !serveAddress.empty() ||
+        generate) {
+        prologDB.setVerbose(false);
+        CorpusIngester ingester(parser);
+        ingester.setProgress(&cerr);
+        ingester.setWorkers(ingestThreads);
+        ingester.sentenceSegmenter().setLineBreaks(!paragraphs);
+        PrologReader reader(prologDB);
+        CsvLoader csvLoader(prologDB);
+        csvLoader.setWorkers(ingestThreads);
+        csvLoader.setHeader(csvHeader);
+        try {
+            for (const string& path : ingestPaths) {
+                cerr << "Reading " << path << endl;
+                ingester.ingestFile(path);
+            }
+            for (const string& path : consultPaths) {
+                cerr << "Consulting " << path << endl;
+                reader.consult(path);
+            }
+            for (const string& path : csvPaths) {
+                cerr << "Loading " << path << endl;
+                csvLoader.loadFile(path);
+            }
+            if (generate && !generatePath.empty()) {
+                // Write the corpus, and its questions next to it
+                CorpusGenerator generator(generatorOptions);
+                ofstream out(generatePath, ios::binary);
+                uint64_t count = generator.writeStatements(out);
+                ofstream questions;
+                if (questionCount > 0) {
+                    questions.open(generatePath + ".questions", ios::binary);
+                    for (uint64_t q = 0; q < questionCount; q++) {
+                        questions << generator.nextQuestion() << '\n';
+                    }
+                }
+                if (!out.flush() || (questionCount > 0 && !questions.flush())) {
+                    throw runtime_error("Error writing generated corpus: " + generatePath);
+                }
+                cerr << "Generated " << count << " statements in " << generatePath
+                     << endl;
+            } else if (generate) {
+                CorpusGenerator generator(generatorOptions);
+                CorpusGenerator::Reader source(generator);
+                istream in(&source);
+                cerr << "Reading " << generatorOptions.statements
+                     << " generated statements" << endl;
+                ingester.ingest(in);
+                
+                // Ask the questions against what was just read
+                auto started = chrono::steady_clock::now();
+                NullBuffer discard;
+                ostream answers(&discard);
+                QueryEngine engine(prologDB);
+                engine.setOutput(answers);
+                for (uint64_t q = 0; q < questionCount; q++) {
+                    engine.processQuery(generator.nextQuestion());
+                }
+                if (questionCount > 0) {
+                    double seconds = chrono::duration<double>(
+                        chrono::steady_clock::now() - started).count();
+                    cerr << "Answered " << questionCount << " questions in " << fixed
+                         << setprecision(2) << seconds << "s (" << setprecision(0)
+                         << questionCount / max(seconds, 1e-9) << "/s)" << defaultfloat
+                         << setprecision(6) << endl;
+                }
+            }
+        } catch (const runtime_error& e) {
+            cerr << e.what() << "\n";
+            return 1;
+        }
+        
+        if (!ingestPaths.empty() || (generate && generatePath.empty())) {
+            const IngestStats& total = ingester.stats();
+            cout << "Sentences: " << total.sentences << "\n";
+            cout << "Facts:     " << total.facts << "\n";
+            cout << "Unparsed:  " << total.sentences - total.facts << "\n";
+        }
+        if (!consultPaths.empty()) {
+            const ConsultStats& total = reader.stats();
+            cout << "Clauses:    " << total.clauses << "\n";
+            cout << "Facts:      " << total.facts << "\n";
+            cout << "Rules:      " << total.rules << " (not stored)\n";
+            cout << "Directives: " << total.directives << " (not stored)\n";
+            cout << "Non-ground: " << total.nonGround << " (not stored)\n";
+            cout << "Errors:     " << total.errors << "\n";
+        }
+        if (!csvPaths.empty()) {
+            const LoadStats& total = csvLoader.stats();
+            cout << "Rows:       " << total.rows << "\n";
+            cout << "Bad rows:   " << total.badRows << "\n";
+            cerr << "Loaded " << fixed << setprecision(1)
+                 << total.bytes / 1048576.0 << " MiB in " << total.seconds << "s ("
+                 << total.bytes / 1048576.0 / max(total.seconds, 1e-9) << " MiB/s)"
+                 << defaultfloat << setprecision(6) << endl;
+        }
+        if (showStats) prologDB.printStats();
+        if (showMemory) prologDB.printMemoryReport();
+        
+        if (!serveAddress.empty()) {
+#ifdef PROLOG_HAVE_EPOLL
+            parser.setVerbose(false);
+            QueryServer server(prologDB, parser);
+            server.setWorkers(ingestThreads);
+            try {
+                server.open(serveAddress);
+            } catch (const runtime_error& e) {
+                cerr << e.what() << "\n";
+                return 1;
+            }
+            runningServer = &server;
+            signal(SIGINT, stopServer);
+            signal(SIGTERM, stopServer);
+            cerr << "Serving on " << serveAddress << endl;
+            server.run();
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            runningServer = nullptr;
+            cerr << "Server stopped" << endl;
+#else
+            cerr << "Server mode is not supported on this platform\n";
+            return 1;
+#endif
+        }
+        return explainAll() && exportFacts() && saveSnapshot() && writeMetrics() &&
+               writeTrace() ? 0 : 1;
+    }
+    
     // =========================================================================
     // STEP 1: Parse natural language statements and add to database
     // =========================================================================
@@ -503,6 +10186,13 @@ int main() {
     // =========================================================================
     prologDB.printDatabase();
     
+    if (showStats) {
+        prologDB.printStats();
+    }
+    if (showMemory) {
+        prologDB.printMemoryReport();
+    }
+    
     // =========================================================================
     // STEP 3: Process natural language queries
     // =========================================================================
@@ -555,5 +10245,7 @@ int main() {
     cout << "   Program completed successfully!\n";
     cout << "========================================\n";
     
-    return 0;
+    return explainAll() && exportFacts() && saveSnapshot() && writeMetrics() &&
+           writeTrace() ? 0 : 1;
 }
+#endif  // PROLOG_NO_MAIN